@@ -0,0 +1,161 @@
+// backproject_kernel.h
+
+// inner loop of the backprojection: runs down one voxel column (all the slices at a
+// single x,y position) and adds the bilinear interpolated detector values to it.
+// For a fixed column the detector row (fy, dy) and the weight don't change, only the
+// detector column z_p, which is linear in the slice number.
+
+// requires FP_VAR to be defined before inclusion
+
+#ifndef _BACKPROJECT_KERNEL_H
+#define _BACKPROJECT_KERNEL_H
+
+#include <cmath>
+#include <algorithm>
+
+#include "cpu_features.h"
+
+using namespace std;
+
+// acc[i] += scale * bilinear(row0,row1,dy,z_p(i)) for i_start <= i < i_end
+// where z_p(i) = zp0 + i*dzp is in detector pixels, and row0/row1 are detector rows fy and fy+1.
+// The caller clips [i_start,i_end) so that 0 < floor(z_p) < det_cols-1 (see ProjectionGeometry),
+// so there are no bounds checks in the loop.
+typedef void (*SliceKernel)(FP_VAR* acc, const FP_VAR* row0, const FP_VAR* row1, double dy,
+							double zp0, double dzp, double scale, int det_cols, int i_start, int i_end);
+
+// reference version, double precision, same arithmetic as the original loop
+void SliceKernelScalar(FP_VAR* acc, const FP_VAR* row0, const FP_VAR* row1, double dy,
+					   double zp0, double dzp, double scale, int det_cols, int i_start, int i_end)
+{
+	int i;
+	int fz;
+	double z_p, dz;
+
+	for(i=i_start;i<i_end;i++)
+	{
+		z_p = zp0 + i*dzp;
+		fz = (int)floor(z_p);
+		dz = z_p - fz;
+		fz = min(max(fz, 1), det_cols - 2);	// only matters if rounding differs from the clipping
+
+		acc[i] += scale *
+				  (row0[fz] * (1-dy) * (1-dz) +	// bilinear interpolation
+				  row1[fz] * dy * (1-dz) +
+				  row0[fz+1] * (1-dy) * dz +
+				  row1[fz+1] * dy * dz);
+	}
+}
+
+#ifdef CT_SIMD_X86
+
+// 8 slices at a time, single precision with gathers from the two detector rows
+TARGET_AVX2 void SliceKernelAVX2(FP_VAR* acc, const FP_VAR* row0, const FP_VAR* row1, double dy,
+								 double zp0, double dzp, double scale, int det_cols, int i_start, int i_end)
+{
+	float* f_acc = (float*)acc;
+	const float* f_row0 = (const float*)row0;
+	const float* f_row1 = (const float*)row1;
+
+	const __m256 lane = _mm256_setr_ps(0,1,2,3,4,5,6,7);
+	const __m256 v_dzp = _mm256_set1_ps((float)dzp);
+	const __m256 v_dy = _mm256_set1_ps((float)dy);
+	const __m256 v_scale = _mm256_set1_ps((float)scale);
+	const __m256i v_first = _mm256_set1_epi32(1);
+	const __m256i v_last = _mm256_set1_epi32(det_cols - 2);
+
+	int i = i_start;
+	for(;i+8<=i_end;i+=8)
+	{
+		// the start of each block is done in double so the error doesn't build up along the column
+		__m256 z_p = _mm256_fmadd_ps(lane, v_dzp, _mm256_set1_ps((float)(zp0 + i*dzp)));
+		__m256 flr = _mm256_floor_ps(z_p);
+		__m256 dz = _mm256_sub_ps(z_p, flr);
+		__m256i fz = _mm256_cvttps_epi32(flr);
+
+		// the range was clipped in double precision, the clamp only guards against
+		// single precision rounding pushing an edge slice off the detector
+		fz = _mm256_min_epi32(_mm256_max_epi32(fz, v_first), v_last);
+
+		__m256 p00 = _mm256_i32gather_ps(f_row0, fz, 4);
+		__m256 p01 = _mm256_i32gather_ps(f_row0 + 1, fz, 4);
+		__m256 p10 = _mm256_i32gather_ps(f_row1, fz, 4);
+		__m256 p11 = _mm256_i32gather_ps(f_row1 + 1, fz, 4);
+
+		__m256 p0 = _mm256_fmadd_ps(dz, _mm256_sub_ps(p01, p00), p00);
+		__m256 p1 = _mm256_fmadd_ps(dz, _mm256_sub_ps(p11, p10), p10);
+		__m256 p = _mm256_fmadd_ps(v_dy, _mm256_sub_ps(p1, p0), p0);
+
+		_mm256_storeu_ps(f_acc + i, _mm256_fmadd_ps(p, v_scale, _mm256_loadu_ps(f_acc + i)));
+	}
+
+	SliceKernelScalar(acc, row0, row1, dy, zp0, dzp, scale, det_cols, i, i_end);
+}
+
+// 16 slices at a time
+TARGET_AVX512 void SliceKernelAVX512(FP_VAR* acc, const FP_VAR* row0, const FP_VAR* row1, double dy,
+									 double zp0, double dzp, double scale, int det_cols, int i_start, int i_end)
+{
+	float* f_acc = (float*)acc;
+	const float* f_row0 = (const float*)row0;
+	const float* f_row1 = (const float*)row1;
+
+	const __m512 lane = _mm512_setr_ps(0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15);
+	const __m512 v_dzp = _mm512_set1_ps((float)dzp);
+	const __m512 v_dy = _mm512_set1_ps((float)dy);
+	const __m512 v_scale = _mm512_set1_ps((float)scale);
+	const __m512i v_first = _mm512_set1_epi32(1);
+	const __m512i v_last = _mm512_set1_epi32(det_cols - 2);
+
+	int i = i_start;
+	for(;i+16<=i_end;i+=16)
+	{
+		__m512 z_p = _mm512_fmadd_ps(lane, v_dzp, _mm512_set1_ps((float)(zp0 + i*dzp)));
+		__m512 flr = _mm512_roundscale_ps(z_p, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+		__m512 dz = _mm512_sub_ps(z_p, flr);
+		__m512i fz = _mm512_cvttps_epi32(flr);
+		fz = _mm512_min_epi32(_mm512_max_epi32(fz, v_first), v_last);
+
+		__m512 p00 = _mm512_i32gather_ps(fz, f_row0, 4);
+		__m512 p01 = _mm512_i32gather_ps(fz, f_row0 + 1, 4);
+		__m512 p10 = _mm512_i32gather_ps(fz, f_row1, 4);
+		__m512 p11 = _mm512_i32gather_ps(fz, f_row1 + 1, 4);
+
+		__m512 p0 = _mm512_fmadd_ps(dz, _mm512_sub_ps(p01, p00), p00);
+		__m512 p1 = _mm512_fmadd_ps(dz, _mm512_sub_ps(p11, p10), p10);
+		__m512 p = _mm512_fmadd_ps(v_dy, _mm512_sub_ps(p1, p0), p0);
+
+		_mm512_storeu_ps(f_acc + i, _mm512_fmadd_ps(p, v_scale, _mm512_loadu_ps(f_acc + i)));
+	}
+
+	SliceKernelScalar(acc, row0, row1, dy, zp0, dzp, scale, det_cols, i, i_end);
+}
+
+#endif
+
+// picks the fastest kernel the cpu can run, capped at max_level
+SliceKernel SelectSliceKernel(simd_level max_level)
+{
+	if(sizeof(FP_VAR) != sizeof(float))	// vector kernels are single precision only
+		return SliceKernelScalar;
+
+#ifdef CT_SIMD_X86
+	simd_level level = GetSIMDLevel();
+	if(max_level < level)
+		level = max_level;
+
+	switch(level)
+	{
+	case SIMD_AVX512:
+		return SliceKernelAVX512;
+	case SIMD_AVX2:
+		return SliceKernelAVX2;
+	default:
+		break;
+	}
+#endif
+
+	return SliceKernelScalar;
+}
+
+#endif
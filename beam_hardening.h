@@ -0,0 +1,319 @@
+// beam_hardening.h
+
+// empirical beam hardening correction. A correction maps the measured attenuation
+// P = log(blank/count) to the corrected one, and is either a polynomial with no constant term
+// or a monotone cubic spline through measured points. There's one for each kVp, filter and
+// scanner the calibration knows about, read from a file with LoadBHCalibration. Until one is
+// loaded the 45, 55 and 65 kVp polynomials the reconstruction has always used are there.
+//
+// calibration file, one correction per line, # starts a comment:
+//   <kVp> <filter> <scanner> poly <c1> <c2> ... <cn>           c1*P + c2*P^2 + ... + cn*P^n
+//   <kVp> <filter> <scanner> spline <P1> <Q1> <P2> <Q2> ...    through each (Pi,Qi) and (0,0)
+// filter and scanner are compared with the DICOM Filter Type (0018,1160) and Station Name
+// (0008,1010), * matches anything. The most specific line that matches a scan is used, the
+// first one if there's a tie. Spline points have to be in increasing order of P, with Q not
+// decreasing. (0,0) is added unless there's a point at P = 0, and outside the points the spline
+// carries on in a straight line.
+//
+// Projection compiles the correction for its scan into a BHTable covering every attenuation
+// 16 bit counts can give, so Preprocess applies it with one table fetch per pixel.
+
+// requires FP_VAR to be defined before inclusion
+
+#ifndef _BEAM_HARDENING_H
+#define _BEAM_HARDENING_H
+
+#include <cmath>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+
+using namespace std;
+
+class BHCurve
+{
+public:
+	int kVp;
+	string filter;		// * for any
+	string scanner;
+	bool spline;
+	vector<double> coef;	// polynomial, coef[k] multiplies P^(k+1)
+	vector<double> x, y;	// spline points, including one at P = 0
+	vector<double> slope;	// spline tangents at the points
+
+	double Evaluate(double P) const;	// corrected attenuation
+	bool SetSpline(const vector<double>& points);	// P1,Q1,P2,Q2... false if they aren't monotone
+};
+
+double BHCurve::Evaluate(double P) const
+{
+	int k,n;
+	double r,h,t;
+
+	if(!spline)
+	{
+		r = 0;
+		for(k=(int)coef.size()-1;k>=0;k--)
+			r = r*P + coef[k];
+		return r*P;
+	}
+
+	n = (int)x.size();
+	if(P <= x[0])
+		return y[0] + slope[0]*(P - x[0]);
+	if(P >= x[n-1])
+		return y[n-1] + slope[n-1]*(P - x[n-1]);
+
+	// cubic hermite on the interval P is in
+	k = int(upper_bound(x.begin(), x.end(), P) - x.begin()) - 1;
+	h = x[k+1] - x[k];
+	t = (P - x[k]) / h;
+	return (2*t*t*t - 3*t*t + 1) * y[k] + (t*t*t - 2*t*t + t) * h * slope[k] +
+		   (-2*t*t*t + 3*t*t) * y[k+1] + (t*t*t - t*t) * h * slope[k+1];
+}
+
+bool BHCurve::SetSpline(const vector<double>& points)
+{
+	int k,n;
+	vector<double> d;
+	double a,b,s;
+	bool zero = false;		// (0,0) or another point at P = 0 is in
+
+	spline = true;
+	x.clear();
+	y.clear();
+	if(points.size() < 2 || points.size() % 2)
+		return false;
+
+	for(k=0;k<(int)points.size();k+=2)
+	{
+		if(!zero && points[k] >= 0)
+		{
+			if(points[k] > 0)
+			{
+				x.push_back(0);
+				y.push_back(0);
+			}
+			zero = true;
+		}
+		x.push_back(points[k]);
+		y.push_back(points[k+1]);
+	}
+	if(!zero)
+	{
+		x.push_back(0);
+		y.push_back(0);
+	}
+
+	n = (int)x.size();
+	for(k=0;k<n-1;k++)
+		if(x[k+1] <= x[k] || y[k+1] < y[k])
+			return false;
+
+	// Fritsch-Carlson tangents, which keep the spline monotone between the points
+	d.resize(n-1);
+	for(k=0;k<n-1;k++)
+		d[k] = (y[k+1] - y[k]) / (x[k+1] - x[k]);
+	slope.resize(n);
+	slope[0] = d[0];
+	slope[n-1] = d[n-2];
+	for(k=1;k<n-1;k++)
+		slope[k] = d[k-1]*d[k] > 0 ? (d[k-1] + d[k]) / 2 : 0;
+	for(k=0;k<n-1;k++)
+	{
+		if(d[k] == 0)
+		{
+			slope[k] = slope[k+1] = 0;
+			continue;
+		}
+		a = slope[k] / d[k];
+		b = slope[k+1] / d[k];
+		if(a*a + b*b > 9)
+		{
+			s = 3 / sqrt(a*a + b*b);
+			slope[k] = s * a * d[k];
+			slope[k+1] = s * b * d[k];
+		}
+	}
+
+	return true;
+}
+
+class BHCalibration
+{
+public:
+	BHCalibration();
+
+	bool Load(const char* filename);	// replaces the curves, keeps the old ones if the file has errors
+	void LoadDefaults();
+
+	// the best match for a scan, NULL if there's no curve for its kVp
+	const BHCurve* Find(int kVp, const char* filter, const char* scanner);
+
+private:
+	vector<BHCurve> curves;
+};
+
+BHCalibration::BHCalibration()
+{
+	LoadDefaults();
+}
+
+void BHCalibration::LoadDefaults()
+{
+	const int kVps[] = {45, 55, 65};
+	const double coefs[3][3] = {{0.8346, 0.1656, 0.0069},
+								{0.8260, 0.2111, -0.0042},
+								{0.8159, 0.2636, -0.0195}};
+	BHCurve curve;
+
+	curves.clear();
+	curve.filter = "*";
+	curve.scanner = "*";
+	curve.spline = false;
+	for(int i=0;i<3;i++)
+	{
+		curve.kVp = kVps[i];
+		curve.coef.assign(coefs[i], coefs[i] + 3);
+		curves.push_back(curve);
+	}
+}
+
+bool BHCalibration::Load(const char* filename)
+{
+	ifstream f(filename);
+	string line, type;
+	vector<BHCurve> loaded;
+	vector<double> values;
+	double v;
+	int line_num = 0;
+
+	if(!f.is_open())
+	{
+		cout << "Error: can't open beam hardening calibration " << filename << endl;
+		return false;
+	}
+
+	while(getline(f, line))
+	{
+		line_num++;
+		line = line.substr(0, line.find('#'));
+
+		istringstream ss(line);
+		BHCurve curve;
+		if(!(ss >> curve.kVp))
+		{
+			if(line.find_first_not_of(" \t\r") == string::npos)
+				continue;	// blank line or comment
+			cout << "Error: " << filename << " line " << line_num << ": expected a kVp" << endl;
+			return false;
+		}
+
+		values.clear();
+		ss >> curve.filter >> curve.scanner >> type;
+		while(ss >> v)
+			values.push_back(v);
+		if(!ss.eof() || values.empty())
+		{
+			cout << "Error: " << filename << " line " << line_num << ": expected <kVp> <filter> <scanner> poly|spline <values>" << endl;
+			return false;
+		}
+
+		if(type == "poly")
+		{
+			curve.spline = false;
+			curve.coef = values;
+		}
+		else if(type != "spline")
+		{
+			cout << "Error: " << filename << " line " << line_num << ": unknown correction " << type << ", expected poly or spline" << endl;
+			return false;
+		}
+		else if(!curve.SetSpline(values))
+		{
+			cout << "Error: " << filename << " line " << line_num << ": spline points must be P,Q pairs in increasing order" << endl;
+			return false;
+		}
+
+		loaded.push_back(curve);
+	}
+
+	curves.swap(loaded);
+	return true;
+}
+
+const BHCurve* BHCalibration::Find(int kVp, const char* filter, const char* scanner)
+{
+	const BHCurve* best = NULL;
+	int score, best_score = -1;
+
+	for(size_t i=0;i<curves.size();i++)
+	{
+		const BHCurve& c = curves[i];
+		if(c.kVp != kVp || (c.filter != "*" && c.filter != filter) || (c.scanner != "*" && c.scanner != scanner))
+			continue;
+		score = (c.filter != "*") + (c.scanner != "*");
+		if(score > best_score)
+		{
+			best = &c;
+			best_score = score;
+		}
+	}
+
+	return best;
+}
+
+// the calibration every Projection looks its correction up in
+BHCalibration& GetBHCalibration()
+{
+	static BHCalibration calibration;
+	return calibration;
+}
+
+// loads a calibration file for the Projections constructed after it, NULL goes back to the built in curves
+bool LoadBHCalibration(const char* filename)
+{
+	if(!filename)
+	{
+		GetBHCalibration().LoadDefaults();
+		return true;
+	}
+	return GetBHCalibration().Load(filename);
+}
+
+// a correction sampled over every attenuation a 16 bit count and blank can give,
+// -log(65535) to log(65535), and interpolated linearly between the samples.
+// Attenuations outside that (a count or blank of 0) get the value at the nearest end.
+const int BH_TABLE_SIZE = 65536;	// intervals
+
+struct BHTable
+{
+	FP_VAR lo;			// attenuation at the first sample
+	FP_VAR scale;		// intervals per unit attenuation
+	FP_VAR *entries;	// value at the start of each interval and the change over it, in pairs
+};
+
+void BuildBHTable(BHTable* table, const BHCurve& curve)
+{
+	double max_P = log(65535.0);
+	double h = 2*max_P / BH_TABLE_SIZE;
+	double v, next;
+
+	table->lo = FP_VAR(-max_P);
+	table->scale = FP_VAR(1/h);
+	table->entries = new FP_VAR[2*BH_TABLE_SIZE];
+
+	next = curve.Evaluate(-max_P);
+	for(int i=0;i<BH_TABLE_SIZE;i++)
+	{
+		v = next;
+		next = curve.Evaluate(-max_P + (i+1)*h);
+		table->entries[2*i] = FP_VAR(v);
+		table->entries[2*i+1] = FP_VAR(next - v);
+	}
+}
+
+#endif
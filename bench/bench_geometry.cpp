@@ -0,0 +1,163 @@
+// bench_geometry.cpp
+
+// microbenchmark for the per-projection geometry tables. Backprojects one synthetic
+// projection into a volume three ways:
+//   inline  - the original loop, recomputing the geometry for every voxel
+//   table   - ProjectionGeometry (with the slices clipped to the detector) + scalar slice kernel
+//   simd    - ProjectionGeometry + the fastest slice kernel for this cpu
+//
+// builds on its own, e.g.
+//   g++ -O2 -std=c++11 -I.. bench_geometry.cpp -o bench_geometry
+//   bench_geometry [volume size] [detector size]
+
+#define _USE_MATH_DEFINES
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <chrono>
+#include <algorithm>
+
+typedef float FP_VAR;
+
+#include "geometry.h"
+#include "backproject_kernel.h"
+
+using namespace std;
+
+static double Seconds(chrono::steady_clock::time_point start)
+{
+	return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// the loop as it was before the geometry tables
+static void BackprojectInline(FP_VAR* vol, FP_VAR** pd, const ScanGeometry& scan, int n,
+							  const double* x, const double* y, const double* z,
+							  double cos_theta, double sin_theta, double YOffset, double ZOffset)
+{
+	int i,j,k;
+	double x_r, y_r, y_p, z_p, dy, dz, scale;
+	int fy, fz;
+
+	for(j=0;j<n;j++)
+		for(k=0;k<n;k++)
+		{
+			x_r = x[k] * cos_theta + y[j] * sin_theta;
+			y_r = -x[k] * sin_theta + y[j] * cos_theta;
+			y_p = y_r * (scan.sourceToDetector/(scan.sourceToAxis + x_r)) + YOffset;
+			y_p = ((scan.det_rows-1.0)/2.0) - (y_p/scan.detectorRes);
+
+			scale = scan.sourceToAxis /(scan.sourceToAxis - x_r);
+			scale *= scale;
+
+			for(i=0;i<n;i++)
+			{
+				z_p = z[i] * (scan.sourceToDetector/(scan.sourceToAxis + x_r)) + ZOffset;
+				z_p = (z_p/scan.detectorRes) + ((scan.det_cols-1.0)/2.0);
+
+				fy = floor(y_p);
+				fz = floor(z_p);
+				dy = y_p - fy;
+				dz = z_p - fz;
+
+				if( (fy>0) && (fy < (scan.det_rows - 1)) && (fz>0) && (fz<(scan.det_cols - 1)) )
+					vol[((size_t)j*n + k)*n + i] += scale *
+								  (pd[fy][fz] * (1-dy) * (1-dz) +
+								  pd[fy+1][fz] * dy * (1-dz) +
+								  pd[fy][fz+1] * (1-dy) * dz +
+								  pd[fy+1][fz+1] * dy * dz);
+			}
+		}
+}
+
+static void BackprojectTable(FP_VAR* vol, FP_VAR** pd, const ScanGeometry& scan, int n, ProjectionGeometry& geom,
+							 double cos_theta, double sin_theta, double YOffset, double ZOffset, SliceKernel kernel)
+{
+	int j,k;
+	ColumnGeometry* c;
+
+	geom.Compute(scan, cos_theta, sin_theta, YOffset, ZOffset, 0, n);
+	for(j=0;j<n;j++)
+		for(k=0;k<n;k++)
+		{
+			c = &geom(j,k);
+			if(c->i_start >= c->i_end)
+				continue;
+			kernel(vol + ((size_t)j*n + k)*n, pd[c->fy], pd[c->fy+1], c->dy, c->zp0, c->dzp, c->scale, scan.det_cols, c->i_start, c->i_end);
+		}
+}
+
+int main(int argc, char* argv[])
+{
+	int n = 256;		// volume is n^3
+	int det = 512;		// detector is det x det
+	int num_proj = 8;
+	int i,j,p;
+
+	if(argc > 1)
+		n = atoi(argv[1]);
+	if(argc > 2)
+		det = atoi(argv[2]);
+
+	ScanGeometry scan;
+	scan.sourceToDetector = 400;
+	scan.sourceToAxis = 300;
+	scan.detectorRes = 0.1;
+	scan.det_rows = det;
+	scan.det_cols = det;
+
+	double res = 0.8 * det * scan.detectorRes * scan.sourceToAxis / scan.sourceToDetector / n;
+
+	double* x = new double[n];
+	double* y = new double[n];
+	double* z = new double[n];
+	for(i=0;i<n;i++)
+		x[i] = y[i] = z[i] = res * (i - (n-1.0)/2);
+
+	FP_VAR** pd = new FP_VAR*[det];
+	for(i=0;i<det;i++)
+	{
+		pd[i] = new FP_VAR[det];
+		for(j=0;j<det;j++)
+			pd[i][j] = (FP_VAR)(sin(i*0.05) * cos(j*0.03));
+	}
+
+	size_t voxels = (size_t)n*n*n;
+	FP_VAR* vol_ref = new FP_VAR[voxels];
+	FP_VAR* vol = new FP_VAR[voxels];
+	ProjectionGeometry geom(n, n, n, x, y, z[0], res);
+
+	const char* names[] = {"inline", "table", "simd"};
+	double times[3] = {0,0,0};
+	double max_err[3] = {0,0,0};
+
+	for(int method=0;method<3;method++)
+	{
+		FP_VAR* v = method ? vol : vol_ref;
+		memset(v, 0, voxels*sizeof(FP_VAR));
+		SliceKernel kernel = (method == 2) ? SelectSliceKernel(SIMD_AVX512) : SliceKernelScalar;
+
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		for(p=0;p<num_proj;p++)
+		{
+			double angle = M_PI * (p * 360.0/num_proj + 90) / 180;
+			if(method == 0)
+				BackprojectInline(v, pd, scan, n, x, y, z, cos(angle), sin(angle), 0.1, -0.2);
+			else
+				BackprojectTable(v, pd, scan, n, geom, cos(angle), sin(angle), 0.1, -0.2, kernel);
+		}
+		times[method] = Seconds(start);
+
+		if(method)
+			for(size_t v_i=0;v_i<voxels;v_i++)
+				max_err[method] = max(max_err[method], (double)fabs(vol[v_i] - vol_ref[v_i]));
+	}
+
+	printf("volume %d^3, detector %dx%d, %d projections, simd level %d\n", n, det, det, num_proj, GetSIMDLevel());
+	for(i=0;i<3;i++)
+		printf("%-8s %8.3f s  %8.1f Mvoxel/s  speedup %5.2fx  max diff %g\n", names[i], times[i],
+			   voxels * num_proj / times[i] / 1e6, times[0] / times[i], max_err[i]);
+
+	return 0;
+}
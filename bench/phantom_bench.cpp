@@ -0,0 +1,850 @@
+// phantom_bench.cpp
+
+// end to end benchmark that doesn't need scanner data. Forward projects a 3D Shepp-Logan
+// phantom (sum of ellipsoids, so the line integrals are exact) with the same geometry
+// conventions as Projection/Reconstruction, writes it out as DICOM projections plus a
+// blank scan the loader accepts, then times every stage of a reconstruction:
+//   Projection   - constructor (reads the header and blank scan)
+//   load         - LoadNextProj for every projection (DICOM parse, log, beam hardening)
+//   filter       - Filter for every projection
+//   backproject  - Reconstruction::Backproject (pipelined, includes its own load/filter)
+//   dicom        - Reconstruction::WriteDicom
+// and reports voxels/second and the RMSE against the phantom (after a least squares
+// scale fit, the reconstruction isn't in absolute units) for each volume size.
+// Before that it checks Filter against FilterReference (the original complex FFT
+// convolution) on one of the phantom projections, for every filter type and both
+// FFT backends, Preprocess against PreprocessReference, that a reconstruction from the
+// sinogram cache, or metal removal from the projection stack, is the same as one without it,
+// and metal removal (linear and NMAR) on the phantom with metal spheres added.
+//
+// builds with the command line version, e.g.
+//   g++ -O2 -std=c++11 -pthread -I.. phantom_bench.cpp ../fft.cpp -o phantom_bench
+//   phantom_bench [work dir] [volume sizes, e.g. 64,128,256] [projections] [detector size]
+
+#define _USE_MATH_DEFINES
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+#include <sstream>
+#include <iostream>
+
+#include "ct_recon_win.h"
+
+#ifdef _WIN32
+#include <direct.h>
+#define MakeDir(d) _mkdir(d)
+#else
+#include <sys/stat.h>
+#define MakeDir(d) mkdir(d, 0755)
+#endif
+
+using namespace std;
+
+// scan geometry, roughly the nanoSPECT CT
+static const double sourceToAxis = 100.0;		// mm
+static const double sourceToDetector = 150.0;
+static const double phantomRadius = 7.0;		// the unit phantom is scaled to this, in mm
+static const double muScale = 0.02;				// attenuation (1/mm) of a phantom value of 1
+static const double blankCounts = 50000.0;
+static const int kVp = 50;						// no built in beam hardening correction for 50kVp
+
+struct Ellipsoid
+{
+	double rho;			// value added inside
+	double a, b, c;		// semi-axes
+	double x0, y0, z0;	// centre
+	double phi;			// rotation about z, degrees
+};
+
+// modified 3D Shepp-Logan, in units of the phantom radius
+static const Ellipsoid shepp_logan[] = {
+	{ 1.0, .6900, .920, .810,   0.0,    0.0,   0.0,   0},
+	{-0.8, .6624, .874, .780,   0.0, -.0184,   0.0,   0},
+	{-0.2, .1100, .310, .220,   .22,    0.0,   0.0, -18},
+	{-0.2, .1600, .410, .280,  -.22,    0.0,   0.0,  18},
+	{ 0.1, .2100, .250, .410,   0.0,    .35,  -.15,   0},
+	{ 0.1, .0460, .046, .050,   0.0,     .1,   .25,   0},
+	{ 0.1, .0460, .046, .050,   0.0,    -.1,   .25,   0},
+	{ 0.1, .0460, .023, .050,  -.08,  -.605,   0.0,   0},
+	{ 0.1, .0230, .023, .020,   0.0,  -.606,   0.0,   0},
+	{ 0.1, .0230, .046, .020,   .06,  -.605,   0.0,   0}
+};
+static const int num_ellipsoids = sizeof(shepp_logan)/sizeof(shepp_logan[0]);
+
+// two small, very dense spheres in the brain, for CheckMetal
+static const Ellipsoid metal_spheres[] = {
+	{40.0, .0500, .050, .050,    .3,     .2,   0.0,   0},
+	{40.0, .0500, .050, .050,   -.3,     .2,   0.0,   0}
+};
+static const int num_metal_spheres = sizeof(metal_spheres)/sizeof(metal_spheres[0]);
+static bool phantom_metal = false;		// the metal spheres are part of the phantom
+
+static int NumEllipsoids()
+{
+	return num_ellipsoids + (phantom_metal ? num_metal_spheres : 0);
+}
+
+static const Ellipsoid& GetEllipsoid(int e)
+{
+	return e < num_ellipsoids ? shepp_logan[e] : metal_spheres[e - num_ellipsoids];
+}
+
+// (x,y,z) in mm is within margin mm of a metal sphere
+static bool NearMetal(double x, double y, double z, double margin)
+{
+	for(int e=0;e<num_metal_spheres;e++)
+	{
+		const Ellipsoid& el = metal_spheres[e];
+		double dx = x - el.x0*phantomRadius, dy = y - el.y0*phantomRadius, dz = z - el.z0*phantomRadius;
+		double r = el.a*phantomRadius + margin;
+		if(dx*dx + dy*dy + dz*dz < r*r)
+			return true;
+	}
+
+	return false;
+}
+
+static double Seconds(chrono::steady_clock::time_point start)
+{
+	return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// phantom value at (x,y,z) in mm
+static double PhantomValue(double x, double y, double z)
+{
+	double value = 0;
+
+	for(int e=0;e<NumEllipsoids();e++)
+	{
+		const Ellipsoid& el = GetEllipsoid(e);
+		double c = cos(el.phi*M_PI/180), s = sin(el.phi*M_PI/180);
+		double px = x/phantomRadius - el.x0;
+		double py = y/phantomRadius - el.y0;
+		double pz = z/phantomRadius - el.z0;
+		double qx = (c*px + s*py)/el.a;
+		double qy = (-s*px + c*py)/el.b;
+		double qz = pz/el.c;
+		if(qx*qx + qy*qy + qz*qz <= 1)
+			value += el.rho;
+	}
+
+	return value;
+}
+
+// integral of the phantom along the segment from p to p+d (mm), in phantom units * mm
+static double LineIntegral(const double p[3], const double d[3])
+{
+	double total = 0;
+	double len = sqrt(d[0]*d[0] + d[1]*d[1] + d[2]*d[2]);
+
+	for(int e=0;e<NumEllipsoids();e++)
+	{
+		const Ellipsoid& el = GetEllipsoid(e);
+		double c = cos(el.phi*M_PI/180), s = sin(el.phi*M_PI/180);
+
+		// move to the frame where the ellipsoid is the unit sphere
+		double px = p[0]/phantomRadius - el.x0, py = p[1]/phantomRadius - el.y0, pz = p[2]/phantomRadius - el.z0;
+		double dx = d[0]/phantomRadius, dy = d[1]/phantomRadius, dz = d[2]/phantomRadius;
+		double sx = (c*px + s*py)/el.a, sy = (-s*px + c*py)/el.b, sz = pz/el.c;
+		double ux = (c*dx + s*dy)/el.a, uy = (-s*dx + c*dy)/el.b, uz = dz/el.c;
+
+		double A = ux*ux + uy*uy + uz*uz;
+		double B = sx*ux + sy*uy + sz*uz;
+		double C = sx*sx + sy*sy + sz*sz - 1;
+		double disc = B*B - A*C;
+		if(disc <= 0)
+			continue;
+
+		// the whole chord lies between the source and the detector
+		total += el.rho * len * 2*sqrt(disc)/A;
+	}
+
+	return total;
+}
+
+struct HeaderTag
+{
+	unsigned short group, element;
+	const char* vr;
+	const char* value;	// FD tags are written as 0
+};
+
+static const HeaderTag header_tags[] = {
+	{0x0008,0x0020,"DA","20260101"}, {0x0008,0x002a,"DT","20260101120000"}, {0x0008,0x0030,"TM","120000"},
+	{0x0008,0x0050,"SH","PHANTOM"}, {0x0008,0x0060,"CS","CT"}, {0x0008,0x0070,"LO","Synthetic"},
+	{0x0008,0x1010,"SH","BENCH"}, {0x0008,0x1030,"LO","Shepp-Logan"}, {0x0008,0x1090,"LO","phantom_bench"},
+	{0x0010,0x0010,"PN","Phantom^SheppLogan"}, {0x0010,0x0020,"LO","PHANTOM"}, {0x0010,0x0030,"DA","20260101"},
+	{0x0010,0x0040,"CS","O"}, {0x0010,0x1020,"DS","0"}, {0x0010,0x1030,"DS","0"},
+	{0x0018,0x1120,"DS","0"}, {0x0018,0x1130,"DS","0"}, {0x0018,0x1140,"CS","CW"},
+	{0x0018,0x1150,"IS","0"}, {0x0018,0x1152,"IS","0"}, {0x0018,0x1160,"SH","NONE"},
+	{0x0018,0x1170,"IS","0"}, {0x0018,0x5100,"CS","FFS"}, {0x0018,0x8151,"DS","0"},
+	{0x0018,0x9305,"FD",NULL}, {0x0018,0x9307,"FD",NULL}, {0x0018,0x9309,"FD",NULL},
+	{0x0018,0x9311,"FD",NULL}, {0x0018,0x9327,"FD",NULL}, {0x0018,0x9345,"FD",NULL},
+	{0x0020,0x000d,"UI","1.2.826.0.1.3680043.2.1125.1"}, {0x0020,0x000e,"UI","1.2.826.0.1.3680043.2.1125.1.1"},
+	{0x0020,0x0010,"SH","1"},
+	{0x0020,0x0011,"IS","1"}, {0x0020,0x0012,"IS","1"}
+};
+static const int num_header_tags = sizeof(header_tags)/sizeof(header_tags[0]);
+
+static void AddElement(RootDicomObj* dcm, unsigned short group, unsigned short element, const char* vr,
+					   unsigned long len, const void* value)
+{
+	dcm->SetElement(new DataElement(group, element, vr, len, value));
+}
+
+static void AddString(RootDicomObj* dcm, unsigned short group, unsigned short element, const char* vr, const char* value)
+{
+	AddElement(dcm, group, element, vr, strlen(value), value);
+}
+
+// writes one projection (or the blank scan if angle < 0) with the tags Projection reads
+static bool WriteProjection(const char* filename, const unsigned short* pixels, int rows, int cols, int num_proj,
+							double detectorRes, const float* YOffset, const float* ZOffset, double angle)
+{
+	RootDicomObj dcm;
+	unsigned short us;
+	double fd;
+	char temp[64];
+
+	AddString(&dcm, 0x0008, 0x0008, "CS", angle < 0 ? "ORIGINAL\\PRIMARY\\BLANK SCAN" : "ORIGINAL\\PRIMARY\\AXIAL");
+
+	// patient/study/scanner fields that WriteDicom copies from the projections
+	for(int t=0;t<num_header_tags;t++)
+	{
+		const HeaderTag& h = header_tags[t];
+		if(h.vr[0] == 'F')
+		{
+			fd = 0;
+			AddElement(&dcm, h.group, h.element, h.vr, sizeof(fd), &fd);
+		}
+		else
+			AddString(&dcm, h.group, h.element, h.vr, h.value);
+	}
+
+	AddElement(&dcm, 0x0009, 0x1036, "FD", sizeof(double), &angle);
+	AddElement(&dcm, 0x0009, 0x1046, "FL", 360*sizeof(float), ZOffset);
+	AddElement(&dcm, 0x0009, 0x1047, "FL", 360*sizeof(float), YOffset);
+
+	sprintf(temp, "%d", kVp);
+	AddString(&dcm, 0x0018, 0x0060, "DS", temp);
+	sprintf(temp, "%.4f", sourceToDetector);
+	AddString(&dcm, 0x0018, 0x1110, "DS", temp);
+	sprintf(temp, "%.4f", sourceToAxis);
+	AddString(&dcm, 0x0018, 0x1111, "DS", temp);
+	AddElement(&dcm, 0x0018, 0x9306, "FD", sizeof(double), &detectorRes);
+	fd = 0;
+	AddElement(&dcm, 0x0018, 0x9310, "FD", sizeof(double), &fd);
+
+	us = rows;
+	AddElement(&dcm, 0x0028, 0x0010, "US", sizeof(us), &us);
+	us = cols;
+	AddElement(&dcm, 0x0028, 0x0011, "US", sizeof(us), &us);
+	us = 16;
+	AddElement(&dcm, 0x0028, 0x0100, "US", sizeof(us), &us);
+	us = num_proj;
+	AddElement(&dcm, 0x0054, 0x0053, "US", sizeof(us), &us);
+
+	AddElement(&dcm, 0x7FE0, 0x0010, "OW", (unsigned long)rows*cols*sizeof(unsigned short), pixels);
+
+	return dcm.Write(filename) == 0;
+}
+
+// forward projects the phantom at one angle, in detector counts
+static void ForwardProject(unsigned short* pixels, int rows, int cols, double detectorRes,
+						   double angle, double YOffset, double ZOffset)
+{
+	int i,j;
+	double theta = M_PI*(angle + 90)/180;	// same rotation as Reconstruction::ComputeGeometry
+	double c = cos(theta), s = sin(theta);
+	double src[3], det[3], d[3];
+	double u, v, P;
+
+	// in the rotated frame the source is at x_r = -sourceToAxis and the detector
+	// at x_r = sourceToDetector - sourceToAxis, see ProjectionGeometry::Compute
+	src[0] = c*(-sourceToAxis);
+	src[1] = s*(-sourceToAxis);
+	src[2] = 0;
+
+	for(i=0;i<rows;i++)
+	{
+		// detector row i is at y_p = (rows-1)/2 - (u + YOffset)/detectorRes
+		u = ((rows-1.0)/2.0 - i)*detectorRes - YOffset;
+		for(j=0;j<cols;j++)
+		{
+			// and column j at z_p = (v + ZOffset)/detectorRes + (cols-1)/2
+			v = (j - (cols-1.0)/2.0)*detectorRes - ZOffset;
+
+			det[0] = c*(sourceToDetector - sourceToAxis) - s*u;
+			det[1] = s*(sourceToDetector - sourceToAxis) + c*u;
+			det[2] = v;
+			d[0] = det[0] - src[0];
+			d[1] = det[1] - src[1];
+			d[2] = det[2] - src[2];
+
+			P = muScale * LineIntegral(src, d);
+			pixels[i*cols + j] = (unsigned short)floor(blankCounts*exp(-P) + 0.5);
+		}
+	}
+}
+
+// writes the blank scan, a leading extra projection like the scanner's one at 270 (the angle of
+// the projection nearest 270, so the index drops it as a duplicate) and num_proj projections
+// over 360 degrees
+static bool MakeScan(const char* dir, int num_proj, int det_size)
+{
+	int n, i;
+	double detectorRes;
+	double angle;
+	float YOffset[360], ZOffset[360];
+	char filename[MAX_PATH];
+	vector<unsigned short> pixels(det_size*det_size);
+
+	MakeDir(dir);
+
+	// the detector covers the phantom at the magnification of the axis, with a margin
+	detectorRes = 2.6 * phantomRadius * (sourceToDetector/sourceToAxis) / det_size;
+
+	// small calibration offsets that change with angle, to check they're applied the same way
+	for(n=0;n<360;n++)
+	{
+		YOffset[n] = (float)(0.02 * sin(n*M_PI/180));
+		ZOffset[n] = (float)(-0.015 + 0.01 * cos(n*M_PI/180));
+	}
+
+	for(i=0;i<det_size*det_size;i++)
+		pixels[i] = (unsigned short)blankCounts;
+	sprintf_s(filename, MAX_PATH, "%s" PATH_SEP "1.3.6.1.4.1.9590.0.0000", dir);
+	if(!WriteProjection(filename, &pixels[0], det_size, det_size, num_proj, detectorRes, YOffset, ZOffset, -1))
+		return false;
+
+	for(n=0;n<=num_proj;n++)
+	{
+		angle = (n == 0) ? 360.0*floor(270.0*num_proj/360 + 0.5)/num_proj : 360.0*(n-1)/num_proj;
+
+		// same lookup as Projection::getYOffset/getZOffset
+		int k = ((int)floor(angle + 0.5) + 180) % 360;
+		ForwardProject(&pixels[0], det_size, det_size, detectorRes, angle, YOffset[k], ZOffset[k]);
+
+		sprintf_s(filename, MAX_PATH, "%s" PATH_SEP "1.3.6.1.4.1.9590.1.%04d", dir, n);
+		if(!WriteProjection(filename, &pixels[0], det_size, det_size, num_proj, detectorRes, YOffset, ZOffset, angle))
+			return false;
+	}
+
+	return true;
+}
+
+// swallows everything written to cout while a stage runs, the engine prints every angle
+class QuietCout
+{
+public:
+	QuietCout() { old = cout.rdbuf(sink.rdbuf()); }
+	~QuietCout() { cout.rdbuf(old); }
+private:
+	ostringstream sink;
+	streambuf* old;
+};
+
+// largest difference between Filter and FilterReference, relative to the largest filtered value,
+// and the time Filter takes per projection with one FFT backend
+static void CheckFilter(char* dir, fft_backend backend, const char* backend_name)
+{
+	const char* names[] = {"ramlak", "shepplogan", "hamming", "hann", "cosine", "blackman"};
+	const filter_type types[] = {ramlak, shepplogan, hamming, hanning, cosine, blackman};
+	const double cutoffs[] = {1.0, 0.5};
+
+	Projection* proj;
+	ProjBuffer* source;
+	ProjBuffer* fast;
+	ProjBuffer* reference;
+	ScanGeometry scan;
+	int f,c,i,j;
+	double diff, peak;
+	double t_filter = 0;
+	chrono::steady_clock::time_point t;
+
+	SetFFTBackend(backend);
+	{
+		QuietCout quiet;
+		proj = new Projection(dir);
+		scan = proj->GetScanGeometry();
+		source = new ProjBuffer(scan.det_rows, scan.det_cols);
+		fast = new ProjBuffer(scan.det_rows, scan.det_cols);
+		reference = new ProjBuffer(scan.det_rows, scan.det_cols);
+
+		proj->ReadNext(source);
+		proj->Preprocess(source);
+		proj->Rewind();
+	}
+
+	printf("Filter (%s FFT) vs FilterReference (max difference / max value):\n", backend_name);
+	for(f=0;f<6;f++)
+		for(c=0;c<2;c++)
+		{
+			{
+				QuietCout quiet;
+				proj->CreateFilter(types[f], cutoffs[c]);
+			}
+			for(i=0;i<scan.det_rows;i++)
+			{
+				memcpy(fast->pd[i], source->pd[i], scan.det_cols*sizeof(FP_VAR));
+				memcpy(reference->pd[i], source->pd[i], scan.det_cols*sizeof(FP_VAR));
+			}
+			t = chrono::steady_clock::now();
+			proj->Filter(fast);
+			t_filter += Seconds(t);
+			proj->FilterReference(reference);
+
+			diff = peak = 0;
+			for(i=0;i<scan.det_rows;i++)
+				for(j=0;j<scan.det_cols;j++)
+				{
+					diff = max(diff, (double)fabs(fast->pd[i][j] - reference->pd[i][j]));
+					peak = max(peak, (double)fabs(reference->pd[i][j]));
+				}
+			printf("  %-10s cutoff %.1f  %.2e\n", names[f], cutoffs[c], peak > 0 ? diff/peak : diff);
+		}
+	printf("  %.3f ms per projection\n", 1000*t_filter/(6*2));
+
+	// splitting the columns over threads mustn't change anything
+	for(i=0;i<scan.det_rows;i++)
+	{
+		memcpy(fast->pd[i], source->pd[i], scan.det_cols*sizeof(FP_VAR));
+		memcpy(reference->pd[i], source->pd[i], scan.det_cols*sizeof(FP_VAR));
+	}
+	proj->SetFilterThreads(1);
+	proj->Filter(reference);
+	proj->SetFilterThreads(4);
+	proj->Filter(fast);
+	diff = 0;
+	for(i=0;i<scan.det_rows;i++)
+		if(memcmp(fast->pd[i], reference->pd[i], scan.det_cols*sizeof(FP_VAR)))
+			diff = 1;
+	printf("  1 vs 4 filter threads: %s\n", diff ? "DIFFERENT" : "identical");
+
+	delete source;
+	delete fast;
+	delete reference;
+	delete proj;
+}
+
+// largest difference between Preprocess (log and beam hardening tables, single precision) and
+// PreprocessReference on a phantom projection and on every possible count, and the time each
+// takes per projection. calibration is a beam hardening calibration file, NULL for the built
+// in one (which has nothing for the phantom's kVp).
+static void CheckPreprocess(char* dir, const char* calibration, const char* name)
+{
+	const int reps = 20;
+
+	Projection* proj;
+	ProjBuffer* fast;
+	ProjBuffer* reference;
+	ScanGeometry scan;
+	int i,j,r;
+	int pixels;
+	double diff, rel;
+	double bound = calibration ? 5e-6 : 1e-6;	// what preprocess_kernel.h promises
+	double t_fast, t_reference;
+	chrono::steady_clock::time_point t;
+
+	{
+		QuietCout quiet;
+		LoadBHCalibration(calibration);
+		proj = new Projection(dir);
+		scan = proj->GetScanGeometry();
+		fast = new ProjBuffer(scan.det_rows, scan.det_cols);
+		reference = new ProjBuffer(scan.det_rows, scan.det_cols);
+
+		proj->ReadNext(fast);
+		proj->Rewind();
+		LoadBHCalibration(NULL);
+	}
+	pixels = scan.det_rows * scan.det_cols;
+	memcpy(reference->raw, fast->counts, pixels*sizeof(unsigned short));
+	reference->UseRaw();
+
+	t = chrono::steady_clock::now();
+	for(r=0;r<reps;r++)
+		proj->Preprocess(fast);
+	t_fast = Seconds(t) / reps;
+	t = chrono::steady_clock::now();
+	for(r=0;r<reps;r++)
+		proj->PreprocessReference(reference);
+	t_reference = Seconds(t) / reps;
+
+	// absolute where the value is under 1, relative above
+	diff = 0;
+	for(i=0;i<scan.det_rows;i++)
+		for(j=0;j<scan.det_cols;j++)
+			diff = max(diff, fabs(fast->pd[i][j] - reference->pd[i][j]) / max(1.0, (double)fabs(reference->pd[i][j])));
+
+	printf("Preprocess vs PreprocessReference (%s), max difference (absolute under 1, relative above):\n", name);
+	printf("  phantom projection %.2e%s\n", diff, diff > bound ? "  FAILED" : "");
+
+	// every count from 1 up
+	rel = 0;
+	for(int first=1;first<65536;first+=pixels)
+	{
+		fast->UseRaw();
+		for(i=0;i<pixels;i++)
+			fast->raw[i] = reference->raw[i] = (unsigned short)min(first + i, 65535);
+		proj->Preprocess(fast);
+		proj->PreprocessReference(reference);
+		for(i=0;i<scan.det_rows;i++)
+			for(j=0;j<scan.det_cols;j++)
+				rel = max(rel, fabs(fast->pd[i][j] - reference->pd[i][j]) / max(1.0, (double)fabs(reference->pd[i][j])));
+	}
+	printf("  all counts %.2e%s\n", rel, rel > bound ? "  FAILED" : "");
+	if(diff > bound || rel > bound)
+		printf("  over the %.0e bound\n", bound);
+	printf("  %.3f ms per projection (reference %.3f ms)\n", 1000*t_fast, 1000*t_reference);
+
+	delete fast;
+	delete reference;
+	delete proj;
+}
+
+// RMSE of the n^3 volume in the .bin file against the phantom, after the least squares scale.
+// Only the voxels inside the phantom's bounding cylinder, away from the ends where the cone
+// beam doesn't cover the whole volume, and away from the metal if asked.
+static double PhantomRMSE(const string& bin, int n, double res, bool away_from_metal, double* scale)
+{
+	FP_VAR* slice = new FP_VAR[n*n];
+	double srp = 0, srr = 0, spp = 0;
+	long long voxels = 0;
+	int i,j,k;
+	double x,y,z, p, r;
+
+	ifstream f(bin.c_str(), ios::binary);
+	for(i=0;i<n;i++)
+	{
+		f.read(reinterpret_cast<char*>(slice), n*n*sizeof(FP_VAR));
+		z = res * (i - (n-1.0)/2);
+		if(fabs(z) > 0.6*phantomRadius)
+			continue;
+		for(j=0;j<n;j++)
+			for(k=0;k<n;k++)
+			{
+				x = res * (k - (n-1.0)/2);
+				y = res * (j - (n-1.0)/2);
+				if(x*x + y*y > phantomRadius*phantomRadius)
+					continue;
+				if(away_from_metal && NearMetal(x, y, z, 4*res))
+					continue;
+				p = PhantomValue(x,y,z);
+				r = slice[j*n + k];
+				srp += r*p;
+				srr += r*r;
+				spp += p*p;
+				voxels++;
+			}
+	}
+	f.close();
+	delete [] slice;
+
+	*scale = srr > 0 ? srp/srr : 0;
+	return voxels ? sqrt(max(0.0, spp - 2*(*scale)*srp + (*scale)*(*scale)*srr) / voxels) : 0;
+}
+
+static void RunSize(char* dir, int n, double fov)
+{
+	chrono::steady_clock::time_point t;
+	double t_proj, t_load, t_filter, t_bp, t_dicom;
+	int count = 0;
+	double res = fov / n;
+	char filename[MAX_PATH];
+
+	Projection* proj;
+	Reconstruction* recon;
+
+	{
+		QuietCout quiet;
+
+		t = chrono::steady_clock::now();
+		proj = new Projection(dir);
+		t_proj = Seconds(t);
+
+		// load and filter every projection on their own, to see what they cost outside the pipeline
+		proj->CreateFilter(ramlak, 1.0);
+		t_load = t_filter = 0;
+		while(1)
+		{
+			t = chrono::steady_clock::now();
+			if(!proj->LoadNextProj())
+				break;
+			t_load += Seconds(t);
+
+			t = chrono::steady_clock::now();
+			proj->Filter();
+			t_filter += Seconds(t);
+			count++;
+		}
+		proj->Rewind();
+
+		recon = new Reconstruction(n, n, n, res, proj);
+
+		t = chrono::steady_clock::now();
+		recon->Backproject();
+		t_bp = Seconds(t);
+
+		sprintf_s(filename, MAX_PATH, "%s" PATH_SEP "recon_%d.dcm", dir, n);
+		t = chrono::steady_clock::now();
+		recon->WriteDicom(filename);
+		t_dicom = Seconds(t);
+	}
+
+	double scale;
+	string bin = string(dir) + PATH_SEP + "recon.bin";
+	recon->WriteBin((char*)bin.c_str());
+	double rmse = PhantomRMSE(bin, n, res, false, &scale);
+	remove(bin.c_str());
+
+	printf("%4d^3  %3d proj | Projection %7.3f s | load %7.3f s | filter %7.3f s | backproject %7.3f s"
+		   " (%7.1f Mvox/s, %7.1f Mvox-proj/s) | dicom %6.3f s | RMSE %.4f (scale %.4g)\n",
+		   n, count, t_proj, t_load, t_filter, t_bp,
+		   (double)n*n*n/t_bp/1e6, (double)n*n*n*max(count,1)/t_bp/1e6, t_dicom, rmse, scale);
+
+	delete recon;
+	delete proj;
+}
+
+// true if the two files have the same, not empty, contents. Both are removed.
+static bool SameContents(const string& name_a, const string& name_b)
+{
+	ifstream a(name_a.c_str(), ios::binary), b(name_b.c_str(), ios::binary);
+	string va((istreambuf_iterator<char>(a)), istreambuf_iterator<char>());
+	string vb((istreambuf_iterator<char>(b)), istreambuf_iterator<char>());
+	a.close();
+	b.close();
+	remove(name_a.c_str());
+	remove(name_b.c_str());
+
+	return !va.empty() && va == vb;
+}
+
+// reconstructs twice with the sinogram cache on, the first time writes it and the second
+// loads the filtered projections from it, which has to give the same volume
+static void CheckCache(char* dir, int n, double fov)
+{
+	chrono::steady_clock::time_point t;
+	double t_run[2];
+	string bins[2];
+	string cache_dir = string(dir) + PATH_SEP + "cache";
+	FileFinder finder;
+	char name[MAX_PATH];
+	int run;
+
+	// start without one
+	MakeDir(cache_dir.c_str());
+	if(finder.First(cache_dir.c_str(), "sino_*", name, sizeof(name)))
+		do
+			remove((cache_dir + PATH_SEP + name).c_str());
+		while(finder.Next(name, sizeof(name)));
+
+	for(run=0;run<2;run++)
+	{
+		QuietCout quiet;
+
+		t = chrono::steady_clock::now();
+		Projection* proj = new Projection(dir);
+		proj->SetSinogramCacheDir(cache_dir.c_str());
+		proj->CreateFilter(ramlak, 1.0);
+		Reconstruction* recon = new Reconstruction(n, n, n, fov / n, proj);
+		recon->Backproject();
+		t_run[run] = Seconds(t);
+
+		bins[run] = cache_dir + PATH_SEP + (run ? "cached.bin" : "uncached.bin");
+		recon->WriteBin((char*)bins[run].c_str());
+		delete recon;
+		delete proj;
+	}
+
+	bool same = SameContents(bins[0], bins[1]);
+
+	printf("Sinogram cache, %d^3: %.3f s writing it, %.3f s reading it, volumes %s\n",
+		   n, t_run[0], t_run[1], same ? "identical" : "DIFFERENT");
+}
+
+// reconstructs and removes metal with the projection stack off and then on, which has to give
+// the same volume, and times the metal removal pass, which reads from the stack the second time
+static void CheckStack(char* dir, int n, double fov)
+{
+	chrono::steady_clock::time_point t;
+	double t_metal[2];
+	string bins[2];
+	int run, nearest = -1;
+
+	for(run=0;run<2;run++)
+	{
+		QuietCout quiet;
+
+		Projection* proj = new Projection(dir);
+		proj->SetStackBudget(run ? -1 : 0);
+		proj->CreateFilter(ramlak, 1.0);
+		Reconstruction* recon = new Reconstruction(n, n, n, fov / n, proj);
+		recon->Backproject();
+		recon->SetMetalThreshold(0.35);	// the brightest voxels of the skull
+		t = chrono::steady_clock::now();
+		recon->RemoveMetal();
+		t_metal[run] = Seconds(t);
+		if(run)		// a turn and a bit less than half a step on from projection 10
+			nearest = proj->GetStack().FindAngle(proj->GetStack().GetAngle(10) + 360 + 0.4 * 360 / proj->GetNumProj());
+
+		bins[run] = string(dir) + PATH_SEP + (run ? "stacked.bin" : "streamed.bin");
+		recon->WriteBin((char*)bins[run].c_str());
+		delete recon;
+		delete proj;
+	}
+
+	bool same = SameContents(bins[0], bins[1]);
+
+	printf("Projection stack, %d^3 metal removal: %.3f s streamed, %.3f s from the stack, volumes %s, FindAngle %s\n",
+		   n, t_metal[0], t_metal[1], same ? "identical" : "DIFFERENT", nearest == 10 ? "ok" : "WRONG");
+}
+
+// forward projects the phantom with two metal spheres in it, then reconstructs it and removes
+// the metal with linear interpolation and with NMAR, and compares each against the phantom
+// away from the metal. NMAR (with the metal dilated and diagnostics on) is run with 1 and
+// with 4 threads, which have to give the same volume and diagnostics file.
+static void CheckMetal(char* dir, int num_proj, int det_size, int n, double fov)
+{
+	const int runs = 4;
+	const char* run_name[runs] = {"none", "linear", "nmar", "nmar1"};
+	double rmse[runs], scale;
+	string bins[runs], diags[runs];
+	string metal_dir = string(dir) + PATH_SEP + "metal";
+	DiagnosticsHeader h;
+	bool diag_ok;
+	int run;
+
+	phantom_metal = true;
+	bool made = MakeScan(metal_dir.c_str(), num_proj, det_size);
+	phantom_metal = false;
+	if(!made)
+	{
+		printf("Metal removal: error writing the projections\n");
+		return;
+	}
+
+	for(run=0;run<runs;run++)
+	{
+		QuietCout quiet;
+		int threads = run == 3 ? 1 : 4;
+
+		Projection* proj = new Projection(metal_dir.c_str());
+		proj->SetFilterThreads(threads);
+		proj->CreateFilter(ramlak, 1.0);
+		Reconstruction* recon = new Reconstruction(n, n, n, fov / n, proj);
+		recon->SetNumThreads(threads);
+		recon->Backproject();
+		if(run > 0)
+		{
+			recon->SetMetalThreshold(1.0);		// only the spheres, the skull is about 0.3
+			recon->SetMetalDilation(1);
+			recon->SetMetalMode(run == 1 ? METAL_LINEAR : METAL_NMAR);
+			if(run >= 2)
+			{
+				diags[run] = metal_dir + PATH_SEP + run_name[run] + "_diag.bin";
+				recon->SetDiagnosticsFile(diags[run].c_str());
+			}
+			recon->RemoveMetal();
+		}
+
+		bins[run] = metal_dir + PATH_SEP + run_name[run] + ".bin";
+		recon->WriteBin((char*)bins[run].c_str());
+		delete recon;
+		delete proj;
+		if(run < 3)
+			rmse[run] = PhantomRMSE(bins[run], n, fov / n, true, &scale);
+		if(run < 2)
+			remove(bins[run].c_str());
+	}
+
+	// the header, and some of the first projection in the metal trace
+	memset(&h, 0, sizeof(h));
+	ifstream f(diags[2].c_str(), ios::binary);
+	f.read(reinterpret_cast<char*>(&h), sizeof(h));
+	diag_ok = f && !memcmp(h.magic, "CTDIAG", 6) && h.num_planes == DIAG_NUM_PLANES && h.num_proj == num_proj;
+	if(diag_ok)
+	{
+		vector<FP_VAR> trace(size_t(h.rows)*h.cols);
+		f.seekg(h.data_offset);
+		f.read(reinterpret_cast<char*>(&trace[0]), trace.size()*sizeof(FP_VAR));
+		diag_ok = f && count(trace.begin(), trace.end(), FP_VAR(1)) > 0;
+	}
+	f.close();
+
+	bool same = SameContents(bins[2], bins[3]);
+	bool same_diag = SameContents(diags[2], diags[3]);
+	printf("Metal removal, %d^3: RMSE away from the metal %.4f none, %.4f linear, %.4f NMAR, "
+		   "NMAR 1 vs 4 threads: volumes %s, diagnostics %s\n",
+		   n, rmse[0], rmse[1], rmse[2], same ? "identical" : "DIFFERENT",
+		   !diag_ok ? "WRONG" : same_diag ? "identical" : "DIFFERENT");
+}
+
+int main(int argc, char* argv[])
+{
+	char* dir = (char*)"phantom_scan";
+	const char* sizes = "64,128,256";
+	int num_proj = 360;
+	int det_size = 256;
+	chrono::steady_clock::time_point t;
+
+	if(argc > 1)
+		dir = argv[1];
+	if(argc > 2)
+		sizes = argv[2];
+	if(argc > 3)
+		num_proj = atoi(argv[3]);
+	if(argc > 4)
+		det_size = atoi(argv[4]);
+
+	printf("Forward projecting %d projections, %d x %d detector, into %s\n", num_proj, det_size, det_size, dir);
+	t = chrono::steady_clock::now();
+	if(!MakeScan(dir, num_proj, det_size))
+	{
+		printf("Error writing the projections\n");
+		return 1;
+	}
+	printf("  %.2f s\n", Seconds(t));
+
+	// the volume covers the phantom, RMSE is in phantom units (the outer shell is 1.0,
+	// the brain 0.2, the small features 0.1 above that)
+	double fov = 2.2 * phantomRadius;
+
+	CheckFilter(dir, FFT_OOURA, "ooura");
+	CheckFilter(dir, FFT_SIMD, "simd");
+	SetFFTBackend(FFT_OOURA);
+	CheckPreprocess(dir, NULL, "no beam hardening correction");
+
+	// a polynomial for any filter and scanner, and a more specific spline that should win over it
+	char calibration[MAX_PATH];
+	sprintf(calibration, "%s/bh_poly.txt", dir);
+	FILE* f = fopen(calibration, "w");
+	fprintf(f, "# kVp filter scanner\n%d * * poly 0.8346 0.1656 0.0069\n", kVp);
+	fclose(f);
+	CheckPreprocess(dir, calibration, "polynomial calibration");
+	sprintf(calibration, "%s/bh_spline.txt", dir);
+	f = fopen(calibration, "w");
+	fprintf(f, "%d * * poly 0.8346 0.1656 0.0069\n%d NONE BENCH spline -1 -0.9 0.5 0.45 1 0.95 2 2.1 4 4.8 8 11\n", kVp, kVp);
+	fclose(f);
+	CheckPreprocess(dir, calibration, "spline calibration");
+	CheckCache(dir, 64, fov);
+	CheckStack(dir, 64, fov);
+	CheckMetal(dir, num_proj, det_size, 64, fov);
+
+	stringstream ss(sizes);
+	string item;
+	while(getline(ss, item, ','))
+	{
+		int n = atoi(item.c_str());
+		if(n > 0)
+			RunSize(dir, n, fov);
+	}
+
+	return 0;
+}
@@ -0,0 +1,333 @@
+// cone_ct_cli.cpp
+
+// command line front end for the reconstruction, for running batches of scans without the GUI.
+// Runs the same Projection/Reconstruction engine as win_cone_ct.cpp.
+
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <csignal>
+
+#include "ct_recon_win.h"
+
+using namespace std;
+
+static volatile sig_atomic_t interrupted = 0;
+
+static void OnInterrupt(int)
+{
+	interrupted = 1;
+}
+
+// prints progress to stderr and stops the reconstruction on ctrl-c
+class ConsoleCallback : public ReconCallback
+{
+public:
+	ConsoleCallback() : complete(false) {}
+
+	void Progress(int done, int total) { cerr << "Projection " << done << " of " << total << endl; }
+	void Complete() { complete = true; }
+	bool Cancelled() { return interrupted != 0; }
+
+	bool complete;
+};
+
+static void Usage(const char* name)
+{
+	cout << "Usage: " << name << " -i <projection dir> [options]" << endl
+		 << endl
+		 << "  -i <dir>         directory with the DICOM projections and blank scan" << endl
+		 << "  -n <voxels>      x/y size of the volume (default 128)" << endl
+		 << "  -z <slices>      number of slices (default 128)" << endl
+		 << "  -r <mm>          voxel size (default 0.1)" << endl
+		 << "  -f <filter>      ramlak, shepplogan, hamming, hann, cosine or blackman (default ramlak)" << endl
+		 << "  -c <cutoff>      filter cutoff as a fraction of Nyquist (default 1.0)" << endl
+		 << "  -o <file>        write the raw volume (float, slice/row/col order)" << endl
+		 << "  -d <file>        write the volume as DICOM" << endl
+		 << "  -t <threads>     backprojection and forward projection threads, 0 uses every hardware thread" << endl
+		 << "                   (default 0)" << endl
+		 << "  --filter-threads <threads>" << endl
+		 << "                   threads the ramp filter splits each projection over (default 1). The filter" << endl
+		 << "                   stage runs alongside the -t threads, so together they shouldn't exceed the cores" << endl
+		 << "  --roi cx,cy,cz,ex,ey,ez" << endl
+		 << "                   reconstruct a region centred at (cx,cy,cz) with extent (ex,ey,ez), in mm;" << endl
+		 << "                   overrides -n, -z" << endl
+		 << "  --fov-mask       only reconstruct the cylinder inscribed in the volume" << endl
+		 << "  --batch <n>      projections per backprojection pass, 0 picks from the cache size (default 0)" << endl
+		 << "  --simd <level>   none, avx2 or avx512, caps the instruction set used" << endl
+		 << "  --fft <backend>  ooura (double precision) or simd (single precision) (default ooura)" << endl
+		 << "  --metal <thresh> run metal artefact reduction after reconstructing, with this threshold" << endl
+		 << "  --metal-dilate <voxels>" << endl
+		 << "                   grow the metal by this radius before tracing it in the projections (default 0)" << endl
+		 << "  --nmar           fill in the metal trace normalized by a forward projected tissue prior (NMAR)" << endl
+		 << "                   rather than straight across it" << endl
+		 << "  --diag <file>    save the metal trace, interpolated projection and (with --nmar) projected" << endl
+		 << "                   prior of every projection to file (see diagnostics.h)" << endl
+		 << "  --bh <file>      beam hardening calibration (see beam_hardening.h), replaces the built in" << endl
+		 << "                   45, 55 and 65 kVp corrections" << endl
+		 << "  --cache <dir>    keep the filtered projections in dir, and use them when the same scan is" << endl
+		 << "                   reconstructed again with the same correction and filter" << endl
+		 << "  --stack <MB|auto> keep the preprocessed projections in memory if they fit in MB (auto is half" << endl
+		 << "                   the free memory), so --metal doesn't read the files again (default off)" << endl;
+}
+
+static bool ParseFilter(const char* name, filter_type* filter)
+{
+	const char* names[] = {"ramlak", "shepplogan", "hamming", "hann", "cosine", "blackman"};
+	const filter_type types[] = {ramlak, shepplogan, hamming, hanning, cosine, blackman};
+
+	for(int i=0;i<6;i++)
+		if(strcmp(name, names[i]) == 0)
+		{
+			*filter = types[i];
+			return true;
+		}
+	if(strcmp(name, "hanning") == 0)
+	{
+		*filter = hanning;
+		return true;
+	}
+	return false;
+}
+
+int main(int argc, char* argv[])
+{
+	char* proj_dir = NULL;
+	char* bin_file = NULL;
+	char* dcm_file = NULL;
+	int nxy = 128;
+	int nz = 128;
+	double res = 0.1;
+	filter_type filter = ramlak;
+	double cutoff = 1.0;
+	int threads = 0;
+	int filter_threads = 1;
+	bool use_roi = false;
+	double roi_center[3], roi_extent[3];
+	bool fov_mask = false;
+	int batch = 0;
+	simd_level simd = SIMD_AVX512;
+	fft_backend fft = FFT_OOURA;
+	bool metal = false;
+	double threshold = 0;
+	int metal_radius = 0;
+	bool nmar = false;
+	char* bh_file = NULL;
+	char* cache_dir = NULL;
+	long long stack_mb = 0;
+	char* diag_file = NULL;
+
+	int i;
+
+	for(i=1;i<argc;i++)
+	{
+		const char* arg = argv[i];
+		const char* val = (i+1 < argc) ? argv[i+1] : NULL;
+
+		if(strcmp(arg, "-h") == 0 || strcmp(arg, "--help") == 0)
+		{
+			Usage(argv[0]);
+			return 0;
+		}
+		else if(strcmp(arg, "--fov-mask") == 0)
+		{
+			fov_mask = true;
+			continue;
+		}
+		else if(strcmp(arg, "--nmar") == 0)
+		{
+			nmar = true;
+			continue;
+		}
+
+		// everything else takes a value
+		if(!val)
+		{
+			cout << "Error: " << arg << " needs a value" << endl;
+			return 1;
+		}
+		i++;
+
+		if(strcmp(arg, "-i") == 0)
+			proj_dir = argv[i];
+		else if(strcmp(arg, "-n") == 0)
+			nxy = atoi(val);
+		else if(strcmp(arg, "-z") == 0)
+			nz = atoi(val);
+		else if(strcmp(arg, "-r") == 0)
+			res = atof(val);
+		else if(strcmp(arg, "-f") == 0)
+		{
+			if(!ParseFilter(val, &filter))
+			{
+				cout << "Error: unknown filter " << val << endl;
+				return 1;
+			}
+		}
+		else if(strcmp(arg, "-c") == 0)
+			cutoff = atof(val);
+		else if(strcmp(arg, "-o") == 0)
+			bin_file = argv[i];
+		else if(strcmp(arg, "-d") == 0)
+			dcm_file = argv[i];
+		else if(strcmp(arg, "-t") == 0)
+			threads = atoi(val);
+		else if(strcmp(arg, "--filter-threads") == 0)
+			filter_threads = atoi(val);
+		else if(strcmp(arg, "--roi") == 0)
+		{
+			if(sscanf(val, "%lf,%lf,%lf,%lf,%lf,%lf", &roi_center[0], &roi_center[1], &roi_center[2],
+					  &roi_extent[0], &roi_extent[1], &roi_extent[2]) != 6)
+			{
+				cout << "Error: --roi needs cx,cy,cz,ex,ey,ez" << endl;
+				return 1;
+			}
+			use_roi = true;
+		}
+		else if(strcmp(arg, "--batch") == 0)
+			batch = atoi(val);
+		else if(strcmp(arg, "--simd") == 0)
+		{
+			if(strcmp(val, "none") == 0)
+				simd = SIMD_NONE;
+			else if(strcmp(val, "avx2") == 0)
+				simd = SIMD_AVX2;
+			else if(strcmp(val, "avx512") == 0)
+				simd = SIMD_AVX512;
+			else
+			{
+				cout << "Error: unknown instruction set " << val << endl;
+				return 1;
+			}
+		}
+		else if(strcmp(arg, "--fft") == 0)
+		{
+			if(strcmp(val, "ooura") == 0)
+				fft = FFT_OOURA;
+			else if(strcmp(val, "simd") == 0)
+				fft = FFT_SIMD;
+			else
+			{
+				cout << "Error: unknown FFT backend " << val << endl;
+				return 1;
+			}
+		}
+		else if(strcmp(arg, "--bh") == 0)
+			bh_file = argv[i];
+		else if(strcmp(arg, "--cache") == 0)
+			cache_dir = argv[i];
+		else if(strcmp(arg, "--stack") == 0)
+		{
+			stack_mb = strcmp(val, "auto") == 0 ? -1 : atoll(val);
+			if(stack_mb < -1)
+			{
+				cout << "Error: --stack needs a size in MB or auto" << endl;
+				return 1;
+			}
+		}
+		else if(strcmp(arg, "--metal") == 0)
+		{
+			metal = true;
+			threshold = atof(val);
+		}
+		else if(strcmp(arg, "--metal-dilate") == 0)
+			metal_radius = atoi(val);
+		else if(strcmp(arg, "--diag") == 0)
+			diag_file = argv[i];
+		else
+		{
+			cout << "Error: unknown option " << arg << endl;
+			Usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if(!proj_dir)
+	{
+		Usage(argv[0]);
+		return 1;
+	}
+	if(!bin_file && !dcm_file)
+	{
+		cout << "Error: nothing to write, give -o and/or -d" << endl;
+		return 1;
+	}
+	if(nmar && (!metal || threshold <= 0))
+	{
+		cout << "Error: --nmar needs a --metal threshold above 0" << endl;
+		return 1;
+	}
+	if(nxy <= 0 || nz <= 0 || res <= 0)
+	{
+		cout << "Error: volume size and voxel size must be positive" << endl;
+		return 1;
+	}
+
+	// Projection expects at least one file to read the scan parameters from
+	FileFinder finder;
+	char name[MAX_PATH];
+	if(!finder.First(proj_dir, "1.3.6.1.4.1*", name, sizeof(name)))
+	{
+		cout << "Error: no projections found in " << proj_dir << endl;
+		return 1;
+	}
+	finder.Close();
+
+	signal(SIGINT, OnInterrupt);
+
+	if(bh_file && !LoadBHCalibration(bh_file))
+		return 1;
+
+	SetFFTBackend(fft, simd);
+	Projection proj(proj_dir);
+	if(proj.GetNumProj() == 0)
+	{
+		cout << "Error: no projections found in " << proj_dir << endl;
+		return 1;
+	}
+
+	Reconstruction* recon;
+	if(use_roi)
+		recon = new Reconstruction(roi_center, roi_extent, res, &proj);
+	else
+		recon = new Reconstruction(nz, nxy, nxy, res, &proj);
+
+	ConsoleCallback callback;
+	recon->SetCallback(&callback);
+	recon->SetNumThreads(threads);
+	recon->SetSIMDLevel(simd);
+	recon->SetFOVMask(fov_mask);
+	recon->SetBatchSize(batch);
+
+	proj.SetFilterThreads(filter_threads);
+	proj.SetSIMDLevel(simd);
+	proj.SetSinogramCacheDir(cache_dir);
+	proj.SetStackBudget(stack_mb);
+	proj.CreateFilter(filter, cutoff);
+	recon->Backproject();
+
+	if(callback.complete && metal)
+	{
+		callback.complete = false;
+		recon->SetMetalThreshold(threshold);
+		recon->SetMetalDilation(metal_radius);
+		recon->SetMetalMode(nmar ? METAL_NMAR : METAL_LINEAR);
+		recon->SetDiagnosticsFile(diag_file);
+		recon->RemoveMetal();
+	}
+
+	if(!callback.complete)
+	{
+		cout << "Reconstruction cancelled, nothing written." << endl;
+		delete recon;
+		return 2;
+	}
+
+	if(bin_file)
+		recon->WriteBin(bin_file);
+	if(dcm_file)
+		recon->WriteDicom(dcm_file);
+
+	delete recon;
+	return 0;
+}
@@ -0,0 +1,159 @@
+// cpu_features.h
+
+// runtime detection of the vector instruction sets the reconstruction kernels can use,
+// and of the cache sizes used to pick block sizes
+
+#ifndef _CPU_FEATURES_H
+#define _CPU_FEATURES_H
+
+#include <cstdlib>
+#include <cstdio>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define CT_SIMD_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// gcc and clang need the instruction set enabled per function, msvc allows the intrinsics anywhere
+#if defined(CT_SIMD_X86) && defined(__GNUC__)
+#define TARGET_AVX2 __attribute__((target("avx2,fma")))
+#define TARGET_AVX512 __attribute__((target("avx512f,avx2,fma")))
+#else
+#define TARGET_AVX2
+#define TARGET_AVX512
+#endif
+
+enum simd_level {SIMD_NONE, SIMD_AVX2, SIMD_AVX512};
+
+// returns the widest instruction set supported by both the cpu and the OS
+inline simd_level GetSIMDLevel()
+{
+#if !defined(CT_SIMD_X86)
+	return SIMD_NONE;
+#elif defined(_MSC_VER)
+	int info[4];
+	unsigned long long xcr0;
+	bool avx2, fma, avx512;
+
+	__cpuid(info, 1);
+	fma = (info[2] & (1<<12)) != 0;
+	if(!(info[2] & (1<<27)))		// OSXSAVE, needed for _xgetbv
+		return SIMD_NONE;
+	xcr0 = _xgetbv(0);
+	if((xcr0 & 0x6) != 0x6)		// OS saves the XMM and YMM registers
+		return SIMD_NONE;
+
+	__cpuid(info, 0);
+	if(info[0] < 7)
+		return SIMD_NONE;
+	__cpuidex(info, 7, 0);
+	avx2 = (info[1] & (1<<5)) != 0;
+	avx512 = (info[1] & (1<<16)) != 0 && (xcr0 & 0xE6) == 0xE6;	// also needs the opmask and ZMM state
+
+	if(avx512 && avx2 && fma)
+		return SIMD_AVX512;
+	if(avx2 && fma)
+		return SIMD_AVX2;
+	return SIMD_NONE;
+#else
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+		return SIMD_AVX512;
+	if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+		return SIMD_AVX2;
+	return SIMD_NONE;
+#endif
+}
+
+// size in bytes of the level 2 and level 3 data caches seen by one core (the L3 is usually shared).
+// Either is 0 if it couldn't be found.
+inline void GetCacheSizes(size_t* l2, size_t* l3)
+{
+	*l2 = 0;
+	*l3 = 0;
+
+#ifdef _WIN32
+	DWORD len = 0;
+	SYSTEM_LOGICAL_PROCESSOR_INFORMATION* info;
+
+	GetLogicalProcessorInformation(NULL, &len);
+	if(len == 0)
+		return;
+
+	info = (SYSTEM_LOGICAL_PROCESSOR_INFORMATION*)malloc(len);
+	if(info && GetLogicalProcessorInformation(info, &len))
+	{
+		for(DWORD i=0;i<len/sizeof(*info);i++)
+		{
+			if(info[i].Relationship != RelationCache)
+				continue;
+			if(info[i].Cache.Type != CacheData && info[i].Cache.Type != CacheUnified)
+				continue;
+			if(info[i].Cache.Level == 2 && info[i].Cache.Size > *l2)
+				*l2 = info[i].Cache.Size;
+			if(info[i].Cache.Level == 3 && info[i].Cache.Size > *l3)
+				*l3 = info[i].Cache.Size;
+		}
+	}
+	free(info);
+#else
+#if defined(_SC_LEVEL2_CACHE_SIZE) && defined(_SC_LEVEL3_CACHE_SIZE)
+	long size;
+	if((size = sysconf(_SC_LEVEL2_CACHE_SIZE)) > 0)
+		*l2 = size;
+	if((size = sysconf(_SC_LEVEL3_CACHE_SIZE)) > 0)
+		*l3 = size;
+#endif
+	// sysconf isn't filled in everywhere, the kernel's view of cpu0 is
+	for(int index=0;index<8 && (*l2 == 0 || *l3 == 0);index++)
+	{
+		char path[128];
+		char type[32];
+		int level = 0;
+		unsigned long kb = 0;
+		char unit = 0;
+		FILE* f;
+
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/level", index);
+		if(!(f = fopen(path, "r")))
+			break;
+		if(fscanf(f, "%d", &level) != 1)
+			level = 0;
+		fclose(f);
+
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/type", index);
+		if(!(f = fopen(path, "r")))
+			continue;
+		if(fscanf(f, "%31s", type) != 1)
+			type[0] = 0;
+		fclose(f);
+		if(type[0] == 'I')		// Instruction
+			continue;
+
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/size", index);
+		if(!(f = fopen(path, "r")))
+			continue;
+		if(fscanf(f, "%lu%c", &kb, &unit) < 1)
+			kb = 0;
+		fclose(f);
+		if(unit == 'M')
+			kb *= 1024;
+
+		if(level == 2 && *l2 == 0)
+			*l2 = kb * 1024;
+		if(level == 3 && *l3 == 0)
+			*l3 = kb * 1024;
+	}
+#endif
+}
+
+#endif
@@ -1,50 +1,190 @@
-#include <windows.h>
-
 #include <fstream>
 #include <cstring>
 #include <cmath>
 #include <ctime>
+#include <mutex>
+#include <chrono>
+#include <vector>
+#include <string>
 
-#include <io.h>
-#include <process.h>
-
+#include "platform.h"
 #include "dicom.h"
 #include "fft.h"
+#include "thread_pool.h"
+#include "projection_index.h"
 
 typedef float FP_VAR;	// complile with either single or double precision
 
-enum filter_type {ramlak, shepplogan, hamming, hanning, cosine, blackman};
+#include "backproject_kernel.h"
+#include "preprocess_kernel.h"
+#include "volume.h"
+#include "geometry.h"
+
+enum filter_type {ramlak, shepplogan, hamming, hanning, cosine, blackman, nofilter};	// nofilter passes everything through
+
+#include "filter_bank.h"
+#include "sinogram_cache.h"
+#include "projection_stack.h"
+#include "diagnostics.h"
+
+const int FILTER_BLOCK = 32;	// columns Projection::Filter transforms together
+
+// one projection in memory. Projection keeps one of these as the current projection,
+// the pipeline keeps a ring of them so several projections can be in flight at once.
+class ProjBuffer
+{
+public:
+	ProjBuffer(int newRows, int newCols);
+	~ProjBuffer();
+
+	FP_VAR **pd;			// projection data
+	const unsigned short *counts;	// the counts Preprocess reads, into file or raw
+	unsigned short *raw;	// counts copied out of the file, when it can't be used in place
+	double projAngle;		// angle of the projection
+	MappedFile file;		// the projection's file, mapped until the buffer is read into again
+
+	void UseRaw() { file.Close(); counts = raw; }	// preprocess whatever's been put in raw
+
+private:
+	int rows;
+};
+
+ProjBuffer::ProjBuffer(int newRows, int newCols)
+:rows(newRows)
+{
+	pd = new FP_VAR*[rows];
+	for(int i=0;i<rows;i++)
+		pd[i] = new FP_VAR[newCols];
+	raw = new unsigned short[rows*newCols];
+	counts = raw;
+	projAngle = 0;
+}
+
+ProjBuffer::~ProjBuffer()
+{
+	for(int i=0;i<rows;i++)
+		delete [] pd[i];
+	delete [] pd;
+	delete [] raw;
+}
+
+// the buffer and FFT plans one thread needs to filter a block of columns. Plans keep their own
+// work buffers, so every filter thread has a workspace of its own.
+class FilterWorkspace
+{
+public:
+	FilterWorkspace(int fft_length, bool real);	// real transforms (power of 2 lengths only) or complex ones
+	~FilterWorkspace();
+
+	FP_VAR *temp;			// FILTER_BLOCK zero padded columns, 64 byte aligned
+	RealFFTPlan *fwd_plan;	// real transforms, NULL if complex
+	RealFFTPlan *inv_plan;
+	FFTPlan *fwd_pair_plan;	// complex transforms of two columns at once, NULL if real
+	FFTPlan *inv_pair_plan;
+};
+
+FilterWorkspace::FilterWorkspace(int fft_length, bool real)
+{
+	size_t bytes = size_t(fft_length) * FILTER_BLOCK * sizeof(FP_VAR);
+
+#ifdef _WIN32
+	temp = (FP_VAR*)_aligned_malloc(bytes, 64);
+#else
+	void* p = NULL;
+	temp = posix_memalign(&p, 64, bytes) == 0 ? (FP_VAR*)p : NULL;
+#endif
+
+	fwd_plan = NULL;
+	inv_plan = NULL;
+	fwd_pair_plan = NULL;
+	inv_pair_plan = NULL;
+	if(real)
+	{
+		fwd_plan = new RealFFTPlan(fft_length, 1);
+		inv_plan = new RealFFTPlan(fft_length, -1);
+	}
+	else
+	{
+		fwd_pair_plan = new FFTPlan(fft_length, 1);
+		inv_pair_plan = new FFTPlan(fft_length, -1, true);
+	}
+}
+
+FilterWorkspace::~FilterWorkspace()
+{
+#ifdef _WIN32
+	_aligned_free(temp);
+#else
+	free(temp);
+#endif
+	delete fwd_plan;
+	delete inv_plan;
+	delete fwd_pair_plan;
+	delete inv_pair_plan;
+}
 
 class Projection
 {
 public:
-	Projection(const char* newDir);
+	Projection(const char* newDir);		// Filter uses the FFT backend set when it's constructed (SetFFTBackend)
 	~Projection();	
 
 	float getYOffset();		// returns the y-offset for the specified projection angle
 	float getZOffset();
+	float getYOffset(double angle);
+	float getZOffset(double angle);
 
 	int LoadNextProj();	// loads the next projection
 	int Filter();
 	int Interpolate(int** interp_map);
 
+	// the steps of LoadNextProj/Filter on a buffer other than the current projection.
+	// ReadNext is the only one that moves through the projections, the others can run on any thread.
+	int ReadNext(ProjBuffer* buf);		// reads the raw counts and angle of the next projection in order of angle, 0 at the end
+	int ReadProj(int n, ProjBuffer* buf);	// the same for projection n (0..GetNumProj()-1), 0 if it can't be read
+	void Preprocess(ProjBuffer* buf);	// log transform and beam hardening correction
+	void PreprocessReference(ProjBuffer* buf);	// the same in double precision without the tables, to check Preprocess against
+	int Filter(ProjBuffer* buf);		// only one thread at a time, the columns are split over the filter threads
+	int FilterReference(ProjBuffer* buf);	// the same filter one column at a time with double precision complex transforms, to check Filter against
+	// linear interpolation down each column over the pixels marked in interp_map. Given the
+	// forward projection of a prior, the projection is divided by it before interpolating and
+	// multiplied by it again after (normalized metal artefact reduction).
+	int Interpolate(int** interp_map, ProjBuffer* buf, FP_VAR** prior = NULL);
+
 	void Subtract(FP_VAR** pd2, FP_VAR ratio);
 
 	void CreateFilter(filter_type filter, double cutoff = 1.0);
 
+	// names the scan and everything Preprocess (and Filter, if filtered) depend on, for the
+	// sinogram cache. Empty if the scan has no StudyInstanceUID to identify it by.
+	string CacheKey(bool filtered);
+	// where the cache files go, NULL or "" for no cache (the default). With max_mb the oldest files
+	// in dir are removed to keep them all under it.
+	void SetSinogramCacheDir(const char* dir, long long max_mb = 0) { cache_dir = dir ? dir : ""; cache_budget = max_mb*1024*1024; }
+	void SetFilterThreads(int n);	// threads Filter splits the columns over, 0 uses every hardware thread. 1 by default,
+									// the pipeline filters alongside the backprojection threads
+	void SetSIMDLevel(simd_level max_level);	// caps the instruction set Preprocess and Filter use
+
 	unsigned short GetNumProj() { return num_proj; }
-	void CloseFindFile();
+	ScanGeometry GetScanGeometry();
+	void Rewind();		// LoadNextProj/ReadNext start again from the first projection
+	// memory the projection stack may use, in MB, reserved now: 0 for none (the default), negative
+	// for half the free memory. Set it before a reconstruction starts.
+	void SetStackBudget(long long megabytes) { stack.Reserve(rows, cols, num_proj, megabytes); }
+	const ProjectionStack& GetStack() { return stack; }	// empty until a pipeline has been through every projection
 
 	void WriteBin(char* filename);
+	void WriteBin(char* filename, ProjBuffer* buf);
 
 	friend class Reconstruction;
+	friend class ProjectionPipeline;
 
 private:
 	// directory
 	char dir[1024];				// location of source files
 
 	// projection parameters
-	unsigned short num_proj;	// number of projections
+	unsigned short num_proj;	// number of projections (in the index, the header's count is only checked against it)
 	unsigned short rows;		// rows
 	unsigned short cols;		// columns
 	double detectorRes;			// resolution
@@ -57,55 +197,75 @@ private:
 
 	// misc scan data
 	int kVp;					// x-ray voltage
+	char filterType[17];		// x-ray filter (SH)
+	char stationName[17];		// scanner (SH)
+	char studyUID[65];			// StudyInstanceUID (UI)
+	char seriesUID[65];			// SeriesInstanceUID (UI)
 	double pitch;				// mm per revolution (not used yet)
 
 	FP_VAR **blank;				// blank projection
 
+	// preprocessing tables
+	FP_VAR *log_lut;			// log of every possible count (LOG_LUT_SIZE)
+	FP_VAR *log_blank;			// log(blank), rows*cols
+	BHCurve bh_curve;			// beam hardening correction, from the calibration
+	bool bh_correct;			// false if the calibration has nothing for the scan
+	BHTable bh_table;			// bh_curve sampled for Preprocess
+	PreprocessKernel preprocess_kernel;
+
 	// current projection in memory
 	unsigned short *dataBuffer;	// buffer for loading dicom data
-	FP_VAR **pd;		// projection data
+	ProjBuffer *current;
+	FP_VAR **pd;		// projection data (current->pd)
 	double projAngle;	// angle of the current projection
 
 	// projection filters
-	FP_VAR *G;			// convolution function
+	int fft_length;		// columns are zero padded to this, the first fast FFT length >= 2*rows-1
+	const FilterResponse *response;	// convolution function, from the filter bank
+	filter_type filter_kind;	// what response is, for CacheKey
+	string cache_dir;			// sinogram cache directory, empty for none
+	long long cache_budget;		// bytes the files in cache_dir can take, 0 for no limit
+	double filter_cutoff;
+	SpectrumKernel spectrum_kernel;
 	FP_VAR **cos_theta; // cos(theta) scaling
-	FP_VAR *temp;		// temp buffer used for FFT transforms
+	fft_backend filter_backend;
+	bool real_filter;	// real transforms, for FFT_OOURA when fft_length is a power of 2, complex otherwise
+	WorkerPool *filter_pool;
+	FilterWorkspace **workspaces;	// one for each filter_pool thread
+
+	void FilterBlock(FP_VAR** pd, int j, int count, FilterWorkspace* ws);
+	void FilterBlockPairs(FP_VAR** pd, int j, int count, FilterWorkspace* ws);
+
+	// files
+	ProjectionIndex index;	// the blank scan and projections in the directory
+	int next_proj;			// next projection LoadNextProj/ReadNext read
+
+	int ReadPixels(const ProjectionEntry& entry, unsigned short* pixels);
 
-	// file io handle
-	intptr_t ff;			// Windows-specific file io using _findfirst and _findnext
+	ProjectionStack stack;	// the preprocessed projections, if they fit in the budget (SetStackBudget)
 };
 
 Projection::Projection(const char* newDir)
 {
-	_finddata_t data;
-	
 	int len;
-	char filename[MAX_PATH];
 
 	RootDicomObj* DCMObj;
+	const ProjectionEntry* entry;
 
 	int i,j;
 	double y,z;
 	char buffer[16];
 
-	char temp_str[64];
-
-	
-	FP_VAR offset = 0.0f;
-	FP_VAR slope = 0.0f;
-
 	memcpy(dir,newDir, strlen(newDir)+1);
 
-	// get the first file
-	sprintf_s(filename,MAX_PATH,"%s\\1.3.6.1.4.1*",dir);
-	if((ff = _findfirst(filename,&data)) == -1)
-	{
-		cout << "An error has occurred: " << errno;	// an error has occurred
-	}
+	// find the blank scan and the angle of every projection
+	if(!index.Build(dir))
+		cout << "An error has occurred: no projections found in " << dir << endl;
+	next_proj = 0;
 
-	// open the first file in the directory
-	sprintf_s(filename,MAX_PATH,"%s\\%s",dir,data.name);
-	DCMObj = new RootDicomObj(filename);
+	// the scan parameters are in every file, take them from the first projection
+	entry = index.GetNumProj() ? &index.GetProj(0) : index.GetBlank();
+	DCMObj = new RootDicomObj(entry ? entry->filename.c_str() : "", true);
 
 	// fill in rows, cols, num_proj, etc...
 	DCMObj->GetValue(0x0028,0x0010,&rows,sizeof(rows));
@@ -128,62 +288,90 @@ Projection::Projection(const char* newDir)
 	buffer[len] = 0;
 	kVp = atoi(buffer);
 
+	// the filter and scanner pick the beam hardening calibration, they're empty if they aren't there
+	len = DCMObj->GetValue(0x0018, 0x1160, filterType, sizeof(filterType)-1);	// filter type (SH)
+	filterType[len > 0 && len < int(sizeof(filterType)) ? len : 0] = 0;
+	len = DCMObj->GetValue(0x0008, 0x1010, stationName, sizeof(stationName)-1);	// station name (SH)
+	stationName[len > 0 && len < int(sizeof(stationName)) ? len : 0] = 0;
+	for(len=(int)strlen(filterType);len>0 && filterType[len-1]==' ';len--)	// drop the padding
+		filterType[len-1] = 0;
+	for(len=(int)strlen(stationName);len>0 && stationName[len-1]==' ';len--)
+		stationName[len-1] = 0;
+
+	// UIDs are padded with a 0 rather than a space
+	len = DCMObj->GetValue(0x0020, 0x000d, studyUID, sizeof(studyUID)-1);
+	studyUID[len > 0 && len < int(sizeof(studyUID)) ? len : 0] = 0;
+	len = DCMObj->GetValue(0x0020, 0x000e, seriesUID, sizeof(seriesUID)-1);
+	seriesUID[len > 0 && len < int(sizeof(seriesUID)) ? len : 0] = 0;
+
+	delete DCMObj;
+
+	index.Report(num_proj);
+	num_proj = (unsigned short)index.GetNumProj();
+
 	// allocate memory for scan and blank
-	pd = new FP_VAR*[rows];			// current working projection
+	current = new ProjBuffer(rows, cols);	// current working projection
+	pd = current->pd;
+	projAngle = 0;
 	blank = new FP_VAR*[rows];		// 
 
 	cos_theta = new FP_VAR*[rows];
-	G = new FP_VAR[2*rows];			// double the length to facilitate zero padding
-	temp = new FP_VAR[4*rows];
+	fft_length = FFTFastLength(2*rows-1);	// long enough that the convolution doesn't wrap around
+	spectrum_kernel = SelectSpectrumKernel(SIMD_AVX512);
+	filter_backend = GetFFTBackend();
+	real_filter = filter_backend == FFT_OOURA && (fft_length & (fft_length-1)) == 0;
+	filter_pool = NULL;
+	workspaces = NULL;
+	SetFilterThreads(1);
+	cache_budget = 0;
 
 	for(i=0;i<rows;i++)
 	{
-		pd[i] = new FP_VAR[cols];
 		blank[i] = new FP_VAR[cols];
 		cos_theta[i] = new FP_VAR[cols];
 	}
 
 	dataBuffer = new unsigned short[rows*cols];
 
-	// find the blank scan
+	// load the blank scan
 	cout << "Loading blank scan" << endl;
-	while(1)
+	entry = index.GetBlank();
+	if(entry && ReadPixels(*entry, dataBuffer))
 	{
-		// open the first file in the directory
-		sprintf_s(filename,MAX_PATH,"%s\\%s",dir,data.name);
-		DCMObj = new RootDicomObj(filename, true); //load header only
-
-		// check ImageType
-		DCMObj->GetValue(0x0008,0x0008,temp_str,sizeof(temp_str));
-		if(strstr(temp_str,"BLANK SCAN"))
-		{
-			// load the blank scan data
-			delete DCMObj;
-			DCMObj = new RootDicomObj(filename); // reload with the data
-
-			DCMObj->GetValue(0x7FE0,0x0010,(char*)dataBuffer, rows*cols*sizeof(dataBuffer));
-			for(i=0;i<rows;i++)
-			{
-				for(j=0; j<cols; j++)
-					blank[i][j] = dataBuffer[i*cols + j]; // + offset + slope*j;
-			}
-
-			break;
-		}
-		else if(_findnext(ff, &data) == -1L)
+		for(i=0;i<rows;i++)
 		{
-			cout << "Warning: blank scan not found." << endl;
-			for(i=0;i<rows;i++)
-				for(j=0;j<cols;j++)
-					blank[i][j] = 0.0;
-			break;
+			for(j=0; j<cols; j++)
+				blank[i][j] = dataBuffer[i*cols + j]; // + offset + slope*j;
 		}
-
-		delete DCMObj;
+	}
+	else
+	{
+		for(i=0;i<rows;i++)
+			for(j=0;j<cols;j++)
+				blank[i][j] = 0.0;
 	}
 
-	_findclose(ff);
-	ff = -1;
+	// log tables for Preprocess
+	log_lut = new FP_VAR[LOG_LUT_SIZE];
+	BuildLogLUT(log_lut);
+	log_blank = new FP_VAR[rows*cols];
+	for(i=0;i<rows;i++)
+		for(j=0;j<cols;j++)
+			log_blank[i*cols + j] = FP_VAR(log(double(blank[i][j])));
+	preprocess_kernel = SelectPreprocessKernel(SIMD_AVX512);
+
+	// empirical beam hardening correction
+	const BHCurve* curve = GetBHCalibration().Find(kVp, filterType, stationName);
+	bh_correct = curve != NULL;
+	bh_table.entries = NULL;
+	if(curve)
+	{
+		bh_curve = *curve;
+		BuildBHTable(&bh_table, bh_curve);
+	}
+	else
+		cout << "Warning: no beam hardening calibration for " << kVp << " kVp, filter " << filterType
+			 << ", scanner " << stationName << ". No correction applied." << endl;
 
 	// create cos_theta scaling map
 	for(i=0;i<rows;i++)
@@ -197,41 +385,69 @@ Projection::Projection(const char* newDir)
 	}
 
 	// initialize other filter to unity (no filtering)
-	for(i=0;i<(2*rows);i++)
-		G[i] = 1.0;
+	response = GetFilterBank().Get(nofilter, 1.0, fft_length);
+	filter_kind = nofilter;
+	filter_cutoff = 1.0;
 }
 
 Projection::~Projection()
 {
 	for(int i=0;i<rows;i++)
 	{
-		delete [] pd[i];
 		delete [] blank[i];
 		delete [] cos_theta[i];
 	}
 
-	delete [] pd;
+	delete current;
 	delete [] blank;
 	delete [] cos_theta;
-	delete [] G;
-	delete [] temp;
+	delete [] log_lut;
+	delete [] log_blank;
+	delete [] bh_table.entries;
+	for(int i=0;i<filter_pool->GetNumThreads();i++)
+		delete workspaces[i];
+	delete [] workspaces;
+	delete filter_pool;
 
 	delete [] dataBuffer;
 }
 
+ScanGeometry Projection::GetScanGeometry()
+{
+	ScanGeometry scan;
+
+	scan.sourceToDetector = sourceToDetector;
+	scan.sourceToAxis = sourceToAxis;
+	scan.detectorRes = detectorRes;
+	scan.det_rows = rows;
+	scan.det_cols = cols;
+
+	return scan;
+}
+
 float Projection::getYOffset()
+{
+	return getYOffset(projAngle);
+}
+
+float Projection::getZOffset()
+{
+	return getZOffset(projAngle);
+}
+
+float Projection::getYOffset(double angle)
 {
 	int n;
-	n = floor(projAngle+0.5);
+	n = floor(angle+0.5);
 	n += 180;			// projection angle is 180 from tube angle
 	n = n % 360;
 	return YOffset[n];
 }
 
-float Projection::getZOffset()
+float Projection::getZOffset(double angle)
 {
 	int n;
-	n = floor(projAngle+0.5);
+	n = floor(angle+0.5);
 	n += 180;			// projection angle is 180 from tube angle
 	n = n % 360;
 	return ZOffset[n];
@@ -239,20 +455,6 @@ float Projection::getZOffset()
 
 void Projection::CreateFilter(filter_type filter, double cutoff)
 {
-	int i;
-
-	double* w;
-
-	w = new double[rows+1];
-
-	for(i=0; i<=rows; i++)
-	{
-		G[i] = FP_VAR(i) / rows;
-		w[i] = M_PI * double(i) /rows;
-	}
-	for(i=rows*cutoff+1;i<=rows;i++)
-		G[i] = 0;
-
 	switch(filter)
 	{
 	case ramlak:
@@ -261,137 +463,297 @@ void Projection::CreateFilter(filter_type filter, double cutoff)
 
 	case shepplogan:
 		cout << "Shepp-Logan filter, " << cutoff << " cutoff." << endl;
-		for(i=1; i<=rows; i++)
-			G[i] *= sin(w[i]/(2*cutoff))/(w[i]/(2*cutoff));
 		break;
 
 	case hamming:
 		cout << "Hamming filter, " << cutoff << " cutoff." << endl;
-		for(i=1; i<=rows; i++)
-			G[i] *= 0.54 + 0.46 * cos(w[i]/cutoff);
 		break;
 
 	case hanning:
 		cout << "Hann filter, " << cutoff << " cutoff." << endl;
-		for(i=1; i<=rows; i++)
-			G[i] *= (1 + cos(w[i]/cutoff))/2;
 		break;
 
 	case cosine:
 		cout << "Cosine filter, " << cutoff << " cutoff." << endl;
-		for(i=1; i<=rows; i++)
-			G[i] *= cos(w[i]/(2*cutoff));
+		break;
+
+	case blackman:
+		cout << "Blackman filter, " << cutoff << " cutoff." << endl;
 		break;
 
 	default:
 		cout << "Unknown filter!" << endl;
-		for(i=0; i<=rows; i++)
-			G[i] = 1.0;
+		filter = nofilter;
 		break;
 	}
 
-	// mirror the filter
-	for(;i<(2*rows);i++)
+	response = GetFilterBank().Get(filter, cutoff, fft_length);
+	filter_kind = filter;
+	filter_cutoff = cutoff;
+}
+
+string Projection::CacheKey(bool filtered)
+{
+	ostringstream key;
+	size_t k;
+
+	if(!studyUID[0])
+		return "";
+
+	key.precision(17);
+	key << "study " << studyUID << " series " << seriesUID << " size " << rows << "x" << cols << "x" << num_proj;
+
+	key << " bh ";
+	if(!bh_correct)
+		key << "none";
+	else if(!bh_curve.spline)
+	{
+		key << "poly";
+		for(k=0;k<bh_curve.coef.size();k++)
+			key << " " << bh_curve.coef[k];
+	}
+	else
 	{
-		G[i] = G[2*rows-i];
+		key << "spline";
+		for(k=0;k<bh_curve.x.size();k++)
+			key << " " << bh_curve.x[k] << " " << bh_curve.y[k];
 	}
 
-	delete [] w;
+	if(filtered)
+		key << " filter " << int(filter_kind) << " " << filter_cutoff << " fft " << int(filter_backend);
+
+	return key.str();
 }
 
 int Projection::LoadNextProj()
 {
-	_finddata_t data;
+	if(!ReadNext(current))
+		return 0;
 
-	int i,j;
-	double P;
-	RootDicomObj* DCMObj;
+	Preprocess(current);
+	projAngle = current->projAngle;
 
-	bool done = false;
+	return 1;
+}
 
-	char temp[64];
-	char filespec[MAX_PATH];
-	char filename[MAX_PATH];
+int Projection::ReadNext(ProjBuffer* buf)
+{
+	// a file that can't be read is skipped, like a missing one
+	while(next_proj < index.GetNumProj())
+		if(ReadProj(next_proj++, buf))
+			return 1;
+
+	return 0;
+}
 
-	while(1)
+int Projection::ReadProj(int n, ProjBuffer* buf)
+{
+	if(n < 0 || n >= index.GetNumProj())
+		return 0;
+
+	const ProjectionEntry& entry = index.GetProj(n);
+	size_t bytes = size_t(rows)*cols*sizeof(unsigned short);
+
+	buf->projAngle = entry.angle;
+
+	// the counts are used straight from the mapped file, unless they aren't 2 byte aligned
+	// or it can't be mapped
+	if(entry.pixel_length >= bytes && entry.pixel_offset % 2 == 0 && buf->file.Open(entry.filename.c_str()))
 	{
-		if(ff == -1)	// load the first projection
-		{
-			sprintf_s(filespec,MAX_PATH,"%s\\1.3.6.1.4.1*",dir);
-			ff = _findfirst(filespec, &data);
-			if(ff == -1)	// no files found matching description
-				return 0;
-		}
-		else
+		if((size_t)entry.pixel_offset + bytes <= buf->file.Size())
 		{
-			if(_findnext(ff, &data) == -1)	// _findnext will return 0 if sucessful
-			{
-				_findclose(ff);			// close the file handle
-				ff = -1;
-				return 0;				// no next file found
-			}
+			buf->counts = (const unsigned short*)(buf->file.Data() + entry.pixel_offset);
+			return 1;
 		}
+	}
 
-		sprintf_s(filename,MAX_PATH,"%s\\%s",dir,data.name);	
-		DCMObj = new RootDicomObj(filename);
+	buf->UseRaw();
+	return ReadPixels(entry, buf->raw);
+}
 
-		DCMObj->GetValue(0x0008,0x0008,temp,sizeof(temp));
-		if(strstr(temp,"BLANK SCAN"))
-			delete DCMObj;
-		else
-			break;
+// copies rows*cols counts from where the index found the pixel data
+int Projection::ReadPixels(const ProjectionEntry& entry, unsigned short* pixels)
+{
+	size_t bytes = size_t(rows)*cols*sizeof(unsigned short);
+	ifstream f;
+
+	if(entry.pixel_length < bytes)
+	{
+		cout << "Error: " << entry.filename << " has " << entry.pixel_length << " bytes of pixel data, expected " << bytes << endl;
+		return 0;
+	}
+
+	f.open(entry.filename.c_str(), fstream::binary);
+	f.seekg(entry.pixel_offset, ios::beg);
+	f.read((char*)pixels, bytes);
+	if(!f)
+	{
+		cout << "Error: can't read the pixel data in " << entry.filename << endl;
+		return 0;
 	}
 
-	FP_VAR offset = 0.0f;
-	FP_VAR slope = 0.0f;
+	return 1;
+}
+
+void Projection::Preprocess(ProjBuffer* buf)
+{
+	for(int i=0;i<rows;i++)
+		preprocess_kernel(buf->pd[i], buf->counts + i*cols, log_blank + i*cols, log_lut, bh_correct ? &bh_table : NULL, cols);
+}
+
+void Projection::PreprocessReference(ProjBuffer* buf)
+{
+	int i,j;
+	double P;
 
-	DCMObj->GetValue(0x7FE0,0x0010,(char*)dataBuffer, rows*cols*sizeof(dataBuffer));
 	for(i=0;i<rows;i++)
 		for(j=0; j<cols; j++)
 		{
 				
-			P = log(blank[i][j]/(FP_VAR(dataBuffer[i*cols + j]))); // + offset+ slope*j)));
+			P = log(blank[i][j]/(FP_VAR(buf->counts[i*cols + j]))); // + offset+ slope*j)));
 
 			// empirical beam hardening correction
-			
-			switch(kVp)
-			{
-			case 45:	// empirical beam hardening for 45kVp
-				P = 0.8346*P + 0.1656*P*P + 0.0069*P*P*P;
-				break;
-			case 55:
-				P = 0.8260*P + 0.2111*P*P - 0.0042*P*P*P;
-				break;
-			case 65:
-				P = 0.8159*P + 0.2636*P*P - 0.0195*P*P*P;
-				break;
-			default:	// no correction
-				break;
-			}
-			
-			pd[i][j] = P;
+			if(bh_correct)
+				P = bh_curve.Evaluate(P);
+
+			buf->pd[i][j] = P;
 		}
+}
 
+void Projection::Rewind()
+{
+	next_proj = 0;
+}
 
-	DCMObj->GetValue(0x0009,0x1036,(char*)&projAngle, sizeof(projAngle));
+int Projection::Filter()
+{
+	return Filter(current);
+}
 
-	delete DCMObj;
+int Projection::Filter(ProjBuffer* buf)
+{
+	FP_VAR** pd = buf->pd;
 
-	return 1;
+	// convolve projection with filter, FILTER_BLOCK zero padded columns at a time.
+	// Each block is done the same way whichever thread gets it, so the result doesn't
+	// depend on the number of threads.
+	filter_pool->Run((cols + FILTER_BLOCK - 1) / FILTER_BLOCK, [&](int block, int thread)
+	{
+		int j = block * FILTER_BLOCK;
+
+		if(real_filter)
+			FilterBlock(pd, j, min(FILTER_BLOCK, cols-j), workspaces[thread]);
+		else
+			FilterBlockPairs(pd, j, min(FILTER_BLOCK, cols-j), workspaces[thread]);
+	});
+	
+	return 0;
 }
 
-void Projection::CloseFindFile()
+// columns j to j+count-1 as real transforms, with the cos(theta) scaling
+void Projection::FilterBlock(FP_VAR** pd, int j, int count, FilterWorkspace* ws)
 {
-	if(ff==-1)
-		return;
-	_findclose(ff);
-	ff = -1;
-	return;
+	int i,b;
+	FP_VAR* temp = ws->temp;
+	FP_VAR* col;
+	size_t dist = fft_length;		// floats between columns in temp
+
+	for(b=0;b<count;b++)
+	{
+		col = temp + b*dist;
+		for(i=0;i<rows;i++)
+			col[i] = pd[i][j+b] * cos_theta[i][j+b];
+		for(;i<fft_length;i++)
+			col[i] = 0;
+	}
+
+	ws->fwd_plan->ExecuteBatch(temp, count, dist);
+	for(b=0;b<count;b++)
+		spectrum_kernel(temp + b*dist, response->packed, fft_length);
+	ws->inv_plan->ExecuteBatch(temp, count, dist);
+
+	for(b=0;b<count;b++)
+	{
+		col = temp + b*dist;
+		for(i=0;i<rows;i++)
+			pd[i][j+b] = col[i];
+	}
 }
 
-int Projection::Filter()
+// columns j to j+count-1 two at a time, one as the real part and the next as the imaginary part
+// of a complex transform. G is real and symmetric so the two filtered columns don't mix.
+void Projection::FilterBlockPairs(FP_VAR** pd, int j, int count, FilterWorkspace* ws)
+{
+	int i,b;
+	int pairs = (count+1)/2;
+	bool odd = (count & 1) != 0;	// last transform has nothing in the imaginary part
+	FP_VAR* temp = ws->temp;
+	FP_VAR* col;
+	size_t dist = 2*fft_length;
+
+	for(b=0;b<pairs;b++)
+	{
+		col = temp + b*dist;
+		for(i=0;i<rows;i++)
+		{
+			col[2*i] = pd[i][j+2*b] * cos_theta[i][j+2*b];
+			col[2*i+1] = (odd && b == pairs-1) ? 0 : pd[i][j+2*b+1] * cos_theta[i][j+2*b+1];
+		}
+		for(;i<fft_length;i++)
+		{
+			col[2*i] = 0;
+			col[2*i+1] = 0;
+		}
+	}
+
+	ws->fwd_pair_plan->ExecuteBatch(temp, pairs, dist);
+	for(b=0;b<pairs;b++)
+		spectrum_kernel(temp + b*dist, response->interleaved, 2*fft_length);
+	ws->inv_pair_plan->ExecuteBatch(temp, pairs, dist);
+
+	for(b=0;b<pairs;b++)
+	{
+		col = temp + b*dist;
+		for(i=0;i<rows;i++)
+		{
+			pd[i][j+2*b] = col[2*i];
+			if(!odd || b < pairs-1)
+				pd[i][j+2*b+1] = col[2*i+1];
+		}
+	}
+}
+
+void Projection::SetSIMDLevel(simd_level max_level)
+{
+	preprocess_kernel = SelectPreprocessKernel(max_level);
+	spectrum_kernel = SelectSpectrumKernel(max_level);
+}
+
+void Projection::SetFilterThreads(int n)
+{
+	int i;
+
+	if(filter_pool)
+	{
+		for(i=0;i<filter_pool->GetNumThreads();i++)
+			delete workspaces[i];
+		delete [] workspaces;
+		delete filter_pool;
+	}
+
+	filter_pool = new WorkerPool(n);
+	workspaces = new FilterWorkspace*[filter_pool->GetNumThreads()];
+	for(i=0;i<filter_pool->GetNumThreads();i++)
+		workspaces[i] = new FilterWorkspace(fft_length, real_filter);
+}
+
+int Projection::FilterReference(ProjBuffer* buf)
 {
 	int i,j;
+	FP_VAR** pd = buf->pd;
+	FP_VAR* temp = workspaces[0]->temp;
+	FFTPlan fwd(fft_length, 1, false, FFT_OOURA);
+	FFTPlan inv(fft_length, -1, true, FFT_OOURA);
 
 	// cos(theta) scaling
 	for(i=0; i<rows; i++)
@@ -406,18 +768,18 @@ int Projection::Filter()
 			temp[2*i] = pd[i][j];
 			temp[2*i+1] = 0;
 		}
-		for(;i<(2*rows);i++)
+		for(;i<fft_length;i++)
 		{
 			temp[2*i] = 0;
 			temp[2*i+1] = 0;
 		}
-		fft(temp,2*rows,1);
-		for(i=0;i<(2*rows);i++)
+		fwd.Execute(temp);
+		for(i=0;i<fft_length;i++)
 		{
-			temp[2*i] *= G[i];
-			temp[2*i+1] *= G[i];
+			temp[2*i] *= response->G[i];
+			temp[2*i+1] *= response->G[i];
 		}
-		fft(temp,2*rows,-1);
+		inv.Execute(temp);
 		for(i=0;i<rows;i++)
 			pd[i][j] = temp[2*i];
 	}
@@ -426,29 +788,55 @@ int Projection::Filter()
 }
 
 int Projection::Interpolate(int** interp_map)
+{
+	return Interpolate(interp_map, current);
+}
+
+int Projection::Interpolate(int** interp_map, ProjBuffer* buf, FP_VAR** prior)
 {
 	int i,j;
+	FP_VAR** pd = buf->pd;
 
 	int int_start, int_end;
 
 	int n;
+	FP_VAR lo, hi;
 	float delta;
-	
+	FP_VAR min_prior = 0;	// smallest prior divided by, so rays that barely touch anything aren't blown up
+
+	if(prior)
+	{
+		for(i=0;i<rows;i++)
+			for(j=0;j<cols;j++)
+				min_prior = max(min_prior, prior[i][j]);
+		min_prior *= FP_VAR(1e-3);
+		if(!(min_prior > 0))
+			prior = NULL;
+	}
+	auto norm = [&](int row, int col) { return prior ? max(prior[row][col], min_prior) : FP_VAR(1); };
+
 	for (j=0;j<cols;j++)
 	{
 		for(i=0;i<rows;i++)
 		{
 			if(interp_map[i][j])
 			{
-				int_start = i-1;
-				while(interp_map[i][j])
+				// pixels int_start..int_end are marked
+				int_start = i;
+				while(i < rows && interp_map[i][j])
 					i++;
 				int_end = i-1;
-				delta = (pd[int_end+1][j] - pd[int_start - 1][j])/(int_end - int_start + 2);
-				for(n=int_start;n<=int_end;n++)
-					pd[n][j] = pd[int_start-1][j] + (n - int_start + 1) * delta;
 
-				i = int_end+1;
+				// the whole column, nothing to go on
+				if(int_start == 0 && int_end == rows-1)
+					continue;
+
+				// from the good pixel on either side, or level with the one there is at the ends
+				lo = int_start > 0 ? pd[int_start-1][j] / norm(int_start-1, j) : pd[int_end+1][j] / norm(int_end+1, j);
+				hi = int_end < rows-1 ? pd[int_end+1][j] / norm(int_end+1, j) : lo;
+				delta = (hi - lo)/(int_end - int_start + 2);
+				for(n=int_start;n<=int_end;n++)
+					pd[n][j] = (lo + (n - int_start + 1) * delta) * norm(n, j);
 			}
 		}
 
@@ -466,31 +854,96 @@ void Projection::Subtract(FP_VAR **pd2, FP_VAR ratio)
 }
 
 void Projection::WriteBin(char* filename)
+{
+	WriteBin(filename, current);
+}
+
+void Projection::WriteBin(char* filename, ProjBuffer* buf)
 {
 	int i;
 	ofstream fout;
 
 	fout.open(filename,ios::binary);
 	for(i=0;i<rows;i++)
-		fout.write(reinterpret_cast<char*>(pd[i]),cols*sizeof(FP_VAR));
+		fout.write(reinterpret_cast<char*>(buf->pd[i]),cols*sizeof(FP_VAR));
 	fout.close();
 }
 
+#include "pipeline.h"
+
+// how a reconstruction reports back to whoever started it. The GUI posts these to its
+// window, the command line version prints them.
+class ReconCallback
+{
+public:
+	virtual ~ReconCallback() {}
+
+	virtual void Progress(int done, int total) {}	// after each batch of projections
+	virtual void Complete() {}						// the reconstruction finished (not called if it was cancelled)
+	virtual bool Cancelled() { return false; }		// polled between batches, true stops the reconstruction
+};
+
+#ifdef _WIN32
+// forwards progress to a window as WM_UPDATE_RECON/WM_RECON_COMPLETE messages
+class WindowCallback : public ReconCallback
+{
+public:
+	WindowCallback() : hwnd(NULL) {}
+	void SetHWND(HWND newHwnd) { hwnd = newHwnd; }
+
+	void Progress(int done, int total) { PostMessage(hwnd,WM_UPDATE_RECON,MAKEWPARAM(done,total),NULL); }
+	void Complete() { PostMessage(hwnd,WM_RECON_COMPLETE,NULL,NULL); }
+
+private:
+	HWND hwnd;
+};
+#endif
+
+// slices i_start..i_end-1 of one column (row j, column k) of the volume, for the forward projector
+struct VoxelRun
+{
+	int j, k;
+	int i_start, i_end;
+};
+
+// how RemoveMetal fills in the metal trace: straight across it, or normalized by the
+// forward projection of a tissue class prior made from the first reconstruction (NMAR)
+enum metal_mode {METAL_LINEAR, METAL_NMAR};
+
 class Reconstruction
 {
 public:
-	Reconstruction(int newSlices, int newRows, int newCols, double newRes, Projection* newProj, char* filename = NULL);	// loads a reconstruction from a file
+	Reconstruction(int newSlices, int newRows, int newCols, double newRes, Projection* newProj, char* filename = NULL,	// loads a reconstruction from a file
+				   axis_order newOrder = ORDER_ROW_COL_SLICE, bool hugePages = false);
+	// region of interest: centre and size (x,y,z) in mm relative to the rotation axis
+	Reconstruction(const double roi_center[3], const double roi_extent[3], double newRes, Projection* newProj,
+				   axis_order newOrder = ORDER_ROW_COL_SLICE, bool hugePages = false);
 	~Reconstruction();
 
 	void Backproject();
 	void RemoveMetal();		// 
 	void SetMetalThreshold(double new_thresh) { threshold = new_thresh; }
+	void SetMetalDilation(int voxels) { metal_radius = max(voxels, 0); }	// grows the metal by this radius before tracing it
+	void SetMetalMode(metal_mode mode) { metal_method = mode; }
+	void SetDiagnosticsFile(const char* filename) { diagnostics_file = filename ? filename : ""; }	// see diagnostics.h, NULL or "" for none (the default)
+	void SetNumThreads(int n);	// 0 uses every hardware thread
+	void SetSIMDLevel(simd_level max_level) { slice_kernel = SelectSliceKernel(max_level); }	// caps the instruction set used
+	void SetFOVMask(bool mask);	// only reconstruct the cylinder inscribed in the x/y extent of the volume
+	void SetPipelineSlots(int n) { pipeline_slots = n; }	// projection buffers shared by the load/filter/backproject stages
+	void SetBatchSize(int n) { batch_size = n; }	// projections applied to each voxel column per pass, 0 = auto, 1 = one at a time
 	
 	int WriteDicom(char* out_file);
 	void WriteBin(char* out_file);
 
 	void CancelRecon() { cancel = true; }
-	void SetHWND(HWND hwnd) {hApp = hwnd;}
+	void SetCallback(ReconCallback* newCallback) { callback = newCallback ? newCallback : &null_callback; }
+
+	// copies the middle slice as it was after the last batch, rows*cols values.
+	// Returns false if the reconstruction thread held on to it for too long.
+	bool GetDisplaySlice(FP_VAR* slice);
+
+#ifdef _WIN32
+	void SetHWND(HWND hwnd) { window_callback.SetHWND(hwnd); SetCallback(&window_callback); }
 	HBITMAP GetBitmap();
 
 	static unsigned __stdcall ReconThread(void* thread_param)
@@ -508,188 +961,435 @@ public:
 		Reconstruction* pThis = (Reconstruction*)thread_param;
 		pThis->cancel = false;
 		pThis->RemoveMetal();
-		SendMessage(pThis->hApp,WM_RECON_COMPLETE,NULL,NULL);
 		_endthreadex(0);
 
 		return 0;	// never reached...
 	}
+#endif
 
 private:
+	void Init(char* filename);
+	bool CheckCancel();
+	void UpdateDisplay(int n);	// copies the middle slice to display_slice and reports progress
+	void ComputeGeometry(ProjBuffer* buf, int b = 0);		// fills in geom[b] for the projection in buf
+	// backprojects bufs[0..count-1] into rows j_start..j_end-1 using geom[0..count-1]
+	void BackprojectRows(ProjBuffer** bufs, int count, int j_start, int j_end, int thread);
+	void BackprojectAll(ProjBuffer** bufs, int count);
+	int GetSlabRows();
+	int GetBatchSize();
+	void AllocGeometry(int n);
+	// the voxels of vol above threshold, dilated by metal_radius, as runs sorted by row and column
+	void FindMetal(Volume* vol, vector<VoxelRun>* metal);
+	// the NMAR prior of vol: air 0, soft tissue and metal the mean soft tissue value and bone
+	// as it is, with the voxels that aren't 0 as runs. NULL (with a warning) if the threshold
+	// isn't above 0 or vol can't be split into the classes.
+	Volume* MakePrior(Volume* vol, vector<VoxelRun>* runs);
+	// projects the runs (from vol, or 1 for every voxel if vol is NULL) onto the detector for geom[0],
+	// the projection at angle, into out. The metal trace is where the metal projects to anything.
+	void ForwardProject(const vector<VoxelRun>& runs, Volume* vol, double angle, FP_VAR** out);
+
 	Projection *proj;
-	FP_VAR*** recon;
+	Volume* recon;
+	axis_order order;	// memory layout of recon
+	bool huge_pages;
 
-	FP_VAR** display_slice;
+	FP_VAR* display_slice;	// rows*cols copy of the middle slice
 
 	double res;
 	int slices;
 	int rows;
 	int cols;
 
+	double center[3];	// x,y,z of the middle of the volume in mm (0,0,0 is on the rotation axis)
+
 	double* x;
 	double* y;
 	double* z;
 
-	FP_VAR threshold;
+	ProjectionGeometry** geom;	// geometry of each projection in the current batch
+	int num_geom;
+	double fov_radius;			// cylinder mask applied to every geometry table, 0 for none
 
-	bool cancel;
-	HWND hApp;
-	HANDLE hMutex;
+	FP_VAR threshold;
+	int metal_radius;	// voxels
+	metal_mode metal_method;
+	string diagnostics_file;	// empty for none
+
+	WorkerPool* pool;	// threads used to split the volume up by rows
+	FP_VAR** col_buf;	// one voxel column per thread for the slice kernel
+	SliceKernel slice_kernel;
+
+	int pipeline_slots;	// projections in flight between loading and backprojection
+	int batch_size;		// projections backprojected together, 0 picks one from the cache size
+
+	volatile bool cancel;
+	ReconCallback* callback;
+	ReconCallback null_callback;	// used when nobody is listening
+#ifdef _WIN32
+	WindowCallback window_callback;
+#endif
+	timed_mutex display_mutex;		// guards display_slice
 };
 
-Reconstruction::Reconstruction(int newSlices, int newRows, int newCols, double newRes, Projection* newProj, char* filename)
-:slices(newSlices),rows(newRows), cols(newCols), res(newRes), proj(newProj)
+Reconstruction::Reconstruction(int newSlices, int newRows, int newCols, double newRes, Projection* newProj, char* filename,
+							   axis_order newOrder, bool hugePages)
+:proj(newProj), order(newOrder), huge_pages(hugePages), res(newRes), slices(newSlices), rows(newRows), cols(newCols)
 {
-	int i,j;
+	center[0] = center[1] = center[2] = 0.0;
+	Init(filename);
+}
+
+Reconstruction::Reconstruction(const double roi_center[3], const double roi_extent[3], double newRes, Projection* newProj,
+							   axis_order newOrder, bool hugePages)
+:proj(newProj), order(newOrder), huge_pages(hugePages), res(newRes)
+{
+	// round the extent up to a whole number of voxels
+	cols = max(1, (int)ceil(roi_extent[0]/res - 1e-6));
+	rows = max(1, (int)ceil(roi_extent[1]/res - 1e-6));
+	slices = max(1, (int)ceil(roi_extent[2]/res - 1e-6));
+
+	center[0] = roi_center[0];
+	center[1] = roi_center[1];
+	center[2] = roi_center[2];
+
+	cout << "ROI " << cols << " x " << rows << " x " << slices << " voxels centred at ("
+		 << center[0] << ", " << center[1] << ", " << center[2] << ") mm" << endl;
+
+	Init(NULL);
+}
+
+void Reconstruction::Init(char* filename)
+{
+	int i;
 	ifstream f;
 
 	cancel = false;
-	hMutex = CreateMutex(NULL, FALSE, NULL);
+	callback = &null_callback;
 	threshold = 10.0;
+	metal_radius = 0;
+	metal_method = METAL_LINEAR;
+	pool = new WorkerPool();
+	slice_kernel = SelectSliceKernel(SIMD_AVX512);
+	pipeline_slots = 4;
+	batch_size = 0;
 
-	// allocate memory
-	recon = new FP_VAR**[slices];
-	for(i=0;i<slices;i++)
-		recon[i] = new FP_VAR*[rows];
-	for(i=0;i<slices;i++)
-		for(j=0;j<rows;j++)
-		{
-			recon[i][j] = new FP_VAR[cols];
-			memset(recon[i][j],0,cols*sizeof(FP_VAR));	// initialize to zero...
-		}
+	col_buf = new FP_VAR*[pool->GetNumThreads()];
+	for(i=0;i<pool->GetNumThreads();i++)
+		col_buf[i] = new FP_VAR[slices];
 
-	display_slice = new FP_VAR*[rows];
-	for(i=0;i<rows;i++)
-		display_slice[i] = new FP_VAR[cols];
+	// allocate memory (initialized to zero)
+	recon = new Volume(slices, rows, cols, order, huge_pages);
+
+	display_slice = new FP_VAR[rows*cols];
+	memset(display_slice,0,rows*cols*sizeof(FP_VAR));
 
 	z = new double[slices];
 	for(i=0;i<slices;i++)
-		z[i] = res * (i - (slices-1.0)/2);
+		z[i] = center[2] + res * (i - (slices-1.0)/2);
 
 	y = new double[rows];
 	for(i=0;i<rows;i++)
-		y[i] = res * (i - (rows-1.0)/2);
+		y[i] = center[1] + res * (i - (rows-1.0)/2);
 
 	x = new double[cols];
 	for(i=0;i<cols;i++)
-		x[i] = res * (i - (cols-1.0)/2);
+		x[i] = center[0] + res * (i - (cols-1.0)/2);
+
+	geom = NULL;
+	num_geom = 0;
+	fov_radius = 0;
+	AllocGeometry(1);
 
 	if(filename)
 	{
 		f.open(filename,ios::binary);
-
-		for(i=0;i<slices;i++)
-			for(j=0;j<rows;j++)
-				f.read(reinterpret_cast<char*>(recon[i][j]),cols*sizeof(FP_VAR));
+		recon->Read(f);
 		f.close();
 	}
 }
 
 void Reconstruction::Backproject()
 {
-	int i,j,k;
+	unsigned short n=0;
+	int b, count;
+
+	// a batch of projections stays in memory while each voxel column is updated with all
+	// of them, so the volume is streamed through once per batch rather than once per projection
+	int batch = GetBatchSize();
+	AllocGeometry(batch);
+
+	ProjectionPipeline pipeline(proj, pipeline_slots + batch);
+	ProjBuffer** batch_buf = new ProjBuffer*[batch];
+
+	recon->Zero();
+
+	// loading and filtering run on their own threads while the pool backprojects
+	pipeline.Start();
+
+	count = batch;
+	while(count == batch)
+	{
+		for(count=0;count<batch;count++)
+		{
+			if((batch_buf[count] = pipeline.Next()) == NULL)
+				break;
+
+			cout << batch_buf[count]->projAngle << "" << endl;
+			// proj->Interpolate(0.6);
+
+			ComputeGeometry(batch_buf[count], count);
+		}
+		if(count == 0)
+			break;
+
+		BackprojectAll(batch_buf, count);
+		for(b=0;b<count;b++)
+			pipeline.Release(batch_buf[b]);
+		n += count;
+
+		// check for cancel after each batch
+		if(CheckCancel())
+		{
+			pipeline.Stop();
+			delete [] batch_buf;
+			// should reset progress bar
+			return;
+		}
+
+		UpdateDisplay(n);
+	}
+	pipeline.Stop();
+	pipeline.PrintStats();
+	delete [] batch_buf;
+
+	// annouce that reconstruction is finished and reset progress bar
+	callback->Complete();
+
+}
+
+bool Reconstruction::CheckCancel()
+{
+	if(callback->Cancelled())
+		cancel = true;
+	return cancel;
+}
+
+void Reconstruction::UpdateDisplay(int n)
+{
+	int j,k;
+
+	// copy current recon into display_slice
+	if(display_mutex.try_lock_for(chrono::milliseconds(1000)))
+	{
+		for(j=0;j<rows;j++)
+			for(k=0;k<cols;k++)
+				display_slice[j*cols + k] = (*recon)(slices/2,j,k);
+		display_mutex.unlock();
+	}
+	callback->Progress(n,proj->num_proj);
+}
+
+bool Reconstruction::GetDisplaySlice(FP_VAR* slice)
+{
+	if(!display_mutex.try_lock_for(chrono::milliseconds(1000)))
+		return false;
+
+	memcpy(slice, display_slice, rows*cols*sizeof(FP_VAR));
+	display_mutex.unlock();
+	return true;
+}
+
+int Reconstruction::GetSlabRows()
+{
+	int slab_rows;
+
+	slab_rows = rows / (4 * pool->GetNumThreads());	// a few slabs per thread to even out the load
+	if(slab_rows < 1)
+		slab_rows = 1;
+
+	return slab_rows;
+}
+
+void Reconstruction::ComputeGeometry(ProjBuffer* buf, int b)
+{
 	double cos_theta, sin_theta;
 	double YOffset, ZOffset;
-	double x_r, y_r;		// rotated x,y coordinates
-	double y_p, z_p;		// projected y,z coordinates
-	int fy, fz;
-	double dy, dz;
-	double scale;
+	ScanGeometry scan;
+	int slab_rows;
 
-	unsigned short n=0;
+	cos_theta = cos(M_PI*(buf->projAngle + 90)/180);
+	sin_theta = sin(M_PI*(buf->projAngle + 90)/180);
+	YOffset = proj->getYOffset(buf->projAngle);
+	ZOffset = proj->getZOffset(buf->projAngle);
+	scan = proj->GetScanGeometry();
 
-	DWORD dwWaitResult;
+	slab_rows = GetSlabRows();
+	pool->Run((rows + slab_rows - 1) / slab_rows, [&](int slab, int thread)
+	{
+		int j_start = slab * slab_rows;
+		int j_end = min(j_start + slab_rows, rows);
+		geom[b]->Compute(scan, cos_theta, sin_theta, YOffset, ZOffset, j_start, j_end);
+	});
+}
 
-	for(i=0;i<slices;i++)
-		for(j=0;j<rows;j++)
-			memset(recon[i][j],0,cols*sizeof(FP_VAR));	// initialize memory to zero...
+// number of projections to keep resident for a batched backprojection.
+// Every projection in a batch is read for each voxel column, so the batch should fit in
+// about half the L3 (or L2 if there's no L3), leaving the rest for the columns and tables.
+int Reconstruction::GetBatchSize()
+{
+	const int max_batch = 16;	// the geometry tables cost rows*cols*sizeof(ColumnGeometry) each
+	size_t l2, l3, cache, proj_bytes;
+	int n;
+
+	if(batch_size > 0)
+		return batch_size;
 
-	proj->LoadNextProj();	// get rid of intial 270???
+	GetCacheSizes(&l2, &l3);
+	cache = l3 ? l3 : l2;
+	if(cache == 0)
+		cache = 8 << 20;
+
+	proj_bytes = (size_t)proj->rows * proj->cols * sizeof(FP_VAR);
+	n = (int)(cache / 2 / proj_bytes);
+	n = min(max(n, 1), max_batch);
+
+	cout << "Backprojecting " << n << " projections per pass (" << (cache >> 10) << " KB cache, "
+		 << (proj_bytes >> 10) << " KB per projection)" << endl;
+
+	return n;
+}
+
+void Reconstruction::AllocGeometry(int n)
+{
+	int b;
+	ProjectionGeometry** new_geom;
+
+	if(n <= num_geom)
+		return;
 
-	while(proj->LoadNextProj())
+	new_geom = new ProjectionGeometry*[n];
+	for(b=0;b<n;b++)
 	{
-		n++;
+		if(b < num_geom)
+			new_geom[b] = geom[b];
+		else
+		{
+			new_geom[b] = new ProjectionGeometry(slices, rows, cols, x, y, z[0], res);
+			new_geom[b]->SetCylinder(fov_radius);
+		}
+	}
 
-		cout << proj->projAngle << "" << endl;
-		// proj->Interpolate(0.6);
-		proj->Filter();
+	delete [] geom;
+	geom = new_geom;
+	num_geom = n;
+}
 
-		cos_theta = cos(M_PI*(proj->projAngle + 90)/180);
-		sin_theta = sin(M_PI*(proj->projAngle + 90)/180);
-		YOffset = proj->getYOffset();
-		ZOffset = proj->getZOffset();
+// splits the volume into slabs of rows and hands them to the worker pool.
+// Every voxel is only touched by one thread, so the result is the same for any number of threads.
+void Reconstruction::BackprojectAll(ProjBuffer** bufs, int count)
+{
+	int slab_rows;
 
-		for(j=0;j<rows;j++)
+	slab_rows = GetSlabRows();
+	pool->Run((rows + slab_rows - 1) / slab_rows, [&](int slab, int thread)
+	{
+		int j_start = slab * slab_rows;
+		int j_end = min(j_start + slab_rows, rows);
+		BackprojectRows(bufs, count, j_start, j_end, thread);
+	});
+}
+
+// each voxel column is the block: it's loaded once and every projection in the batch is
+// added to it while it's in cache. The projections are added in order, so a voxel sees
+// exactly the same sums as it would one projection at a time.
+void Reconstruction::BackprojectRows(ProjBuffer** bufs, int count, int j_start, int j_end, int thread)
+{
+	int b,i,j,k;
+	ColumnGeometry* c;
+
+	FP_VAR* col;
+	size_t stride = recon->SliceStride();
+
+	for(j=j_start;j<j_end;j++)
+	{
+		// the mask is the same for every table
+		for(k=geom[0]->ColStart(j);k<geom[0]->ColEnd(j);k++)
 		{
-			for(k=0;k<cols;k++)
+			// the kernel needs the column to be contiguous, otherwise go through a buffer
+			col = recon->Column(j,k);
+			if(stride != 1)
 			{
-				x_r = x[k] * cos_theta + y[j] * sin_theta;
-				y_r = -x[k] * sin_theta + y[j] * cos_theta;
-				y_p = y_r * (proj->sourceToDetector/(proj->sourceToAxis + x_r)) + YOffset;		// in mm
-				y_p = ((proj->rows-1.0)/2.0) - (y_p/proj->detectorRes);
+				col = col_buf[thread];
+				for(i=0;i<slices;i++)
+					col[i] = (*recon)(i,j,k);
+			}
 
-				scale = proj->sourceToAxis /(proj->sourceToAxis - x_r);
-				scale *= scale;
+			for(b=0;b<count;b++)
+			{
+				c = &(*geom[b])(j,k);
 
-				for(i=0;i<slices;i++)
-				{
-					
-					z_p = z[i] * (proj->sourceToDetector/(proj->sourceToAxis + x_r)) + ZOffset;	// in mm
-					z_p = (z_p/proj->detectorRes) + ((proj->cols-1.0)/2.0);
-						
-					fy = floor(y_p);
-					fz = floor(z_p);
-
-					dy = y_p - fy;
-					dz = z_p - fz;
-
-					if( (fy>0) && (fy < ( proj->rows - 1)) && (fz>0) && (fz<(proj->cols - 1)) )
-						recon[i][j][k] += scale * 
-									  (proj->pd[fy][fz] * (1-dy) * (1-dz) +	// bilinear interpolation
-									  proj->pd[fy+1][fz] * dy * (1-dz) +
-									  proj->pd[fy][fz+1] * (1-dy) * dz +
-									  proj->pd[fy+1][fz+1] * dy * dz);
+				// the whole column misses the detector
+				if(c->i_start >= c->i_end)
+					continue;
 
-				}
-				// check for cancel after each iteration
-				if(cancel)
-				{
-					proj->CloseFindFile();
-					// should reset progress bar
-					return;
-				}
+				slice_kernel(col, bufs[b]->pd[c->fy], bufs[b]->pd[c->fy+1], c->dy, c->zp0, c->dzp, c->scale, proj->cols, c->i_start, c->i_end);
 			}
+
+			if(stride != 1)
+				for(i=0;i<slices;i++)
+					(*recon)(i,j,k) = col[i];
+
+			// check for cancel after each column
+			if(cancel)
+				return;
 		}
-		// copy current recon into display_slice
-		dwWaitResult = WaitForSingleObject(hMutex,1000);
-		if(dwWaitResult == WAIT_OBJECT_0)
-		{
-			for(j=0;j<rows;j++)
-				for(k=0;k<cols;k++)
-					display_slice[j][k] = recon[slices/2][j][k];
-			ReleaseMutex(hMutex);
-		}
-		PostMessage(hApp,WM_UPDATE_RECON,MAKEWPARAM(n,proj->num_proj),NULL);
 	}
-	// annouce that reconstruction is finished and reset progress bar
-	PostMessage(hApp,WM_RECON_COMPLETE,NULL,NULL);
+}
 
+void Reconstruction::SetFOVMask(bool mask)
+{
+	if(mask)
+		fov_radius = res * min(rows, cols) / 2.0;
+	else
+		fov_radius = 0;
+
+	for(int b=0;b<num_geom;b++)
+		geom[b]->SetCylinder(fov_radius);
+}
+
+void Reconstruction::SetNumThreads(int n)
+{
+	int i;
+
+	for(i=0;i<pool->GetNumThreads();i++)
+		delete [] col_buf[i];
+	delete [] col_buf;
+	delete pool;
+
+	pool = new WorkerPool(n);
+	col_buf = new FP_VAR*[pool->GetNumThreads()];
+	for(i=0;i<pool->GetNumThreads();i++)
+		col_buf[i] = new FP_VAR[slices];
 }
 
 Reconstruction::~Reconstruction()
 {
-	int i,j;
+	int i;
 
-	for(i=0;i<slices;i++)
-		for(j=0;j<rows;j++)
-			delete [] recon[i][j];
-	for(i=0;i<slices;i++)
-		delete [] recon[i];
-	delete [] recon;
+	delete recon;
+	delete [] display_slice;
 
+	for(i=0;i<num_geom;i++)
+		delete geom[i];
+	delete [] geom;
 	delete [] x;
 	delete [] y;
 	delete [] z;
 
+	for(i=0;i<pool->GetNumThreads();i++)
+		delete [] col_buf[i];
+	delete [] col_buf;
+	delete pool;
 }
 
 
@@ -714,20 +1414,20 @@ int Reconstruction::WriteDicom(char* out_file)
 
 	ofstream f;
 
-	intptr_t ff;			// Windows-specific file io using _findfirst and _findnext
-	_finddata_t data;
+	FileFinder finder;
+	char name[MAX_PATH];
 	char filename[MAX_PATH];
 
 	// get a Dicom Structure with the scan data
-	sprintf_s(filename,MAX_PATH,"%s\\1.3.6.1.4.1*",proj->dir);
-	if((ff = _findfirst(filename,&data)) == -1)
+	name[0] = 0;
+	if(!finder.First(proj->dir,"1.3.6.1.4.1*",name,sizeof(name)))
 	{
 		cout << "An error has occurred: " << errno;	// an error has occurred
 	}
-	_findclose(ff);
+	finder.Close();
 
 	// open the first file in the directory
-	sprintf_s(filename,MAX_PATH,"%s\\%s",proj->dir,data.name);
+	sprintf_s(filename,MAX_PATH,"%s" PATH_SEP "%s",proj->dir,name);
 	proj_dcm = new RootDicomObj(filename);
 
 	time(&_Time);
@@ -980,7 +1680,8 @@ int Reconstruction::WriteDicom(char* out_file)
 	DE = new DataElement(0x0020,0x0012,"IS",len,temp);	// AcquisitionNumber
 	DCMObj->SetElement(DE);
 
-	len = sprintf_s(temp, 256,"%.1f\\%.1f\\%.1f", (res*cols)/2, (res*rows)/2, (res*slices)/2); // fix this to handle odd numbers
+	// centre of the first voxel written: rows and slices are reversed and x is flipped by the orientation below
+	len = sprintf_s(temp, 256,"%.4f\\%.4f\\%.4f", res*(cols-1)/2 - center[0], res*(rows-1)/2 + center[1], res*(slices-1)/2 + center[2]);
 	DE = new DataElement(0x0020,0x0032,"DS",len,temp);	// ImagePositionPatient ***
 	DCMObj->SetElement(DE);
 	len = sprintf_s(temp, 256,"-1\\0\\0\\0\\-1\\0");
@@ -1064,7 +1765,7 @@ int Reconstruction::WriteDicom(char* out_file)
 	for(i=0;i<slices;i++)	
 		for(j=0;j<rows;j++)
 			for(k=0;k<cols;k++)
-				p_us[i*rows*cols+j*cols+k] = max(100 * recon[slices-1-i][rows-1-j][k],0.0);  // reverse the slice and row order for the DICOM file
+				p_us[i*rows*cols+j*cols+k] = max(100 * (*recon)(slices-1-i,rows-1-j,k),0.0f);  // reverse the slice and row order for the DICOM file
 	DE = new DataElement(0x7fe0,0x0010,"OW",len,(char*)p_us);	// PixelRepresentation
 	DCMObj->SetElement(DE);
 	delete [] p_us;
@@ -1080,19 +1781,16 @@ int Reconstruction::WriteDicom(char* out_file)
 
 void Reconstruction::WriteBin(char* out_file)
 {
-	int i,j;
 	ofstream f;
 
 	f.open(out_file,fstream::binary|fstream::out);
-	for(i=0;i<slices;i++)
-		for(j=0;j<rows;j++)
-				f.write(reinterpret_cast<char*>(recon[i][j]),cols*sizeof(FP_VAR));
+	recon->Write(f);
 	f.close();
 }
 
+#ifdef _WIN32
 HBITMAP Reconstruction::GetBitmap()
 {
-	DWORD dwWaitResult;
 	int i,j;
 
 	HBITMAP hBMP = NULL;
@@ -1104,29 +1802,28 @@ HBITMAP Reconstruction::GetBitmap()
 	DWORD *pixel_data;
 	pixel_data = new DWORD[rows*cols];
 	
-	dwWaitResult = WaitForSingleObject(hMutex, 1000);
-	if(dwWaitResult == WAIT_OBJECT_0)
+	if(display_mutex.try_lock_for(chrono::milliseconds(1000)))
 	{
 		// find maximum and minimum
 		for(i=0;i<rows;i++)
-			for(j=0;j<rows;j++)
+			for(j=0;j<cols;j++)
 			{
-				if(display_slice[i][j] > max)
-					max = display_slice[i][j];
-				//else if(display_slice[i][j] < min)
-				//	min = display_slice[i][j];
+				if(display_slice[i*cols + j] > max)
+					max = display_slice[i*cols + j];
+				//else if(display_slice[i*cols + j] < min)
+				//	min = display_slice[i*cols + j];
 			}
 
 		for(i=0;i<rows;i++)
-			for(j=0;j<rows;j++)
+			for(j=0;j<cols;j++)
 			{
-				if(display_slice[i][j] > 0)
-					temp_us = 255 * (display_slice[i][j] - min)/(max - min);
+				if(display_slice[i*cols + j] > 0)
+					temp_us = 255 * (display_slice[i*cols + j] - min)/(max - min);
 				else
 					temp_us = 0;
 				pixel_data[i*cols + j] = temp_us | (temp_us << 8) | (temp_us << 16);
 			}
-		ReleaseMutex(hMutex);
+		display_mutex.unlock();
 
 		hBMP = CreateBitmap(cols,rows,1,32,pixel_data);
 	}
@@ -1134,177 +1831,388 @@ HBITMAP Reconstruction::GetBitmap()
 	delete [] pixel_data;
 	return hBMP;
 }
+#endif
 
-void Reconstruction::RemoveMetal()
+void Reconstruction::FindMetal(Volume* vol, vector<VoxelRun>* metal)
 {
 	int i,j,k;
-	int n;
-	FP_VAR*** temp_recon;
-	int** temp_proj;
-	double YOffset, ZOffset;
-	
-	double x_r, y_r;		// rotated x,y cooredinates
-	double y_p, z_p;	//	projected y,z coordinates
-	int fy, fz;
-	double dy, dz;
-	double scale;
-
-	double cos_theta, sin_theta;
+	int di,dj,dk;
+	int r = metal_radius;
+	VoxelRun run;
+	vector<unsigned char> mask;
 
-	DWORD dwWaitResult;
-
-	ofstream f;
-
-	// allocate memory
-	temp_proj = new int*[proj->rows];
-	for(i=0;i<proj->rows;i++)
-		temp_proj[i] = new int[proj->cols];
+	// mark a ball around every metal voxel, in the order the runs are sorted in
+	if(r > 0)
+	{
+		mask.assign(size_t(rows)*cols*slices, 0);
+		for(j=0;j<rows;j++)
+			for(k=0;k<cols;k++)
+				for(i=0;i<slices;i++)
+				{
+					if(!((*vol)(i,j,k) > threshold))
+						continue;
+					for(dj=max(-r,-j);dj<=min(r,rows-1-j);dj++)
+						for(dk=max(-r,-k);dk<=min(r,cols-1-k);dk++)
+							for(di=max(-r,-i);di<=min(r,slices-1-i);di++)
+								if(di*di + dj*dj + dk*dk <= r*r)
+									mask[(size_t(j+dj)*cols + k+dk)*slices + i+di] = 1;
+				}
+	}
+	auto is_metal = [&](int i, int j, int k) { return r > 0 ? mask[(size_t(j)*cols + k)*slices + i] != 0 : (*vol)(i,j,k) > threshold; };
 
-	temp_recon = recon;
+	metal->clear();
+	for(j=0;j<rows;j++)
+		for(k=0;k<cols;k++)
+		{
+			run.j = j;
+			run.k = k;
+			for(i=0;i<slices;i++)
+			{
+				if(!is_metal(i,j,k))
+					continue;
+				run.i_start = i;
+				while(i < slices && is_metal(i,j,k))
+					i++;
+				run.i_end = i;
+				metal->push_back(run);
+			}
+		}
+}
 
-	recon = new FP_VAR**[slices];
-	for(i=0;i<slices;i++)
-		recon[i] = new FP_VAR*[rows];
-	for(i=0;i<slices;i++)
-		for(j=0;j<rows;j++)
-			recon[i][j] = new FP_VAR[cols];
+Volume* Reconstruction::MakePrior(Volume* vol, vector<VoxelRun>* runs)
+{
+	const int bins = 1024;
+	int i,j,k,a,b;
+	double v, bin_width = threshold / bins;
+	double centre[3], bound[2];
+	double n0, n1, n2, s0, s1, s2, score, best = -1;
+	vector<double> count(bins+1, 0.0), sum(bins+1, 0.0);	// of the bins below each one
+	vector<double> hist(bins, 0.0);
+	Volume* prior;
+	VoxelRun run;
+
+	// the histogram goes from 0 to the threshold
+	if(threshold <= 0)
+	{
+		cout << "Warning: NMAR needs a metal threshold above 0" << endl;
+		return NULL;
+	}
 
+	// everything below the metal, negative values are air
 	for(i=0;i<slices;i++)
 		for(j=0;j<rows;j++)
-			memset(recon[i][j],0,cols*sizeof(FP_VAR));	// initialize memory to zero...
-	n=0;
-
-	proj->LoadNextProj();
+			for(k=0;k<cols;k++)
+			{
+				v = (*vol)(i,j,k);
+				if(v <= threshold)
+					hist[min(max(int(v / bin_width), 0), bins-1)]++;
+			}
 
-	while(proj->LoadNextProj())
+	// air, soft tissue and bone: the two bin boundaries that split the histogram into the
+	// classes with the least variance inside them (three class Otsu), tried exhaustively
+	for(b=0;b<bins;b++)
 	{
-		// get the angle and offsets
-		cos_theta = cos(M_PI*((proj->projAngle)+90)/180);
-		sin_theta = sin(M_PI*((proj->projAngle)+90)/180);
-		YOffset = proj->getYOffset();
-		ZOffset = proj->getZOffset();
-
-		// project the thresholded image into the temporary projections
-
-		// clear the temp projection
-		for(i=0;i<proj->rows;i++)
-			memset(temp_proj[i],0,proj->cols * sizeof(int));
+		count[b+1] = count[b] + hist[b];
+		sum[b+1] = sum[b] + hist[b] * (b + 0.5) * bin_width;
+	}
+	centre[0] = centre[1] = centre[2] = 0;
+	bound[0] = bound[1] = threshold;
+	for(a=1;a<bins-1;a++)
+	{
+		n0 = count[a];
+		s0 = sum[a];
+		if(n0 == 0)
+			continue;
+		for(b=a+1;b<bins;b++)
+		{
+			n1 = count[b] - n0;
+			s1 = sum[b] - s0;
+			n2 = count[bins] - count[b];
+			s2 = sum[bins] - sum[b];
+			if(n1 == 0 || n2 == 0)
+				continue;
+
+			score = s0*s0/n0 + s1*s1/n1 + s2*s2/n2;		// the larger, the less variance within the classes
+			if(score > best)
+			{
+				best = score;
+				centre[0] = s0 / n0;
+				centre[1] = s1 / n1;
+				centre[2] = s2 / n2;
+				bound[0] = a * bin_width;
+				bound[1] = b * bin_width;
+			}
+		}
+	}
+	if(best < 0 || centre[1] <= 0)
+	{
+		cout << "Warning: no air, soft tissue and bone to make the NMAR prior from" << endl;
+		return NULL;
+	}
+	cout << "NMAR prior: soft tissue " << centre[1] << ", air below " << bound[0] << ", bone above " << bound[1] << endl;
 
+	prior = new Volume(slices, rows, cols, order, huge_pages);	// initialized to zero
+	for(i=0;i<slices;i++)
 		for(j=0;j<rows;j++)
-		{
 			for(k=0;k<cols;k++)
 			{
-				x_r = x[k] * cos_theta + y[j] * sin_theta;
-				y_r = -x[k] * sin_theta + y[j] * cos_theta;
-				y_p = y_r * (proj->sourceToDetector/(proj->sourceToAxis + x_r)) + YOffset;		// in mm
-				y_p = ((proj->rows-1.0)/2.0) - (y_p/proj->detectorRes);
+				v = (*vol)(i,j,k);
+				if(v > threshold || (v >= bound[0] && v < bound[1]))
+					(*prior)(i,j,k) = FP_VAR(centre[1]);
+				else if(v >= bound[1])
+					(*prior)(i,j,k) = FP_VAR(v);
+			}
 
-				// scale = proj->sourceToAxis /(proj->sourceToAxis - x_r);
-				// scale *= scale;
+	runs->clear();
+	for(j=0;j<rows;j++)
+		for(k=0;k<cols;k++)
+		{
+			run.j = j;
+			run.k = k;
+			for(i=0;i<slices;i++)
+			{
+				if((*prior)(i,j,k) == 0)
+					continue;
+				run.i_start = i;
+				while(i < slices && (*prior)(i,j,k) != 0)
+					i++;
+				run.i_end = i;
+				runs->push_back(run);
+			}
+		}
 
-				for(i=0;i<slices;i++)
+	return prior;
+}
+
+void Reconstruction::ForwardProject(const vector<VoxelRun>& runs, Volume* vol, double angle, FP_VAR** out)
+{
+	int num_runs = (int)runs.size();
+	int det_rows = proj->rows;
+	int det_cols = proj->cols;
+	int bands = min(det_rows, 2 * pool->GetNumThreads());
+	int band_rows = (det_rows + bands - 1) / bands;
+	int nbands = (det_rows + band_rows - 1) / band_rows;
+
+	// across the rows a voxel's footprint is the square seen side on at this angle (fan angle
+	// ignored), a trapezoid: a box as wide as the voxel looks along x smeared by one as wide as
+	// it looks along y. Along the columns it's a box, the cone angle is small.
+	double cos_theta = fabs(cos(M_PI*(angle + 90)/180));
+	double sin_theta = fabs(sin(M_PI*(angle + 90)/180));
+
+	// how much of [lo,hi] falls in detector pixel p, which covers p-0.5..p+0.5
+	auto overlap = [](double lo, double hi, int p) { return max(0.0, min(hi, p + 0.5) - max(lo, p - 0.5)); };
+
+	// integral from -infinity to x of a box of width a (a >= b) convolved with one of width b, the
+	// area of each a
+	auto ramp = [](double x) { return x > 0 ? x*x/2 : 0.0; };
+	auto trapezoid = [&](double x, double a, double b)
+	{
+		if(b < 1e-3*a)
+			return min(max(x + a/2, 0.0), a);
+		return (ramp(x + (a+b)/2) - ramp(x + (a-b)/2) - ramp(x - (a-b)/2) + ramp(x - (a+b)/2)) / b;
+	};
+
+	// the rows the column of a run covers on the detector, false if it misses it
+	auto footprint = [&](const VoxelRun& run, ColumnGeometry*& c, double& u, double& wa, double& wb, int& p_start, int& p_end)
+	{
+		if(run.k < geom[0]->ColStart(run.j) || run.k >= geom[0]->ColEnd(run.j))
+			return false;
+		c = &(*geom[0])(run.j, run.k);
+		if(c->i_start >= c->i_end)	// the whole column misses the detector
+			return false;
+
+		// each voxel is c->dzp pixels across, centred on (u, z_p) on the detector. The rows are
+		// the same for the whole column.
+		wa = c->dzp * max(cos_theta, sin_theta);
+		wb = c->dzp * min(cos_theta, sin_theta);
+		u = c->fy + c->dy;
+		p_start = max((int)floor(u - (wa+wb)/2 + 0.5), 0);
+		p_end = min((int)floor(u + (wa+wb)/2 + 0.5), det_rows - 1);
+		return p_start <= p_end;
+	};
+
+	// sort the runs into the bands of rows they touch, a chunk of runs per task. Each chunk keeps
+	// its runs in order and the bands go through the chunks in order, so a band sees its runs in
+	// the order of the runs.
+	int chunk_runs = 4096;
+	int chunks = (num_runs + chunk_runs - 1) / chunk_runs;
+	vector<vector<vector<int> > > bucket(chunks, vector<vector<int> >(nbands));
+	pool->Run(chunks, [&](int chunk, int /*thread*/)
+	{
+		int p_start, p_end;
+		double u, wa, wb;
+		ColumnGeometry* c;
+
+		for(int r=chunk*chunk_runs;r<min(num_runs, (chunk+1)*chunk_runs);r++)
+			if(footprint(runs[r], c, u, wa, wb, p_start, p_end))
+				for(int band=p_start/band_rows;band<=p_end/band_rows;band++)
+					bucket[chunk][band].push_back(r);
+	});
+
+	// voxel driven. Each task only adds to its own band of detector rows, from the runs that touch
+	// it, so every pixel is summed in the order of the runs whatever the number of threads.
+	pool->Run(nbands, [&](int band, int /*thread*/)
+	{
+		int band_start = band * band_rows;
+		int band_end = min(det_rows, band_start + band_rows);	// exclusive
+		int i, p, q;
+		int p_start, p_end, q_start, q_end;
+		double u, w, wa, wb, z_p, v;
+		vector<double> row_weight;
+		ColumnGeometry* c;
+
+		for(i=band_start;i<band_end;i++)
+			memset(out[i], 0, det_cols*sizeof(FP_VAR));
+
+		for(int chunk=0;chunk<chunks;chunk++)
+			for(size_t n=0;n<bucket[chunk][band].size();n++)
+			{
+				const VoxelRun& run = runs[bucket[chunk][band][n]];
+				footprint(run, c, u, wa, wb, p_start, p_end);
+
+				// adds to each pixel in proportion to how much of its footprint falls in it
+				w = c->dzp;
+				p_start = max(p_start, band_start);
+				p_end = min(p_end, band_end - 1);
+				if((int)row_weight.size() < p_end - p_start + 1)
+					row_weight.resize(p_end - p_start + 1);
+				for(p=p_start;p<=p_end;p++)
+					row_weight[p-p_start] = trapezoid(p + 0.5 - u, wa, wb) - trapezoid(p - 0.5 - u, wa, wb);
+
+				// only the slices that land on the detector
+				for(i=max(run.i_start, c->i_start);i<min(run.i_end, c->i_end);i++)
 				{
-					if(temp_recon[i][j][k] > threshold)
-					{
-						z_p = z[i] * (proj->sourceToDetector/(proj->sourceToAxis + x_r)) + ZOffset;	// in mm
-						z_p = (z_p/proj->detectorRes) + ((proj->cols-1.0)/2.0);
-							
-						fy = floor(y_p);
-						fz = floor(z_p);
-
-						//dy = y_p - fy;
-						//dz = z_p - fz;
-
-						if( (fy>0) && (fy < ( proj->rows - 1)) && (fz>0) && (fz<(proj->cols - 1)) )
-						{
-							temp_proj[fy][fz] = 1; //scale * (1-dy) * (1-dz);// * recon[i][j][k];
-							temp_proj[fy+1][fz] = 1; //scale * dy * (1-dz);// * recon[i][j][k];
-							temp_proj[fy][fz+1] = 1; //scale * (1-dy);// * dz * recon[i][j][k];
-							temp_proj[fy+1][fz+1] = 1; //scale * dy * dz;// * recon[i][j][k];
-						}
-					}
+					z_p = c->zp0 + i * c->dzp;	// projected z coordinate
+					q_start = max((int)floor(z_p - w/2 + 0.5), 0);
+					q_end = min((int)floor(z_p + w/2 + 0.5), det_cols - 1);
+
+					// by the voxel size for the length of the ray through it
+					v = vol ? (*vol)(i, run.j, run.k) * res : 1.0;
+					for(p=p_start;p<=p_end;p++)
+						for(q=q_start;q<=q_end;q++)
+							out[p][q] += FP_VAR(v * row_weight[p-p_start] * overlap(z_p - w/2, z_p + w/2, q));
 				}
 			}
-		}
+	});
+}
 
-		f.open("c:\\SPECT\\rat_aorta\\thresh_proj.bin",ios::binary);
-		if(f.is_open())
+void Reconstruction::RemoveMetal()
+{
+	int i,j;
+	int n;
+	size_t r;
+	long long num_metal;
+	bool cancelled = false;
+	Volume* temp_recon;
+	Volume* prior = NULL;	// NMAR only
+	int** temp_proj;
+
+	vector<VoxelRun> metal;
+	vector<VoxelRun> tissue;	// voxels of the prior that aren't 0
+	FP_VAR** trace;				// metal voxels that land on each detector pixel
+	FP_VAR** prior_proj = NULL;	// forward projection of the prior
+
+	DiagnosticsSink diagnostics;	// only if a file has been given for them
+
+	// filtering has to wait until the metal trace has been interpolated
+	ProjectionPipeline pipeline(proj, pipeline_slots, false);
+	ProjBuffer* buf;
+
+	// allocate memory
+	temp_proj = new int*[proj->rows];
+	trace = new FP_VAR*[proj->rows];
+	for(i=0;i<proj->rows;i++)
+	{
+		temp_proj[i] = new int[proj->cols];
+		trace[i] = new FP_VAR[proj->cols];
+	}
+
+	temp_recon = recon;
+
+	// the metal is found once, each projection then only looks at those voxels
+	FindMetal(temp_recon, &metal);
+	num_metal = 0;
+	for(r=0;r<metal.size();r++)
+		num_metal += metal[r].i_end - metal[r].i_start;
+	cout << num_metal << " metal voxels" << endl;
+
+	if(metal_method == METAL_NMAR)
+	{
+		prior = MakePrior(temp_recon, &tissue);
+		if(prior)
+		{
+			prior_proj = new FP_VAR*[proj->rows];
 			for(i=0;i<proj->rows;i++)
-				f.write(reinterpret_cast<char*>(temp_proj[i]),proj->cols * sizeof(int));
+				prior_proj[i] = new FP_VAR[proj->cols];
+		}
 		else
-			OutputDebugString(L"Error opening projection output file.");
-		f.close();
-		
-		proj->Interpolate(temp_proj);
-		proj->WriteBin("c:\\SPECT\\rat_aorta\\interp_proj.bin");
-		proj->Filter();
+			cout << "Warning: no NMAR prior, interpolating the metal trace linearly" << endl;
+	}
 
+	recon = new Volume(slices, rows, cols, order, huge_pages);	// initialized to zero
+	n=0;
 
-		for(j=0;j<rows;j++)
-		{
-			for(k=0;k<cols;k++)
-			{
-				x_r = x[k] * cos_theta + y[j] * sin_theta;
-				y_r = -x[k] * sin_theta + y[j] * cos_theta;
-				y_p = y_r * (proj->sourceToDetector/(proj->sourceToAxis + x_r)) + YOffset;		// in mm
-				y_p = ((proj->rows-1.0)/2.0) - (y_p/proj->detectorRes);
+	if(diagnostics.Open(diagnostics_file.c_str(), proj->rows, proj->cols, proj->num_proj))
+		cout << "Writing metal removal diagnostics to " << diagnostics_file << endl;
+	pipeline.Start();
 
-				scale = proj->sourceToAxis /(proj->sourceToAxis - x_r);
-				scale *= scale;
+	while((buf = pipeline.Next()) != NULL)
+	{
+		// the same geometry is used for the metal trace, the prior and the backprojection
+		ComputeGeometry(buf);
 
-				for(i=0;i<slices;i++)
-				{
-					
-					z_p = z[i] * (proj->sourceToDetector/(proj->sourceToAxis + x_r)) + ZOffset;	// in mm
-					z_p = (z_p/proj->detectorRes) + ((proj->cols-1.0)/2.0);
-						
-					fy = floor(y_p);
-					fz = floor(z_p);
-
-					dy = y_p - fy;
-					dz = z_p - fz;
-
-					if( (fy>0) && (fy < ( proj->rows - 1)) && (fz>0) && (fz<(proj->cols - 1)) )
-						recon[i][j][k] += scale * 
-									  (proj->pd[fy][fz] * (1-dy) * (1-dz) +	// bilinear interpolation
-									  proj->pd[fy+1][fz] * dy * (1-dz) +
-									  proj->pd[fy][fz+1] * (1-dy) * dz +
-									  proj->pd[fy+1][fz+1] * dy * dz);
+		// project the thresholded image into the temporary projections
+		ForwardProject(metal, NULL, buf->projAngle, trace);
+		for(i=0;i<proj->rows;i++)
+			for(j=0;j<proj->cols;j++)
+				temp_proj[i][j] = trace[i][j] > 0;
 
-				}
-				// check for cancel after each iteration
-				if(cancel)
-				{
-					proj->CloseFindFile();
-					// should reset progress bar
-					return;
-				}
-			}
+		if(prior)
+			ForwardProject(tissue, prior, buf->projAngle, prior_proj);
+
+		if(diagnostics.IsOpen())
+			diagnostics.Write(n, DIAG_METAL_TRACE, temp_proj);
+		proj->Interpolate(temp_proj, buf, prior_proj);
+		if(diagnostics.IsOpen())
+		{
+			diagnostics.Write(n, DIAG_INTERPOLATED, buf->pd);
+			if(prior)
+				diagnostics.Write(n, DIAG_PRIOR, prior_proj);
+			diagnostics.SetAngle(n, buf->projAngle);
 		}
-		// copy current recon into display_slice
-		dwWaitResult = WaitForSingleObject(hMutex,1000);
-		if(dwWaitResult == WAIT_OBJECT_0)
+		proj->Filter(buf);
+
+		BackprojectAll(&buf, 1);
+		pipeline.Release(buf);
+		n++;
+
+		if(CheckCancel())
 		{
-			for(j=0;j<rows;j++)
-				for(k=0;k<cols;k++)
-					display_slice[j][k] = recon[slices/2][j][k];
-			ReleaseMutex(hMutex);
+			pipeline.Stop();
+			cancelled = true;
+			// should reset progress bar
+			break;
 		}
-		PostMessage(hApp,WM_UPDATE_RECON,MAKEWPARAM(n,proj->num_proj),NULL);
+
+		UpdateDisplay(n);
 	}
 
 
 	// free memory
 	for(i=0;i<proj->rows;i++)
+	{
 		delete [] temp_proj[i];
+		delete [] trace[i];
+		if(prior_proj)
+			delete [] prior_proj[i];
+	}
 	delete [] temp_proj;
+	delete [] trace;
+	delete [] prior_proj;
 
-	
-	for(i=0;i<slices;i++)
-		for(j=0;j<rows;j++)
-			delete [] temp_recon[i][j];
-	for(i=0;i<slices;i++)
-		delete [] temp_recon[i];
-	delete [] temp_recon;
+	delete temp_recon;
+	delete prior;
 
+	if(!cancelled)
+		callback->Complete();
 }
\ No newline at end of file
@@ -0,0 +1,140 @@
+// diagnostics.h
+
+// intermediate images from metal removal, for looking at what it did to each projection:
+// the metal trace, the projection after the trace has been interpolated over and, with NMAR,
+// the forward projection of the prior it was normalized by (zero otherwise). They go into
+// one memory mapped stack file, named with Reconstruction::SetDiagnosticsFile, with a slot
+// for every plane of every projection, so capturing one is a copy into memory.
+// Off by default, and RemoveMetal doesn't copy anything when it's off.
+//
+// file layout, little endian:
+//   DiagnosticsHeader
+//   projection 0 plane 0, projection 0 plane 1, ... projection 1 plane 0, ... at data_offset,
+//     rows*cols FP_VARs each, row after row (a metal trace is 1 in the trace and 0 elsewhere)
+//   angles (num_proj doubles, degrees) right after the planes
+// Slots for projections that weren't captured (a cancelled reconstruction) are left at zero.
+
+// requires FP_VAR to be defined before inclusion
+
+#ifndef _DIAGNOSTICS_H
+#define _DIAGNOSTICS_H
+
+#include <cstring>
+#include <iostream>
+
+#include "platform.h"
+
+using namespace std;
+
+enum diagnostics_plane {DIAG_METAL_TRACE, DIAG_INTERPOLATED, DIAG_PRIOR, DIAG_NUM_PLANES};
+
+struct DiagnosticsHeader
+{
+	char magic[8];			// "CTDIAG\0\0"
+	int value_size;			// sizeof(FP_VAR)
+	int rows;
+	int cols;
+	int num_proj;
+	int num_planes;			// DIAG_NUM_PLANES, in the order of diagnostics_plane
+	int reserved;
+	long long data_offset;	// from the start of the file
+};
+
+class DiagnosticsSink
+{
+public:
+	DiagnosticsSink();
+
+	// makes the stack file for num_proj projections, replacing it, false if filename is NULL
+	// or "" or the file can't be made
+	bool Open(const char* filename, int newRows, int newCols, int newNumProj);
+	void Close() { file.Close(); data = NULL; }
+	bool IsOpen() { return data != NULL; }
+
+	void Write(int n, diagnostics_plane plane, FP_VAR** pd);	// projection n, 0..num_proj-1
+	void Write(int n, diagnostics_plane plane, int** map);
+	void SetAngle(int n, double angle);
+
+private:
+	FP_VAR* Slot(int n, diagnostics_plane plane) { return data + (size_t(n)*DIAG_NUM_PLANES + plane)*rows*cols; }
+
+	int rows;
+	int cols;
+	int num_proj;
+
+	MappedFile file;
+	FP_VAR* data;		// NULL when closed
+	double* angles;
+};
+
+DiagnosticsSink::DiagnosticsSink()
+{
+	rows = cols = num_proj = 0;
+	data = NULL;
+	angles = NULL;
+}
+
+bool DiagnosticsSink::Open(const char* filename, int newRows, int newCols, int newNumProj)
+{
+	DiagnosticsHeader h;
+	size_t values;
+
+	Close();
+	if(!filename || !filename[0])
+		return false;
+
+	rows = newRows;
+	cols = newCols;
+	num_proj = newNumProj;
+	values = size_t(rows)*cols*num_proj*DIAG_NUM_PLANES;
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, "CTDIAG\0\0", 8);
+	h.value_size = sizeof(FP_VAR);
+	h.rows = rows;
+	h.cols = cols;
+	h.num_proj = num_proj;
+	h.num_planes = DIAG_NUM_PLANES;
+	h.data_offset = (sizeof(h) + 63) / 64 * 64;
+
+	// a new mapping is all zeros
+	if(!file.Create(filename, h.data_offset + values*sizeof(FP_VAR) + num_proj*sizeof(double)))
+	{
+		cout << "Warning: can't write the diagnostics file " << filename << endl;
+		return false;
+	}
+
+	memcpy(file.WritableData(), &h, sizeof(h));
+	data = (FP_VAR*)(file.WritableData() + h.data_offset);
+	angles = (double*)(data + values);
+	return true;
+}
+
+void DiagnosticsSink::Write(int n, diagnostics_plane plane, FP_VAR** pd)
+{
+	if(!data || n < 0 || n >= num_proj)
+		return;
+
+	FP_VAR* dest = Slot(n, plane);
+	for(int i=0;i<rows;i++)
+		memcpy(dest + i*cols, pd[i], cols*sizeof(FP_VAR));
+}
+
+void DiagnosticsSink::Write(int n, diagnostics_plane plane, int** map)
+{
+	if(!data || n < 0 || n >= num_proj)
+		return;
+
+	FP_VAR* dest = Slot(n, plane);
+	for(int i=0;i<rows;i++)
+		for(int j=0;j<cols;j++)
+			dest[i*cols + j] = FP_VAR(map[i][j]);
+}
+
+void DiagnosticsSink::SetAngle(int n, double angle)
+{
+	if(data && n >= 0 && n < num_proj)
+		memcpy(angles + n, &angle, sizeof(angle));	// only 4 byte aligned if FP_VAR is float
+}
+
+#endif
@@ -52,7 +52,7 @@ enum valrep_t {VR_AE,
 
 static map<string, valrep_t> VRMap;
 
-void InitVRMap()
+static bool FillVRMap()
 {
 	VRMap["AE"] = VR_AE;
 	VRMap["AS"] = VR_AS;
@@ -81,6 +81,22 @@ void InitVRMap()
 	VRMap["UN"] = VR_UN;
 	VRMap["US"] = VR_US;
 	VRMap["UT"] = VR_UT;
+	return true;
+}
+
+// fills VRMap the first time it's called. Files can be parsed on several threads at once,
+// so VRMap is only ever read after this (LookupVR, never VRMap[]).
+void InitVRMap()
+{
+	static bool initialized = FillVRMap();
+	(void)initialized;
+}
+
+// the VR of a two letter code, unknown codes are treated as VR_AE (2 byte length)
+inline valrep_t LookupVR(const string& vr)
+{
+	map<string, valrep_t>::const_iterator it = VRMap.find(vr);
+	return it == VRMap.end() ? VR_AE : it->second;
 }
 
 class DataElement : public HDLListObj
@@ -157,12 +173,19 @@ public:
 	void Write(ofstream& f);				// write Dicom object to file
 	int Write(const char* filename);
 
+	// where the pixel data (7FE0,0010) starts in the file and how long it is, so it can be read
+	// without parsing the file again. Only found with hdr_only, -1 and 0 otherwise.
+	long long GetPixelDataOffset() { return pixelDataOffset; }
+	unsigned long GetPixelDataLength() { return pixelDataLength; }
+
 	static int depth;					// only used for indenting when writing
-	static bool VRMap_Initialized;		// tracks if the VR_Map has been intilized yet
+
+private:
+	long long pixelDataOffset;
+	unsigned long pixelDataLength;
 };
 
 int RootDicomObj::depth = 0;
-bool RootDicomObj::VRMap_Initialized = false;
 
 DataElement::DataElement(ifstream& f)
 {
@@ -179,7 +202,7 @@ DataElement::DataElement(ifstream& f)
 	VR = temp;
 
 	Length = 0;
-	switch(VRMap[VR])
+	switch(LookupVR(VR))
 	{
 		case VR_OB:		// if VR is OB, OW, OF, SQ, UT, or UN, skip two bytes, then read 4 byte length
 		case VR_OW:
@@ -263,7 +286,7 @@ DataElement::DataElement(unsigned short newGroup, unsigned short newElement, str
 
 	if(newLength % 2) // pad odd field lengths with spaces or zeros
 	{
-		switch(VRMap[VR])
+		switch(LookupVR(VR))
 		{
 		case VR_AE:
 		case VR_AS:
@@ -290,7 +313,7 @@ DataElement::DataElement(unsigned short newGroup, unsigned short newElement, str
 DataElement::~DataElement()
 {
 	if(Value)
-		delete Value;
+		delete [] Value;
 }
 
 
@@ -314,7 +337,7 @@ void DataElement::Print(ostream& os)
 	else
 		os << dec << Length << "  ";
 
-	switch(VRMap[VR])
+	switch(LookupVR(VR))
 	{
 	case VR_AE:
 	case VR_AS:
@@ -355,13 +378,13 @@ void DataElement::Print(ostream& os)
 		os << *(float*)Value;
 		break;
 	case VR_SL:
-		os << *(long*)Value;
+		os << *(int*)Value;		// SL and UL are 4 bytes, long is 8 on 64 bit Linux
 		break;
 	case VR_SS:
 		os << *(short*)Value;
 		break;
 	case VR_UL:
-		os << *(unsigned long*)Value;
+		os << *(unsigned int*)Value;
 		break;
 	case VR_US:
 		for(unsigned int i=0;i<(Length-2);i+=2)
@@ -406,7 +429,7 @@ void DataElement::Write(ofstream &f)
 	f.write((char*)&Element,2);
 	f << VR;
 
-	switch(VRMap[VR])
+	switch(LookupVR(VR))
 	{
 	case VR_OB:		// if VR is OB, OW, OF, SQ, UT, or UN, write two bytes, then write 4 byte length
 	case VR_OW:
@@ -423,7 +446,7 @@ void DataElement::Write(ofstream &f)
 		break;
 	}
 	
-	switch(VRMap[VR])
+	switch(LookupVR(VR))
 	{
 	case VR_SQ:
 		FirstObj();
@@ -461,7 +484,7 @@ unsigned long DataElement::GetSize()
 {
 	unsigned long Size = 0;
 	
-	switch(VRMap[VR])
+	switch(LookupVR(VR))
 	{
 		case VR_OB:		// if VR is OB, OW, OF, SQ, UT, or UN, skip two bytes, then read 4 byte length
 		case VR_OW:
@@ -493,7 +516,7 @@ unsigned long DataElement::GetSize()
 // returns Length (number of bytes copied)
 unsigned long DataElement::GetValue(void* buffer, unsigned long buf_size)
 {
-	if (VRMap[VR] == VR_SQ)	// SQ data isn't stored in value
+	if (LookupVR(VR) == VR_SQ)	// SQ data isn't stored in value
 		return -1;
 
 	if (buf_size < Length)
@@ -526,7 +549,7 @@ int DataElement::Modify(void* newVal, unsigned long newLen)
 
 			if(newLen%2)					// pad if needed
 			{
-				switch(VRMap[VR])
+				switch(LookupVR(VR))
 				{
 				case VR_AE:
 				case VR_AS:
@@ -565,7 +588,7 @@ int DataElement::CheckLength()
 	int changes = 0;
 
 	// verifies the lengths of SQ objects
-	if(VRMap[VR]==VR_SQ)
+	if(LookupVR(VR)==VR_SQ)
 	{
 		// call CheckLength on all underlying objects
 		FirstObj();
@@ -602,7 +625,7 @@ int DataElement::CheckLength()
 
 int DataElement::SetObject(HDLListObj * newObj)
 {
-	if(VRMap[VR] != VR_SQ)
+	if(LookupVR(VR) != VR_SQ)
 		return -1;	// objects can only be inserted into SQ elements
 
 	AddObj(newObj);
@@ -623,7 +646,7 @@ int DataElement::Validate()
 
 	bool invalid_data = false;
 
-	switch(VRMap[VR])
+	switch(LookupVR(VR))
 	{
 	case VR_AE:
 		data = new char[Length+2];
@@ -1073,7 +1096,7 @@ unsigned long DataElement::GetLength()
 
 HDLListObj* DataElement::GetSQObject(int n)
 {
-	if(VRMap[VR] == VR_SQ)
+	if(LookupVR(VR) == VR_SQ)
 	{
 		FirstObj();
 
@@ -1092,11 +1115,9 @@ HDLListObj* DataElement::GetSQObject(int n)
 
 RootDicomObj::RootDicomObj()
 {
-	if(!VRMap_Initialized)
-	{
-		InitVRMap();
-		VRMap_Initialized = true;
-	}
+	InitVRMap();
+	pixelDataOffset = -1;
+	pixelDataLength = 0;
 }
 
 RootDicomObj::RootDicomObj(const char* filename, bool hdr_only)
@@ -1108,11 +1129,9 @@ RootDicomObj::RootDicomObj(const char* filename, bool hdr_only)
 
 	f.open(filename,fstream::binary);
 
-	if(!VRMap_Initialized)
-	{
-		InitVRMap();
-		VRMap_Initialized = true;
-	}
+	InitVRMap();
+	pixelDataOffset = -1;
+	pixelDataLength = 0;
 
 	f.seekg(128,ios::beg); // first 128 bytes in a DICOM file are unused
 	f.read(temp,4);
@@ -1135,6 +1154,27 @@ RootDicomObj::RootDicomObj(const char* filename, bool hdr_only)
 				f.read(reinterpret_cast<char*>(&temp_us),2);
 				if(temp_us == 0x0010)
 				{
+					// note where the data starts, past the VR and length
+					f.read(temp,2);
+					switch(LookupVR(string(temp,2)))
+					{
+					case VR_OB:
+					case VR_OW:
+					case VR_OF:
+					case VR_UT:
+					case VR_UN:
+						f.seekg(2,ios::cur);
+						f.read(reinterpret_cast<char*>(&pixelDataLength),4);
+						break;
+					default:
+						f.read(reinterpret_cast<char*>(&temp_us),2);
+						pixelDataLength = temp_us;
+						break;
+					}
+					if(f)
+						pixelDataOffset = f.tellg();
+					else
+						pixelDataLength = 0;
 					f.close();
 					return;
 				}
@@ -1208,6 +1248,7 @@ DicomObj::DicomObj(ifstream &f)
 	if(memcmp(temp,DicomObjTag,4)) 
 		cout << "Nested Dicom Object Tag error\n";
 	// read ObjLength
+	Length = 0;		// only the low 4 bytes are read if unsigned long is 8 bytes
 	f.read((char*)&Length,4);
 
 	if(Length == 0xFFFFFFFF)
@@ -1295,8 +1336,8 @@ void DicomObj::ReadFromFile(istream& in)
 	//char* temp_str;	// used for long fields of text
 	float temp_fl;
 	double temp_dbl;
-	long temp_lo;
-	unsigned long temp_ul;
+	int temp_lo;			// 4 byte SL/UL values
+	unsigned int temp_ul;
 	short temp_sh;
 	unsigned short temp_us;
 	unsigned short SQ_Group, SQ_Element;
@@ -1320,7 +1361,7 @@ void DicomObj::ReadFromFile(istream& in)
 
 		in >> VR >> ws;
 
-		switch(VRMap[VR])
+		switch(LookupVR(VR))
 		{
 		case VR_AE:
 		case VR_AS:
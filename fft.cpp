@@ -1,97 +1,452 @@
 // Fast Fourier Transforms 
 #include <algorithm>
 #include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <utility>
 
 #include "fft.h"
 #include "fft8g.c"
+#include "fft_kernel.h"
 
 using namespace std;
 
-void fft1(float *data_r, float *data_i, int nx, int isign)
+static fft_backend default_backend = FFT_OOURA;
+static simd_level default_level = SIMD_AVX512;
+
+void SetFFTBackend(fft_backend backend, simd_level max_level)
+{
+	default_backend = backend;
+	default_level = max_level;
+}
+
+fft_backend GetFFTBackend()
+{
+	return default_backend;
+}
+
+static double* AllocDoubles(size_t count)
+{
+	return (double*)AllocAligned(count * sizeof(double));
+}
+
+static void FreeDoubles(double* p)
+{
+	FreeAligned(p);
+}
+
+static bool IsPowerOf2(int n)
+{
+	return n > 0 && (n & (n-1)) == 0;
+}
+
+int FFTFastLength(int min_n)
+{
+	int n = max(min_n, 1);
+	while(!IsFFTSmooth(n))
+		n++;
+	return n;
+}
+
+// count transforms of n points stored re,im,re,im... through a StockhamFFT, lanes at a time
+template<class T, class S> static void RunStockham(StockhamFFT<T>* stockham, int n, S* data, int count, size_t dist, T scale)
+{
+	int b, c, j, t;
+	T *xr, *xi, *re, *im;
+	S *src;
+
+	for(b=0;b<count;b+=stockham->GetLanes())
+	{
+		c = min(stockham->GetLanes(), count-b);
+		xr = stockham->Buffer();
+		xi = xr + size_t(n)*c;
+		src = data + b*dist;
+
+		for(j=0;j<n;j++)
+			for(t=0;t<c;t++)
+			{
+				xr[j*c + t] = T(src[t*dist + 2*j]);
+				xi[j*c + t] = T(src[t*dist + 2*j+1]);
+			}
+
+		stockham->Run(c, &re, &im);
+
+		for(j=0;j<n;j++)
+			for(t=0;t<c;t++)
+			{
+				src[t*dist + 2*j] = S(re[j*c + t] * scale);
+				src[t*dist + 2*j+1] = S(im[j*c + t] * scale);
+			}
+	}
+}
+
+FFTPlan::FFTPlan(int newN, int newSign, bool newNormalize)
+:n(newN), isign(newSign), normalize(newNormalize), backend(default_backend)
+{
+	Init(default_level);
+}
+
+FFTPlan::FFTPlan(int newN, int newSign, bool newNormalize, fft_backend newBackend, simd_level max_level)
+:n(newN), isign(newSign), normalize(newNormalize), backend(newBackend)
+{
+	Init(max_level);
+}
+
+void FFTPlan::Init(simd_level max_level)
 {
 	int i;
-	double *data = new double[2 * nx];
-	int *ip = new int[2+int(sqrt(nx))+1];
-	ip[0] = 0;
-	double *w = new double[nx/2];
-	
-	for(i=0;i<nx;i++)
+	long long j2;
+	double theta;
+
+	ip = NULL;
+	w = NULL;
+	work = AllocDoubles(2 * n);
+	stockham_f = NULL;
+	stockham_d = NULL;
+	conv_n = 0;
+	chirp = NULL;
+	chirp_fft = NULL;
+	conv_fwd = NULL;
+	conv_inv = NULL;
+	conv_work = NULL;
+
+	if(backend == FFT_SIMD && IsFFTSmooth(n))
+	{
+		Radix4Stage radix4;
+		Radix2Stage radix2;
+		int lanes;
+
+		switch(SelectFFTStages(max_level, &radix4, &radix2))
+		{
+		case SIMD_AVX512:
+			lanes = 16;
+			break;
+		case SIMD_AVX2:
+			lanes = 8;
+			break;
+		default:
+			lanes = 4;
+			break;
+		}
+		stockham_f = new StockhamFFT<float>(n, isign, lanes, radix4, radix2);
+	}
+
+	// the double precision transform, also used by the float versions without stockham_f
+	if(IsPowerOf2(n))
+	{
+		ip = new int[2 + int(sqrt(n)) + 2];
+		w = new double[max(n/2, 1)];
+
+		// build the tables now so Execute never has to
+		ip[0] = 0;
+		for(i=0;i<2*n;i++)
+			work[i] = 0;
+		cdft(2*n, isign, work, ip, w);
+	}
+	else if(IsFFTSmooth(n))
+		stockham_d = new StockhamFFT<double>(n, isign, 4, Radix4StageScalar<double>, Radix2StageScalar<double>);
+	else
 	{
-		data[2*i] = data_r[i];
-		data[2*i+1] = data_i[i];
+		// Bluestein: X[k] = c[k] * sum_j (x[j] c[j]) conj(c[k-j]) for the chirp c[j] = exp(sign*pi*i*j^2/n),
+		// the sum being a convolution done with power of 2 transforms at least 2n-1 long
+		conv_n = 1;
+		while(conv_n < 2*n-1)
+			conv_n *= 2;
+
+		chirp = new double[2*n];
+		for(i=0;i<n;i++)
+		{
+			j2 = (long long)i * i % (2*n);		// keeps the angle accurate for large i
+			theta = isign * M_PI * j2 / n;
+			chirp[2*i] = cos(theta);
+			chirp[2*i+1] = sin(theta);
+		}
+
+		conv_fwd = new FFTPlan(conv_n, 1, false, FFT_OOURA);
+		conv_inv = new FFTPlan(conv_n, -1, false, FFT_OOURA);
+		conv_work = AllocDoubles(2 * conv_n);
+
+		// transform of conj(c[j]) for -n < j < n, with the 1/conv_n of the inverse folded in
+		chirp_fft = new double[2*conv_n];
+		for(i=0;i<2*conv_n;i++)
+			chirp_fft[i] = 0;
+		for(i=0;i<n;i++)
+		{
+			chirp_fft[2*i] = chirp[2*i] / conv_n;
+			chirp_fft[2*i+1] = -chirp[2*i+1] / conv_n;
+			if(i > 0)
+			{
+				chirp_fft[2*(conv_n-i)] = chirp[2*i] / conv_n;
+				chirp_fft[2*(conv_n-i)+1] = -chirp[2*i+1] / conv_n;
+			}
+		}
+		conv_fwd->Execute(chirp_fft);
 	}
-	cdft(2*nx, isign, data, ip, w);
-	for(i=0;i<nx;i++)
+}
+
+FFTPlan::~FFTPlan()
+{
+	delete [] ip;
+	delete [] w;
+	FreeDoubles(work);
+	delete stockham_f;
+	delete stockham_d;
+	delete [] chirp;
+	delete [] chirp_fft;
+	delete conv_fwd;
+	delete conv_inv;
+	FreeDoubles(conv_work);
+}
+
+void FFTPlan::Bluestein(double *data)
+{
+	int i;
+	double re, im;
+
+	for(i=0;i<n;i++)
 	{
-		data_r[i] = float(data[2*i]);
-		data_i[i] = float(data[2*i+1]);
+		conv_work[2*i] = data[2*i]*chirp[2*i] - data[2*i+1]*chirp[2*i+1];
+		conv_work[2*i+1] = data[2*i]*chirp[2*i+1] + data[2*i+1]*chirp[2*i];
 	}
+	for(i=2*n;i<2*conv_n;i++)
+		conv_work[i] = 0;
 
-	delete [] data;
+	conv_fwd->Execute(conv_work);
+	for(i=0;i<conv_n;i++)
+	{
+		re = conv_work[2*i]*chirp_fft[2*i] - conv_work[2*i+1]*chirp_fft[2*i+1];
+		im = conv_work[2*i]*chirp_fft[2*i+1] + conv_work[2*i+1]*chirp_fft[2*i];
+		conv_work[2*i] = re;
+		conv_work[2*i+1] = im;
+	}
+	conv_inv->Execute(conv_work);
 
-	delete[] ip;
-	delete[] w;
+	for(i=0;i<n;i++)
+	{
+		data[2*i] = conv_work[2*i]*chirp[2*i] - conv_work[2*i+1]*chirp[2*i+1];
+		data[2*i+1] = conv_work[2*i]*chirp[2*i+1] + conv_work[2*i+1]*chirp[2*i];
+	}
 }
 
-void fft2(float **data_r, float **data_i, int nx, int ny, int isign)
+void FFTPlan::Execute(double *data)
 {
-	int i,j;
-	double *x_data;
-	double **y_data;
+	if(ip)
+		cdft(2*n, isign, data, ip, w);
+	else if(stockham_d)
+		RunStockham(stockham_d, n, data, 1, 2*n, 1.0);
+	else
+		Bluestein(data);
+
+	if(normalize)
+		for(int i=0;i<2*n;i++)
+			data[i] /= n;
+}
+
+void FFTPlan::Execute(float *data)
+{
+	int i;
 
-	y_data = new double*[nx];
-	for(i=0;i<nx;i++)
-		y_data[i] = new double[2*ny];
+	if(stockham_f)
+	{
+		RunStockham(stockham_f, n, data, 1, 2*n, normalize ? 1.0f/n : 1.0f);
+		return;
+	}
 
-	x_data = new double[2*nx];
+	for(i=0;i<2*n;i++)
+		work[i] = data[i];
+	Execute(work);
+	for(i=0;i<2*n;i++)
+		data[i] = float(work[i]);
+}
+
+void FFTPlan::Execute(float *data_r, float *data_i)
+{
+	int i;
+
+	if(stockham_f)
+	{
+		float *re, *im;
+		float scale = normalize ? 1.0f/n : 1.0f;
+
+		memcpy(stockham_f->Buffer(), data_r, n*sizeof(float));
+		memcpy(stockham_f->Buffer() + n, data_i, n*sizeof(float));
+		stockham_f->Run(1, &re, &im);
+		for(i=0;i<n;i++)
+		{
+			data_r[i] = re[i] * scale;
+			data_i[i] = im[i] * scale;
+		}
+		return;
+	}
+
+	for(i=0;i<n;i++)
+	{
+		work[2*i] = data_r[i];
+		work[2*i+1] = data_i[i];
+	}
+	Execute(work);
+	for(i=0;i<n;i++)
+	{
+		data_r[i] = float(work[2*i]);
+		data_i[i] = float(work[2*i+1]);
+	}
+}
+
+void FFTPlan::ExecuteBatch(double *data, int count, size_t dist)
+{
+	if(stockham_d)
+	{
+		RunStockham(stockham_d, n, data, count, dist, normalize ? 1.0/n : 1.0);
+		return;
+	}
+
+	for(int b=0;b<count;b++)
+		Execute(data + b*dist);
+}
+
+void FFTPlan::ExecuteBatch(float *data, int count, size_t dist)
+{
+	if(stockham_f)
+	{
+		RunStockham(stockham_f, n, data, count, dist, normalize ? 1.0f/n : 1.0f);
+		return;
+	}
+
+	for(int b=0;b<count;b++)
+		Execute(data + b*dist);
+}
+
+RealFFTPlan::RealFFTPlan(int newN, int newSign)
+:n(newN), isign(newSign)
+{
+	ip = new int[2 + int(sqrt(n/2)) + 2];
+	w = new double[max(n/2, 1)];
+	work = AllocDoubles(n);
 
-	int *ip = new int[2 + int(sqrt(max(nx,ny))) + 1];
 	ip[0] = 0;
-	double *w = new double[max(nx,ny) / 2];
+	for(int i=0;i<n;i++)
+		work[i] = 0;
+	rdft(n, isign, work, ip, w);
+}
+
+RealFFTPlan::~RealFFTPlan()
+{
+	delete [] ip;
+	delete [] w;
+	FreeDoubles(work);
+}
+
+void RealFFTPlan::Execute(double *data)
+{
+	rdft(n, isign, data, ip, w);
+}
+
+void RealFFTPlan::Execute(float *data)
+{
+	int i;
+
+	for(i=0;i<n;i++)
+		work[i] = data[i];
+	rdft(n, isign, work, ip, w);
+	for(i=0;i<n;i++)
+		data[i] = float(work[i]);
+}
+
+void RealFFTPlan::ExecuteBatch(float *data, int count, size_t dist)
+{
+	for(int b=0;b<count;b++)
+		Execute(data + b*dist);
+}
+
+// plans used by the free functions below. Each thread gets its own set,
+// since a plan's work buffer can only be used by one thread at a time.
+struct PlanKey
+{
+	int n;
+	int isign;
+	bool normalize;
+	fft_backend backend;
+	simd_level level;
+
+	bool operator<(const PlanKey& k) const
+	{
+		if(n != k.n) return n < k.n;
+		if(isign != k.isign) return isign < k.isign;
+		if(normalize != k.normalize) return normalize < k.normalize;
+		if(backend != k.backend) return backend < k.backend;
+		return level < k.level;
+	}
+};
+
+class PlanCache
+{
+public:
+	~PlanCache()
+	{
+		for(map<PlanKey, FFTPlan*>::iterator it=plans.begin();it!=plans.end();++it)
+			delete it->second;
+	}
+
+	// a plan for the current default backend
+	FFTPlan* Get(int n, int isign, bool normalize = false)
+	{
+		PlanKey key = {n, isign, normalize, default_backend, default_level};
+		FFTPlan*& plan = plans[key];
+		if(!plan)
+			plan = new FFTPlan(n, isign, normalize, default_backend, default_level);
+		return plan;
+	}
+
+private:
+	map<PlanKey, FFTPlan*> plans;
+};
+
+static thread_local PlanCache plan_cache;
+
+void fft(float *data, int n, int isign)
+{
+	plan_cache.Get(n, isign, isign < 0)->Execute(data);
+}
+
+void fft1(float *data_r, float *data_i, int nx, int isign)
+{
+	plan_cache.Get(nx, isign)->Execute(data_r, data_i);
+}
+
+void fft2(float **data_r, float **data_i, int nx, int ny, int isign)
+{
+	int i,j;
+	float *x_data = new float[2*nx*ny];	// row i at x_data + 2*nx*i
+	float *y_data = new float[2*nx*ny];	// column j at y_data + 2*ny*j
 
 	// transform along x-axis
 	for(i=0;i<ny;i++)
-	{
-		// copy row to temp data
 		for(j=0;j<nx;j++)
 		{
-			x_data[2*j] = data_r[i][j];
-			x_data[2*j+1] = data_i[i][j];
+			x_data[2*(i*nx + j)] = data_r[i][j];
+			x_data[2*(i*nx + j)+1] = data_i[i][j];
 		}
+	plan_cache.Get(nx, isign)->ExecuteBatch(x_data, ny, 2*nx);
 
-		cdft(2 * nx, isign, x_data, ip,w);
-		
-		// copy to temporary structure
+	// transform along y_axis and put back in original format
+	for(i=0;i<ny;i++)
 		for(j=0;j<nx;j++)
 		{
-			y_data[j][2*i] = x_data[2*j];
-			y_data[j][2*i+1] = x_data[2*j+1];
+			y_data[2*(j*ny + i)] = x_data[2*(i*nx + j)];
+			y_data[2*(j*ny + i)+1] = x_data[2*(i*nx + j)+1];
 		}
-	}
-
-	ip[0] = 0;
+	plan_cache.Get(ny, isign)->ExecuteBatch(y_data, nx, 2*ny);
 
-	// transform along y_axis and put back in original format
-	for(j=0;j<nx;j++)
-	{
-		cdft(2 * ny, isign, y_data[j], ip, w);
-
-		for(i=0;i<ny;i++)
+	for(i=0;i<ny;i++)
+		for(j=0;j<nx;j++)
 		{
-			data_r[i][j] = float(y_data[j][2*i]);
-			data_i[i][j] = float(y_data[j][2*i+1]);
+			data_r[i][j] = y_data[2*(j*ny + i)];
+			data_i[i][j] = y_data[2*(j*ny + i)+1];
 		}
-	}
 
 	delete [] x_data;
-
-	for(i=0;i<nx;i++)
-		delete [] y_data[i];
 	delete [] y_data;
-
-	delete[] ip;
-	delete[] w;
-
 }
 
 void fft3(float ***data_r, float ***data_i, int nx, int ny, int nz, int isign)
@@ -101,67 +456,66 @@ void fft3(float ***data_r, float ***data_i, int nx, int ny, int nz, int isign)
 	int nn;
 	nn = max(nx, max(ny, nz));
 
-	double *temp = new double[nn * 2];
+	// one plane of lines at a time
+	float *temp = new float[2 * nn * nn];
 
-	int *ip = new int[2 + int(sqrt(nn)) + 1];
-	ip[0] = 0;
-	double *w = new double[nn / 2];
+	FFTPlan* plan_x = plan_cache.Get(nx, isign);
+	FFTPlan* plan_y = plan_cache.Get(ny, isign);
+	FFTPlan* plan_z = plan_cache.Get(nz, isign);
 
 	// transform in x direction
 	for (i = 0;i < nz;i++)
+	{
 		for (j = 0;j < ny;j++)
-		{
 			for (k = 0;k < nx;k++)
 			{
-				temp[2 * k] = data_r[i][j][k];
-				temp[2 * k + 1] = data_i[i][j][k];
+				temp[2 * (j*nx + k)] = data_r[i][j][k];
+				temp[2 * (j*nx + k) + 1] = data_i[i][j][k];
 			}
-			cdft(2 * nx, isign, temp, ip, w);
+		plan_x->ExecuteBatch(temp, ny, 2 * nx);
+		for (j = 0;j < ny;j++)
 			for (k = 0;k < nx;k++)
 			{
-				data_r[i][j][k] = float(temp[2 * k]);
-				data_i[i][j][k] = float(temp[2 * k + 1]);
+				data_r[i][j][k] = temp[2 * (j*nx + k)];
+				data_i[i][j][k] = temp[2 * (j*nx + k) + 1];
 			}
-		}
+	}
 
-	ip[0] = 0;
 	// transform in y direction
 	for (i = 0;i < nz;i++)
-		for (k = 0;k < nx;k++)
-		{
-			for (j = 0;j < ny;j++)
+	{
+		for (j = 0;j < ny;j++)
+			for (k = 0;k < nx;k++)
 			{
-				temp[2 * j] = data_r[i][j][k];
-				temp[2 * j + 1] = data_i[i][j][k];
+				temp[2 * (k*ny + j)] = data_r[i][j][k];
+				temp[2 * (k*ny + j) + 1] = data_i[i][j][k];
 			}
-			cdft(2 * ny, isign, temp, ip, w);
-			for (j = 0;j < ny;j++)
+		plan_y->ExecuteBatch(temp, nx, 2 * ny);
+		for (j = 0;j < ny;j++)
+			for (k = 0;k < nx;k++)
 			{
-				data_r[i][j][k] = float(temp[2 * j]);
-				data_i[i][j][k] = float(temp[2 * j + 1]);
+				data_r[i][j][k] = temp[2 * (k*ny + j)];
+				data_i[i][j][k] = temp[2 * (k*ny + j) + 1];
 			}
-		}
+	}
 
-	ip[0] = 0;
 	// transform in z direction
 	for(j=0;j<ny;j++)
-		for(k=0;k<nx;k++)
-		{
-			for(i=0;i<nz;i++)
+	{
+		for(i=0;i<nz;i++)
+			for(k=0;k<nx;k++)
 			{
-				temp[2*i] = data_r[i][j][k];
-				temp[2*i+1] = data_i[i][j][k];
+				temp[2 * (k*nz + i)] = data_r[i][j][k];
+				temp[2 * (k*nz + i) + 1] = data_i[i][j][k];
 			}
-			cdft(2 * nz, isign, temp, ip, w);
-			for(i=0;i<nz;i++)
+		plan_z->ExecuteBatch(temp, nx, 2 * nz);
+		for(i=0;i<nz;i++)
+			for(k=0;k<nx;k++)
 			{
-				data_r[i][j][k] = float(temp[2*i]);
-				data_i[i][j][k] = float(temp[2*i+1]);
+				data_r[i][j][k] = temp[2 * (k*nz + i)];
+				data_i[i][j][k] = temp[2 * (k*nz + i) + 1];
 			}
-		}
+	}
 
 	delete[] temp;
-  	delete[] ip;
-	delete[] w;
-
 }
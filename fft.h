@@ -1,5 +1,109 @@
+#ifndef _FFT_H
+#define _FFT_H
+
+#include <cstddef>
+
+#include "cpu_features.h"
+
+// FFT_OOURA  - fft8g.c, double precision, the float versions convert on the way in and out
+// FFT_SIMD   - single precision Stockham radix 4/2 with AVX2/AVX-512 butterflies (fft_kernel.h),
+//              batches are transformed several at a time, one per vector lane
+// Lengths that aren't a power of 2 but have no prime factors above 5 use the Stockham transform
+// with radix 3 and 5 stages as well, in double precision for FFT_OOURA. Any other length uses
+// Bluestein's algorithm (in double precision, through fft8g), which is 4-8 times slower.
+enum fft_backend {FFT_OOURA, FFT_SIMD};
+
+template<class T> class StockhamFFT;
+
+// smallest length >= min_n that doesn't need Bluestein's algorithm (2^a 3^b 5^c)
+int FFTFastLength(int min_n);
+
+// backend (and instruction set cap for FFT_SIMD) given to plans that don't ask for one.
+// Set it before any transforms run, plans that already exist keep their backend.
+void SetFFTBackend(fft_backend backend, simd_level max_level = SIMD_AVX512);
+fft_backend GetFFTBackend();
+
+// a transform of one size and direction, with the tables and work buffer set up once.
+// Execute can be called any number of times, but only from one thread at a time.
+// The transforms are unnormalized unless normalize is set, in which case the result is scaled by 1/n.
+// n can be any length. The double versions never use the single precision transform.
+class FFTPlan
+{
+public:
+	FFTPlan(int newN, int newSign, bool newNormalize = false);	// n complex points, isign = 1 or -1
+	FFTPlan(int newN, int newSign, bool newNormalize, fft_backend newBackend, simd_level max_level = SIMD_AVX512);
+	~FFTPlan();
+
+	int GetSize() { return n; }
+	int GetSign() { return isign; }
+	fft_backend GetBackend() { return backend; }
+
+	// n complex points stored re,im,re,im...
+	void Execute(double *data);
+	void Execute(float *data);
+	void Execute(float *data_r, float *data_i);		// reals and imaginaries in separate arrays
+
+	// count transforms, the first one at data and each one dist values (not complex points) after the last
+	void ExecuteBatch(double *data, int count, size_t dist);
+	void ExecuteBatch(float *data, int count, size_t dist);
+
+private:
+	void Init(simd_level max_level);
+	void Bluestein(double *data);
+
+	int n;
+	int isign;
+	bool normalize;
+	fft_backend backend;
+
+	int *ip;		// bit reversal work area and
+	double *w;		// cos/sin table for cdft, built in the constructor (n a power of 2)
+	double *work;	// 2n doubles, 64 byte aligned, for the float versions
+
+	StockhamFFT<float> *stockham_f;		// FFT_SIMD, n = 2^a 3^b 5^c
+	StockhamFFT<double> *stockham_d;	// the double precision transform when n is 2^a 3^b 5^c but not a power of 2
+
+	// Bluestein's algorithm for the other lengths
+	int conv_n;				// power of 2 >= 2n-1
+	double *chirp;			// exp(sign*pi*i*j^2/n), n complex values
+	double *chirp_fft;		// transform of the conjugate chirp, scaled by 1/conv_n
+	FFTPlan *conv_fwd;
+	FFTPlan *conv_inv;
+	double *conv_work;
+};
+
+// transform of n real points (n a power of 2) using Ooura's rdft, same rules as FFTPlan.
+// The forward transform (isign = 1) leaves the spectrum packed in place:
+//   data[0] = R[0], data[1] = R[n/2], data[2k] = Re R[k], data[2k+1] = Im R[k] for 0 < k < n/2
+// which is also what the inverse (isign = -1) expects. Neither direction is normalized,
+// a forward transform followed by an inverse scales the data by n/2.
+class RealFFTPlan
+{
+public:
+	RealFFTPlan(int newN, int newSign);
+	~RealFFTPlan();
+
+	int GetSize() { return n; }
+	int GetSign() { return isign; }
+
+	void Execute(double *data);
+	void Execute(float *data);
+	void ExecuteBatch(float *data, int count, size_t dist);
+
+private:
+	int n;
+	int isign;
+
+	int *ip;
+	double *w;		// cos/sin tables for rdft
+	double *work;	// n doubles, 64 byte aligned
+};
+
 // fourier transforms that handle the data in a slightly more convient form - arrays of reals and imaginaries
+// these keep a plan for each size and direction they've been called with (per thread)
+void fft(float *data, int n, int isign);	// n complex points stored re,im,re,im..., the inverse (isign = -1) is scaled by 1/n
 void fft1(float *data_r, float *data_i, int nx, int isign);
 void fft2(float **data_r, float **data_i, int nx, int ny, int isign);	// 2D fourier transform
 void fft3(float ***data_r, float ***data_i, int nx, int ny, int nz, int isign);	// 3D fourier transform
 
+#endif
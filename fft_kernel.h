@@ -0,0 +1,503 @@
+// fft_kernel.h
+
+// butterflies for the single precision Stockham FFT behind FFTPlan's FFT_SIMD backend.
+// The data is split into real and imaginary arrays, and a batch of transforms is interleaved
+// so that point j of transform t is at [j*lanes + t]. Every butterfly in a stage then works on
+// runs of s*lanes consecutive floats (s = the stage's stride) that share one twiddle factor,
+// and those runs are what gets vectorized. With a full batch (8 or 16 transforms) every run is
+// a whole number of vectors, a single transform only vectorizes once the stride is large enough.
+
+// N = 4^a 3^b 5^c (2 or 1), one Stockham stage per factor in that order. For a stage of radix r
+// and length n (the product of this and the later radices):
+//   m = n/r groups, group p reads runs p, p+m, ... p+(r-1)m of x and writes runs r*p .. r*p+r-1
+//   of y, output k of the group multiplied by the twiddle w^kp for w = exp(sign*2*pi*i/n)
+// The factor of 2, if there is one, is last so n = 2 and it has no twiddles. The output comes
+// out in order without a bit reversal pass. The radix 4 and 2 stages have vector versions,
+// radix 3 and 5 are scalar loops over the runs that the compiler is left to vectorize.
+
+#ifndef _FFT_KERNEL_H
+#define _FFT_KERNEL_H
+
+#include <cmath>
+#include <cstdlib>
+#include <algorithm>
+
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+#include "cpu_features.h"
+
+using namespace std;
+
+inline void* AllocAligned(size_t bytes)
+{
+	void* p = NULL;
+#ifdef _WIN32
+	p = _aligned_malloc(bytes, 64);
+#else
+	if(posix_memalign(&p, 64, bytes))
+		p = NULL;
+#endif
+	return p;
+}
+
+inline void FreeAligned(void* p)
+{
+#ifdef _WIN32
+	_aligned_free(p);
+#else
+	free(p);
+#endif
+}
+
+// tw holds w1r,w1i,w2r,w2i,w3r,w3i for each group, len is the run length in floats
+typedef void (*Radix4Stage)(const float* xr, const float* xi, float* yr, float* yi,
+							int m, int len, const float* tw, float sign);
+typedef void (*Radix2Stage)(const float* xr, const float* xi, float* yr, float* yi, int len);
+
+// one radix 4 butterfly group, values t_start to len of the run
+template<class T> inline void Radix4Run(const T* xr, const T* xi, T* yr, T* yi,
+										int p, int m, int len, const T* tw, T sign, int t_start)
+{
+	const T* ar = xr + p*len;
+	const T* ai = xi + p*len;
+	const T* br = ar + m*len;
+	const T* bi = ai + m*len;
+	const T* cr = br + m*len;
+	const T* ci = bi + m*len;
+	const T* dr = cr + m*len;
+	const T* di = ci + m*len;
+	T* y0r = yr + 4*p*len;
+	T* y0i = yi + 4*p*len;
+
+	T w1r = tw[6*p], w1i = tw[6*p+1];
+	T w2r = tw[6*p+2], w2i = tw[6*p+3];
+	T w3r = tw[6*p+4], w3i = tw[6*p+5];
+
+	for(int t=t_start;t<len;t++)
+	{
+		T apcr = ar[t] + cr[t], apci = ai[t] + ci[t];
+		T amcr = ar[t] - cr[t], amci = ai[t] - ci[t];
+		T bpdr = br[t] + dr[t], bpdi = bi[t] + di[t];
+		T jbmdr = -sign * (bi[t] - di[t]);		// sign*i*(b-d)
+		T jbmdi = sign * (br[t] - dr[t]);
+
+		T x1r = amcr + jbmdr, x1i = amci + jbmdi;
+		T x2r = apcr - bpdr, x2i = apci - bpdi;
+		T x3r = amcr - jbmdr, x3i = amci - jbmdi;
+
+		y0r[t] = apcr + bpdr;
+		y0i[t] = apci + bpdi;
+		y0r[len + t] = x1r*w1r - x1i*w1i;
+		y0i[len + t] = x1r*w1i + x1i*w1r;
+		y0r[2*len + t] = x2r*w2r - x2i*w2i;
+		y0i[2*len + t] = x2r*w2i + x2i*w2r;
+		y0r[3*len + t] = x3r*w3r - x3i*w3i;
+		y0i[3*len + t] = x3r*w3i + x3i*w3r;
+	}
+}
+
+template<class T> inline void Radix2Run(const T* xr, const T* xi, T* yr, T* yi, int len, int t_start)
+{
+	for(int t=t_start;t<len;t++)
+	{
+		T ar = xr[t], ai = xi[t];
+		T br = xr[len + t], bi = xi[len + t];
+
+		yr[t] = ar + br;
+		yi[t] = ai + bi;
+		yr[len + t] = ar - br;
+		yi[len + t] = ai - bi;
+	}
+}
+
+template<class T> void Radix4StageScalar(const T* xr, const T* xi, T* yr, T* yi,
+										 int m, int len, const T* tw, T sign)
+{
+	for(int p=0;p<m;p++)
+		Radix4Run(xr, xi, yr, yi, p, m, len, tw, sign, 0);
+}
+
+template<class T> void Radix2StageScalar(const T* xr, const T* xi, T* yr, T* yi, int len)
+{
+	Radix2Run(xr, xi, yr, yi, len, 0);
+}
+
+// radix r stage (used for 3 and 5) as a direct r point DFT. roots holds cos,sin(sign*2*pi*k/r)
+// for k < r, tw the r-1 twiddles w^kp (k = 1..r-1) of each group.
+template<class T> void RadixNStage(const T* xr, const T* xi, T* yr, T* yi,
+								   int r, int m, int len, const T* tw, const T* roots)
+{
+	int p, k, q, t, idx;
+	T cr, ci, wr, wi, sr, si;
+
+	for(p=0;p<m;p++)
+		for(k=0;k<r;k++)
+		{
+			T* outr = yr + (r*p + k)*len;
+			T* outi = yi + (r*p + k)*len;
+
+			for(t=0;t<len;t++)
+			{
+				outr[t] = xr[p*len + t];
+				outi[t] = xi[p*len + t];
+			}
+			for(q=1;q<r;q++)
+			{
+				const T* inr = xr + (p + q*m)*len;
+				const T* ini = xi + (p + q*m)*len;
+				idx = (q*k) % r;
+				cr = roots[2*idx];
+				ci = roots[2*idx+1];
+				for(t=0;t<len;t++)
+				{
+					sr = outr[t] + inr[t]*cr - ini[t]*ci;
+					si = outi[t] + inr[t]*ci + ini[t]*cr;
+					outr[t] = sr;
+					outi[t] = si;
+				}
+			}
+
+			if(k == 0 || p == 0)	// w^0 = 1
+				continue;
+			wr = tw[2*(p*(r-1) + k-1)];
+			wi = tw[2*(p*(r-1) + k-1) + 1];
+			for(t=0;t<len;t++)
+			{
+				sr = outr[t]*wr - outi[t]*wi;
+				si = outr[t]*wi + outi[t]*wr;
+				outr[t] = sr;
+				outi[t] = si;
+			}
+		}
+}
+
+#ifdef CT_SIMD_X86
+
+TARGET_AVX2 void Radix4StageAVX2(const float* xr, const float* xi, float* yr, float* yi,
+								 int m, int len, const float* tw, float sign)
+{
+	const __m256 v_sign = _mm256_set1_ps(sign);
+	const __m256 v_nsign = _mm256_set1_ps(-sign);
+
+	for(int p=0;p<m;p++)
+	{
+		const float* ar = xr + p*len;
+		const float* ai = xi + p*len;
+		const float* br = ar + m*len;
+		const float* bi = ai + m*len;
+		const float* cr = br + m*len;
+		const float* ci = bi + m*len;
+		const float* dr = cr + m*len;
+		const float* di = ci + m*len;
+		float* y0r = yr + 4*p*len;
+		float* y0i = yi + 4*p*len;
+
+		__m256 w1r = _mm256_set1_ps(tw[6*p]), w1i = _mm256_set1_ps(tw[6*p+1]);
+		__m256 w2r = _mm256_set1_ps(tw[6*p+2]), w2i = _mm256_set1_ps(tw[6*p+3]);
+		__m256 w3r = _mm256_set1_ps(tw[6*p+4]), w3i = _mm256_set1_ps(tw[6*p+5]);
+
+		int t = 0;
+		for(;t+8<=len;t+=8)
+		{
+			__m256 a_r = _mm256_loadu_ps(ar + t), a_i = _mm256_loadu_ps(ai + t);
+			__m256 b_r = _mm256_loadu_ps(br + t), b_i = _mm256_loadu_ps(bi + t);
+			__m256 c_r = _mm256_loadu_ps(cr + t), c_i = _mm256_loadu_ps(ci + t);
+			__m256 d_r = _mm256_loadu_ps(dr + t), d_i = _mm256_loadu_ps(di + t);
+
+			__m256 apcr = _mm256_add_ps(a_r, c_r), apci = _mm256_add_ps(a_i, c_i);
+			__m256 amcr = _mm256_sub_ps(a_r, c_r), amci = _mm256_sub_ps(a_i, c_i);
+			__m256 bpdr = _mm256_add_ps(b_r, d_r), bpdi = _mm256_add_ps(b_i, d_i);
+			__m256 jbmdr = _mm256_mul_ps(v_nsign, _mm256_sub_ps(b_i, d_i));
+			__m256 jbmdi = _mm256_mul_ps(v_sign, _mm256_sub_ps(b_r, d_r));
+
+			__m256 x1r = _mm256_add_ps(amcr, jbmdr), x1i = _mm256_add_ps(amci, jbmdi);
+			__m256 x2r = _mm256_sub_ps(apcr, bpdr), x2i = _mm256_sub_ps(apci, bpdi);
+			__m256 x3r = _mm256_sub_ps(amcr, jbmdr), x3i = _mm256_sub_ps(amci, jbmdi);
+
+			_mm256_storeu_ps(y0r + t, _mm256_add_ps(apcr, bpdr));
+			_mm256_storeu_ps(y0i + t, _mm256_add_ps(apci, bpdi));
+			_mm256_storeu_ps(y0r + len + t, _mm256_fmsub_ps(x1r, w1r, _mm256_mul_ps(x1i, w1i)));
+			_mm256_storeu_ps(y0i + len + t, _mm256_fmadd_ps(x1r, w1i, _mm256_mul_ps(x1i, w1r)));
+			_mm256_storeu_ps(y0r + 2*len + t, _mm256_fmsub_ps(x2r, w2r, _mm256_mul_ps(x2i, w2i)));
+			_mm256_storeu_ps(y0i + 2*len + t, _mm256_fmadd_ps(x2r, w2i, _mm256_mul_ps(x2i, w2r)));
+			_mm256_storeu_ps(y0r + 3*len + t, _mm256_fmsub_ps(x3r, w3r, _mm256_mul_ps(x3i, w3i)));
+			_mm256_storeu_ps(y0i + 3*len + t, _mm256_fmadd_ps(x3r, w3i, _mm256_mul_ps(x3i, w3r)));
+		}
+
+		Radix4Run(xr, xi, yr, yi, p, m, len, tw, sign, t);
+	}
+}
+
+TARGET_AVX2 void Radix2StageAVX2(const float* xr, const float* xi, float* yr, float* yi, int len)
+{
+	int t = 0;
+	for(;t+8<=len;t+=8)
+	{
+		__m256 a_r = _mm256_loadu_ps(xr + t), a_i = _mm256_loadu_ps(xi + t);
+		__m256 b_r = _mm256_loadu_ps(xr + len + t), b_i = _mm256_loadu_ps(xi + len + t);
+
+		_mm256_storeu_ps(yr + t, _mm256_add_ps(a_r, b_r));
+		_mm256_storeu_ps(yi + t, _mm256_add_ps(a_i, b_i));
+		_mm256_storeu_ps(yr + len + t, _mm256_sub_ps(a_r, b_r));
+		_mm256_storeu_ps(yi + len + t, _mm256_sub_ps(a_i, b_i));
+	}
+
+	Radix2Run(xr, xi, yr, yi, len, t);
+}
+
+TARGET_AVX512 void Radix4StageAVX512(const float* xr, const float* xi, float* yr, float* yi,
+									 int m, int len, const float* tw, float sign)
+{
+	const __m512 v_sign = _mm512_set1_ps(sign);
+	const __m512 v_nsign = _mm512_set1_ps(-sign);
+
+	for(int p=0;p<m;p++)
+	{
+		const float* ar = xr + p*len;
+		const float* ai = xi + p*len;
+		const float* br = ar + m*len;
+		const float* bi = ai + m*len;
+		const float* cr = br + m*len;
+		const float* ci = bi + m*len;
+		const float* dr = cr + m*len;
+		const float* di = ci + m*len;
+		float* y0r = yr + 4*p*len;
+		float* y0i = yi + 4*p*len;
+
+		__m512 w1r = _mm512_set1_ps(tw[6*p]), w1i = _mm512_set1_ps(tw[6*p+1]);
+		__m512 w2r = _mm512_set1_ps(tw[6*p+2]), w2i = _mm512_set1_ps(tw[6*p+3]);
+		__m512 w3r = _mm512_set1_ps(tw[6*p+4]), w3i = _mm512_set1_ps(tw[6*p+5]);
+
+		int t = 0;
+		for(;t+16<=len;t+=16)
+		{
+			__m512 a_r = _mm512_loadu_ps(ar + t), a_i = _mm512_loadu_ps(ai + t);
+			__m512 b_r = _mm512_loadu_ps(br + t), b_i = _mm512_loadu_ps(bi + t);
+			__m512 c_r = _mm512_loadu_ps(cr + t), c_i = _mm512_loadu_ps(ci + t);
+			__m512 d_r = _mm512_loadu_ps(dr + t), d_i = _mm512_loadu_ps(di + t);
+
+			__m512 apcr = _mm512_add_ps(a_r, c_r), apci = _mm512_add_ps(a_i, c_i);
+			__m512 amcr = _mm512_sub_ps(a_r, c_r), amci = _mm512_sub_ps(a_i, c_i);
+			__m512 bpdr = _mm512_add_ps(b_r, d_r), bpdi = _mm512_add_ps(b_i, d_i);
+			__m512 jbmdr = _mm512_mul_ps(v_nsign, _mm512_sub_ps(b_i, d_i));
+			__m512 jbmdi = _mm512_mul_ps(v_sign, _mm512_sub_ps(b_r, d_r));
+
+			__m512 x1r = _mm512_add_ps(amcr, jbmdr), x1i = _mm512_add_ps(amci, jbmdi);
+			__m512 x2r = _mm512_sub_ps(apcr, bpdr), x2i = _mm512_sub_ps(apci, bpdi);
+			__m512 x3r = _mm512_sub_ps(amcr, jbmdr), x3i = _mm512_sub_ps(amci, jbmdi);
+
+			_mm512_storeu_ps(y0r + t, _mm512_add_ps(apcr, bpdr));
+			_mm512_storeu_ps(y0i + t, _mm512_add_ps(apci, bpdi));
+			_mm512_storeu_ps(y0r + len + t, _mm512_fmsub_ps(x1r, w1r, _mm512_mul_ps(x1i, w1i)));
+			_mm512_storeu_ps(y0i + len + t, _mm512_fmadd_ps(x1r, w1i, _mm512_mul_ps(x1i, w1r)));
+			_mm512_storeu_ps(y0r + 2*len + t, _mm512_fmsub_ps(x2r, w2r, _mm512_mul_ps(x2i, w2i)));
+			_mm512_storeu_ps(y0i + 2*len + t, _mm512_fmadd_ps(x2r, w2i, _mm512_mul_ps(x2i, w2r)));
+			_mm512_storeu_ps(y0r + 3*len + t, _mm512_fmsub_ps(x3r, w3r, _mm512_mul_ps(x3i, w3i)));
+			_mm512_storeu_ps(y0i + 3*len + t, _mm512_fmadd_ps(x3r, w3i, _mm512_mul_ps(x3i, w3r)));
+		}
+
+		Radix4Run(xr, xi, yr, yi, p, m, len, tw, sign, t);
+	}
+}
+
+TARGET_AVX512 void Radix2StageAVX512(const float* xr, const float* xi, float* yr, float* yi, int len)
+{
+	int t = 0;
+	for(;t+16<=len;t+=16)
+	{
+		__m512 a_r = _mm512_loadu_ps(xr + t), a_i = _mm512_loadu_ps(xi + t);
+		__m512 b_r = _mm512_loadu_ps(xr + len + t), b_i = _mm512_loadu_ps(xi + len + t);
+
+		_mm512_storeu_ps(yr + t, _mm512_add_ps(a_r, b_r));
+		_mm512_storeu_ps(yi + t, _mm512_add_ps(a_i, b_i));
+		_mm512_storeu_ps(yr + len + t, _mm512_sub_ps(a_r, b_r));
+		_mm512_storeu_ps(yi + len + t, _mm512_sub_ps(a_i, b_i));
+	}
+
+	Radix2Run(xr, xi, yr, yi, len, t);
+}
+
+#endif
+
+// picks the widest butterflies the cpu can run, capped at max_level, and returns the level used
+inline simd_level SelectFFTStages(simd_level max_level, Radix4Stage* radix4, Radix2Stage* radix2)
+{
+	simd_level level = SIMD_NONE;
+
+	*radix4 = Radix4StageScalar<float>;
+	*radix2 = Radix2StageScalar<float>;
+
+#ifdef CT_SIMD_X86
+	level = GetSIMDLevel();
+	if(max_level < level)
+		level = max_level;
+
+	switch(level)
+	{
+	case SIMD_AVX512:
+		*radix4 = Radix4StageAVX512;
+		*radix2 = Radix2StageAVX512;
+		break;
+	case SIMD_AVX2:
+		*radix4 = Radix4StageAVX2;
+		*radix2 = Radix2StageAVX2;
+		break;
+	default:
+		break;
+	}
+#endif
+
+	return level;
+}
+
+// true if n has no prime factors above 5
+inline bool IsFFTSmooth(int n)
+{
+	if(n < 1)
+		return false;
+	while(n % 2 == 0)
+		n /= 2;
+	while(n % 3 == 0)
+		n /= 3;
+	while(n % 5 == 0)
+		n /= 5;
+	return n == 1;
+}
+
+// the stages and buffers for transforms of one length (IsFFTSmooth) and direction, in single
+// or double precision. Up to lanes transforms are done at once. Load them into Buffer(count):
+// point j of transform t goes in re[j*count + t], im[j*count + t] where im = re + n*count.
+template<class T> class StockhamFFT
+{
+public:
+	typedef void (*Radix4Fn)(const T*, const T*, T*, T*, int, int, const T*, T);
+	typedef void (*Radix2Fn)(const T*, const T*, T*, T*, int);
+
+	StockhamFFT(int newN, int isign, int newLanes, Radix4Fn newRadix4, Radix2Fn newRadix2);
+	~StockhamFFT();
+
+	int GetLanes() { return lanes; }
+	T* Buffer() { return split; }
+	void Run(int count, T** re, T** im);	// re/im point at the result, in the same order as the input
+
+private:
+	int n;
+	int lanes;
+	T sign;
+
+	int num_stages;
+	int radix[32];
+	T* twiddle;			// each stage's twiddles, one after another
+	T roots3[6];		// the r point DFTs for the radix 3 and 5 stages
+	T roots5[10];
+	T* split;			// two ping-pong buffers of n*lanes reals and n*lanes imaginaries
+
+	Radix4Fn radix4;
+	Radix2Fn radix2;
+};
+
+template<class T> StockhamFFT<T>::StockhamFFT(int newN, int isign, int newLanes, Radix4Fn newRadix4, Radix2Fn newRadix2)
+:n(newN), lanes(newLanes), sign(T(isign)), radix4(newRadix4), radix2(newRadix2)
+{
+	int i, k, p, r, sn;
+	int rest = n;
+	size_t count = 0;
+	double theta;
+
+	num_stages = 0;
+	while(rest % 4 == 0)
+	{
+		radix[num_stages++] = 4;
+		rest /= 4;
+	}
+	while(rest % 3 == 0)
+	{
+		radix[num_stages++] = 3;
+		rest /= 3;
+	}
+	while(rest % 5 == 0)
+	{
+		radix[num_stages++] = 5;
+		rest /= 5;
+	}
+	if(rest == 2)
+		radix[num_stages++] = 2;
+
+	for(i=0;i<3;i++)
+	{
+		roots3[2*i] = T(cos(isign * 2 * M_PI * i / 3));
+		roots3[2*i+1] = T(sin(isign * 2 * M_PI * i / 3));
+	}
+	for(i=0;i<5;i++)
+	{
+		roots5[2*i] = T(cos(isign * 2 * M_PI * i / 5));
+		roots5[2*i+1] = T(sin(isign * 2 * M_PI * i / 5));
+	}
+
+	// w^kp for each stage, computed in double
+	sn = n;
+	for(i=0;i<num_stages;i++)
+	{
+		count += 2 * size_t(sn / radix[i]) * (radix[i] - 1);
+		sn /= radix[i];
+	}
+	twiddle = (T*)AllocAligned(max(count, size_t(1)) * sizeof(T));
+	count = 0;
+	sn = n;
+	for(i=0;i<num_stages;i++)
+	{
+		r = radix[i];
+		for(p=0;p<sn/r;p++)
+			for(k=1;k<r;k++)
+			{
+				theta = isign * 2 * M_PI * k * p / sn;
+				twiddle[count++] = T(cos(theta));
+				twiddle[count++] = T(sin(theta));
+			}
+		sn /= r;
+	}
+
+	split = (T*)AllocAligned(4 * size_t(n) * lanes * sizeof(T));
+}
+
+template<class T> StockhamFFT<T>::~StockhamFFT()
+{
+	FreeAligned(twiddle);
+	FreeAligned(split);
+}
+
+template<class T> void StockhamFFT<T>::Run(int count, T** re, T** im)
+{
+	T* xr = split;
+	T* xi = split + size_t(n)*count;
+	T* yr = split + 2*size_t(n)*count;
+	T* yi = split + 3*size_t(n)*count;
+	const T* tw = twiddle;
+	int i, r, m;
+	int sn = n;
+	int s = 1;
+
+	for(i=0;i<num_stages;i++)
+	{
+		r = radix[i];
+		m = sn / r;
+		if(r == 4)
+			radix4(xr, xi, yr, yi, m, s*count, tw, sign);
+		else if(r == 2)
+			radix2(xr, xi, yr, yi, s*count);
+		else
+			RadixNStage(xr, xi, yr, yi, r, m, s*count, tw, r == 3 ? roots3 : roots5);
+		tw += 2 * m * (r - 1);
+		swap(xr, yr);
+		swap(xi, yi);
+		sn = m;
+		s *= r;
+	}
+
+	*re = xr;
+	*im = xi;
+}
+
+#endif
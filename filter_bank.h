@@ -0,0 +1,248 @@
+// filter_bank.h
+
+// frequency responses of the reconstruction filters. Each one is computed the first time a
+// filter type, cutoff and padded FFT length is asked for and kept for the life of the program,
+// so CreateFilter only looks it up when the same scan (or another one with the same number of
+// rows) is reconstructed again with a filter that's been used before.
+// A response is stored in the layouts Projection::Filter multiplies by directly, so applying
+// it is a single elementwise multiply over the spectrum.
+
+// requires FP_VAR and filter_type to be defined before inclusion
+
+#ifndef _FILTER_BANK_H
+#define _FILTER_BANK_H
+
+#include <cmath>
+#include <map>
+#include <mutex>
+
+#include "cpu_features.h"
+
+using namespace std;
+
+struct FilterResponse
+{
+	int length;				// padded FFT length
+	FP_VAR *G;				// G[0..length-1], real and symmetric (G[i] = G[length-i])
+	FP_VAR *packed;			// in the order RealFFTPlan packs a spectrum, scaled by the inverse's 2/length.
+							// NULL unless length is a power of 2
+	FP_VAR *interleaved;	// each G[i] twice, for complex spectra stored re,im,re,im...
+};
+
+class FilterBank
+{
+public:
+	~FilterBank();
+
+	// never returns NULL, unknown filter types get nofilter's response
+	const FilterResponse* Get(filter_type filter, double cutoff, int length);
+
+private:
+	struct Key
+	{
+		filter_type filter;
+		double cutoff;
+		int length;
+
+		bool operator<(const Key& k) const
+		{
+			if(filter != k.filter) return filter < k.filter;
+			if(cutoff != k.cutoff) return cutoff < k.cutoff;
+			return length < k.length;
+		}
+	};
+
+	FilterResponse* Compute(filter_type filter, double cutoff, int length);
+
+	map<Key, FilterResponse*> responses;
+	mutex m;
+};
+
+// the one bank everything shares
+FilterBank& GetFilterBank()
+{
+	static FilterBank bank;
+	return bank;
+}
+
+FilterBank::~FilterBank()
+{
+	for(map<Key, FilterResponse*>::iterator it=responses.begin();it!=responses.end();++it)
+	{
+		delete [] it->second->G;
+		delete [] it->second->packed;
+		delete [] it->second->interleaved;
+		delete it->second;
+	}
+}
+
+const FilterResponse* FilterBank::Get(filter_type filter, double cutoff, int length)
+{
+	if(filter < ramlak || filter > nofilter)
+		filter = nofilter;
+	if(filter == nofilter)
+		cutoff = 1.0;
+
+	Key key = {filter, cutoff, length};
+
+	lock_guard<mutex> lock(m);
+	FilterResponse*& response = responses[key];
+	if(!response)
+		response = Compute(filter, cutoff, length);
+	return response;
+}
+
+FilterResponse* FilterBank::Compute(filter_type filter, double cutoff, int length)
+{
+	int i;
+	int half = length/2;	// highest frequency, Nyquist if length is even
+	FilterResponse* r = new FilterResponse;
+	FP_VAR* G;
+	double* w;
+
+	r->length = length;
+	r->G = G = new FP_VAR[length];
+	w = new double[half+1];
+
+	// ramp, cut off above cutoff * Nyquist
+	for(i=0; i<=half; i++)
+	{
+		G[i] = FP_VAR(2*i) / length;
+		w[i] = 2 * M_PI * double(i) / length;
+	}
+	for(i=int(length/2.0*cutoff)+1;i<=half;i++)
+		G[i] = 0;
+
+	// windows
+	switch(filter)
+	{
+	case ramlak:
+		break;
+
+	case shepplogan:
+		for(i=1; i<=half; i++)
+			G[i] *= sin(w[i]/(2*cutoff))/(w[i]/(2*cutoff));
+		break;
+
+	case hamming:
+		for(i=1; i<=half; i++)
+			G[i] *= 0.54 + 0.46 * cos(w[i]/cutoff);
+		break;
+
+	case hanning:
+		for(i=1; i<=half; i++)
+			G[i] *= (1 + cos(w[i]/cutoff))/2;
+		break;
+
+	case cosine:
+		for(i=1; i<=half; i++)
+			G[i] *= cos(w[i]/(2*cutoff));
+		break;
+
+	case blackman:
+		for(i=1; i<=half; i++)
+			G[i] *= 0.42 + 0.5 * cos(w[i]/cutoff) + 0.08 * cos(2*w[i]/cutoff);
+		break;
+
+	default:
+		for(i=0; i<=half; i++)
+			G[i] = 1.0;
+		break;
+	}
+
+	// mirror the filter
+	for(i=half+1;i<length;i++)
+		G[i] = G[length-i];
+
+	delete [] w;
+
+	// the product with a real column's spectrum only needs the first half+1 values,
+	// each applied to both halves of a complex bin
+	r->packed = NULL;
+	if((length & (length-1)) == 0)
+	{
+		FP_VAR scale = FP_VAR(2.0 / length);
+
+		r->packed = new FP_VAR[length];
+		r->packed[0] = G[0] * scale;
+		r->packed[1] = G[half] * scale;
+		for(i=1;i<half;i++)
+		{
+			r->packed[2*i] = G[i] * scale;
+			r->packed[2*i+1] = G[i] * scale;
+		}
+	}
+
+	r->interleaved = new FP_VAR[2*length];
+	for(i=0;i<length;i++)
+	{
+		r->interleaved[2*i] = G[i];
+		r->interleaved[2*i+1] = G[i];
+	}
+
+	return r;
+}
+
+// data[i] *= g[i] for i < n
+typedef void (*SpectrumKernel)(FP_VAR* data, const FP_VAR* g, int n);
+
+void SpectrumKernelScalar(FP_VAR* data, const FP_VAR* g, int n)
+{
+	for(int i=0;i<n;i++)
+		data[i] *= g[i];
+}
+
+#ifdef CT_SIMD_X86
+
+TARGET_AVX2 void SpectrumKernelAVX2(FP_VAR* data, const FP_VAR* g, int n)
+{
+	float* f_data = (float*)data;
+	const float* f_g = (const float*)g;
+
+	int i = 0;
+	for(;i+8<=n;i+=8)
+		_mm256_storeu_ps(f_data + i, _mm256_mul_ps(_mm256_loadu_ps(f_data + i), _mm256_loadu_ps(f_g + i)));
+
+	SpectrumKernelScalar(data + i, g + i, n - i);
+}
+
+TARGET_AVX512 void SpectrumKernelAVX512(FP_VAR* data, const FP_VAR* g, int n)
+{
+	float* f_data = (float*)data;
+	const float* f_g = (const float*)g;
+
+	int i = 0;
+	for(;i+16<=n;i+=16)
+		_mm512_storeu_ps(f_data + i, _mm512_mul_ps(_mm512_loadu_ps(f_data + i), _mm512_loadu_ps(f_g + i)));
+
+	SpectrumKernelScalar(data + i, g + i, n - i);
+}
+
+#endif
+
+// picks the widest multiply the cpu can run, capped at max_level
+SpectrumKernel SelectSpectrumKernel(simd_level max_level)
+{
+	if(sizeof(FP_VAR) != sizeof(float))	// vector kernels are single precision only
+		return SpectrumKernelScalar;
+
+#ifdef CT_SIMD_X86
+	simd_level level = GetSIMDLevel();
+	if(max_level < level)
+		level = max_level;
+
+	switch(level)
+	{
+	case SIMD_AVX512:
+		return SpectrumKernelAVX512;
+	case SIMD_AVX2:
+		return SpectrumKernelAVX2;
+	default:
+		break;
+	}
+#endif
+
+	return SpectrumKernelScalar;
+}
+
+#endif
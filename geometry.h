@@ -0,0 +1,204 @@
+// geometry.h
+
+// per-projection geometry tables. For a given projection angle everything about a
+// voxel column (x,y) except the detector column is fixed: the magnification, the
+// detector row and the backprojection weight. These are worked out once per column
+// and shared by every pass that needs them (backprojection, metal trace, ...).
+// The detector column is linear in the slice number, z_p(i) = zp0 + i*dzp, so the range
+// of slices that land on the detector can be found up front instead of testing every voxel.
+
+#ifndef _GEOMETRY_H
+#define _GEOMETRY_H
+
+#include <cmath>
+#include <algorithm>
+
+using namespace std;
+
+struct ScanGeometry
+{
+	double sourceToDetector;
+	double sourceToAxis;
+	double detectorRes;		// mm per detector pixel
+	int det_rows;			// detector rows (projected y)
+	int det_cols;			// detector columns (projected z)
+};
+
+struct ColumnGeometry
+{
+	double zp0;		// detector column of slice 0
+	double dzp;		// change in detector column from one slice to the next
+	double dy;		// detector row is fy + dy
+	double scale;	// backprojection weight
+	int fy;			// -1 if the column misses the detector
+	int i_start;	// slices i_start..i_end-1 land on the detector, 0 < floor(z_p) < det_cols-1
+	int i_end;
+};
+
+class ProjectionGeometry
+{
+public:
+	ProjectionGeometry(int newSlices, int newRows, int newCols, const double* newX, const double* newY, double newZ0, double newRes);
+	~ProjectionGeometry();
+
+	// fills in the table for rows j_start..j_end-1 of the volume
+	void Compute(const ScanGeometry& scan, double cos_theta, double sin_theta, double YOffset, double ZOffset,
+				 int j_start, int j_end);
+
+	ColumnGeometry& operator()(int j, int k) { return table[j*cols + k]; }
+
+	// only columns inside a cylinder of this radius (in mm) around the middle of the volume
+	// are computed, 0 turns the mask off
+	void SetCylinder(double radius);
+	int ColStart(int j) { return col_start[j]; }	// columns in row j to use are ColStart(j)..ColEnd(j)-1
+	int ColEnd(int j) { return col_end[j]; }
+
+private:
+	void ClipSlices(ColumnGeometry* c, int det_cols);
+
+	int slices;			// volume slices (z)
+	int rows;			// volume rows (y)
+	int cols;			// volume columns (x)
+	const double* x;	// voxel centres in mm
+	const double* y;
+	double z0;			// z of slice 0
+	double res;			// voxel size
+
+	ColumnGeometry* table;
+	int* col_start;
+	int* col_end;
+};
+
+ProjectionGeometry::ProjectionGeometry(int newSlices, int newRows, int newCols, const double* newX, const double* newY, double newZ0, double newRes)
+:slices(newSlices), rows(newRows), cols(newCols), x(newX), y(newY), z0(newZ0), res(newRes)
+{
+	table = new ColumnGeometry[rows*cols];
+	col_start = new int[rows];
+	col_end = new int[rows];
+
+	SetCylinder(0);
+}
+
+ProjectionGeometry::~ProjectionGeometry()
+{
+	delete [] table;
+	delete [] col_start;
+	delete [] col_end;
+}
+
+void ProjectionGeometry::SetCylinder(double radius)
+{
+	int j,k;
+	double xc, yc;
+	double dx, dy;
+
+	xc = (x[0] + x[cols-1]) / 2;
+	yc = (y[0] + y[rows-1]) / 2;
+
+	for(j=0;j<rows;j++)
+	{
+		col_start[j] = 0;
+		col_end[j] = cols;
+
+		if(radius <= 0)
+			continue;
+
+		dy = y[j] - yc;
+		for(k=0;k<cols;k++)
+		{
+			dx = x[k] - xc;
+			if(dx*dx + dy*dy <= radius*radius)
+				break;
+		}
+		col_start[j] = k;
+
+		for(k=cols;k>col_start[j];k--)
+		{
+			dx = x[k-1] - xc;
+			if(dx*dx + dy*dy <= radius*radius)
+				break;
+		}
+		col_end[j] = k;
+	}
+}
+
+void ProjectionGeometry::Compute(const ScanGeometry& scan, double cos_theta, double sin_theta, double YOffset, double ZOffset,
+								 int j_start, int j_end)
+{
+	int j,k;
+	double x_r, y_r;		// rotated x,y coordinates
+	double mag;
+	double scale;
+	double y_p;
+	ColumnGeometry* c;
+
+	for(j=j_start;j<j_end;j++)
+	{
+		for(k=col_start[j];k<col_end[j];k++)
+		{
+			c = &table[j*cols + k];
+
+			x_r = x[k] * cos_theta + y[j] * sin_theta;
+			y_r = -x[k] * sin_theta + y[j] * cos_theta;
+			mag = scan.sourceToDetector/(scan.sourceToAxis + x_r);
+
+			y_p = y_r * mag + YOffset;		// in mm
+			y_p = ((scan.det_rows-1.0)/2.0) - (y_p/scan.detectorRes);
+
+			scale = scan.sourceToAxis /(scan.sourceToAxis - x_r);
+			scale *= scale;
+
+			c->fy = (int)floor(y_p);
+			c->dy = y_p - c->fy;
+			c->scale = scale;
+			c->zp0 = (z0 * mag + ZOffset)/scan.detectorRes + ((scan.det_cols-1.0)/2.0);
+			c->dzp = res * mag / scan.detectorRes;
+
+			// the whole column misses the detector
+			if( (c->fy <= 0) || (c->fy >= (scan.det_rows - 1)) )
+			{
+				c->fy = -1;
+				c->i_start = c->i_end = 0;
+			}
+			else
+				ClipSlices(c, scan.det_cols);
+		}
+	}
+}
+
+// finds the slices with 0 < floor(zp0 + i*dzp) < det_cols-1, i.e. 1 <= z_p < det_cols-1.
+// The first guess comes from solving for i, then it's nudged so the test is exactly the
+// one the kernel would have done per voxel.
+void ProjectionGeometry::ClipSlices(ColumnGeometry* c, int det_cols)
+{
+	int i_start, i_end;
+	double lo = 1.0;
+	double hi = det_cols - 1.0;
+
+	if(c->dzp <= 0)		// can't happen unless the voxel is behind the source
+	{
+		c->fy = -1;
+		c->i_start = c->i_end = 0;
+		return;
+	}
+
+	i_start = (int)max(0.0, min((double)slices, ceil((lo - c->zp0)/c->dzp)));
+	while(i_start > 0 && c->zp0 + (i_start-1)*c->dzp >= lo)
+		i_start--;
+	while(i_start < slices && c->zp0 + i_start*c->dzp < lo)
+		i_start++;
+
+	i_end = (int)max(0.0, min((double)slices, ceil((hi - c->zp0)/c->dzp)));
+	while(i_end > 0 && c->zp0 + (i_end-1)*c->dzp >= hi)
+		i_end--;
+	while(i_end < slices && c->zp0 + i_end*c->dzp < hi)
+		i_end++;
+
+	if(i_end < i_start)
+		i_end = i_start;
+
+	c->i_start = i_start;
+	c->i_end = i_end;
+}
+
+#endif
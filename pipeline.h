@@ -0,0 +1,362 @@
+// pipeline.h
+
+// overlaps reading the projections with filtering and backprojecting them.
+// A fixed ring of ProjBuffers moves through three stages, connected by bounded queues:
+//   load    - reads the raw counts of the next projection (by angle) from its file (one thread)
+//   filter  - log transform, beam hardening, cos weighting and the ramp filter (one thread)
+//   consume - whoever calls Next()/Release(), normally the backprojection workers
+// Projections come out of Next() in the order they were read, so the result is the same
+// as doing the stages one after another.
+// Each stage keeps track of how long it spent working, waiting for input (starved) and
+// waiting for somewhere to put its output (blocked); the busiest stage is the bottleneck.
+// With a sinogram cache directory set on the Projection (sinogram_cache.h) the filter stage
+// saves what it produces, and the next pipeline that wants the same projections loads them
+// from the cache instead, with nothing left for the filter stage to do.
+// When the Projection has room for a projection stack (projection_stack.h) the filter stage
+// also puts each preprocessed projection on it, and once the stack is full the pipelines
+// after that load from memory and only filter, leaving the files and the cache alone.
+
+// requires Projection and ProjBuffer to be defined before inclusion
+
+#ifndef _PIPELINE_H
+#define _PIPELINE_H
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <deque>
+#include <iostream>
+
+using namespace std;
+
+// fifo of buffers that blocks when it's empty or holds max_size items.
+// Close() wakes everyone up, Pop() then returns whatever is left followed by NULL.
+class BoundedQueue
+{
+public:
+	BoundedQueue(int newMaxSize) : max_size(newMaxSize), closed(false), max_depth(0), depth_total(0), pushes(0) {}
+
+	bool Push(ProjBuffer* buf, double* wait);	// false if the queue was closed
+	ProjBuffer* Pop(double* wait);				// NULL once the queue is closed and empty
+	void Close();
+	void Reopen();
+
+	int MaxDepth() { return max_depth; }
+	double MeanDepth() { return pushes ? (double)depth_total / pushes : 0.0; }
+
+private:
+	int max_size;
+	bool closed;
+	deque<ProjBuffer*> items;
+	mutex m;
+	condition_variable cv_not_empty;
+	condition_variable cv_not_full;
+
+	// depth seen by each push, to show whether the queue ever fills up
+	int max_depth;
+	long long depth_total;
+	long long pushes;
+};
+
+// time spent in each state, in seconds
+struct StageStats
+{
+	double busy;
+	double starved;		// waiting for input
+	double blocked;		// waiting for an empty slot downstream
+	int count;			// projections handled
+};
+
+class ProjectionPipeline
+{
+public:
+	// slots is the number of projection buffers in flight, at least 2.
+	// With filter = false the projections are only log/beam hardening corrected, for
+	// callers that need to change the raw projection before filtering it (metal removal).
+	ProjectionPipeline(Projection* newProj, int slots = 4, bool filter = true);
+	~ProjectionPipeline();
+
+	void Start();			// starts reading from the first projection, from the cache if there's one
+	ProjBuffer* Next();		// next projection in order, NULL after the last one
+	void Release(ProjBuffer* buf);	// hands a buffer from Next() back to the loader
+	void Stop();			// cancels anything still in flight and waits for the threads
+
+	void PrintStats();
+
+private:
+	void LoadLoop();
+	void FilterLoop();
+
+	Projection* proj;
+	bool do_filter;
+	bool running;
+
+	SinogramCache cache;	// open to read from it, or writing to save this pass
+	bool from_stack;		// loading from proj->stack, which is full
+	bool fill_stack;		// putting the preprocessed projections on proj->stack as they go by
+
+	int num_slots;
+	ProjBuffer** slots;
+
+	BoundedQueue free_q;	// empty buffers waiting to be loaded
+	BoundedQueue load_q;	// raw projections waiting for the filter
+	BoundedQueue ready_q;	// finished projections waiting for the consumer
+
+	thread loader;
+	thread filterer;
+
+	StageStats load_stats;
+	StageStats filter_stats;
+	StageStats consume_stats;
+	chrono::steady_clock::time_point consume_start;	// when the buffer now held by the consumer was handed out
+	chrono::steady_clock::time_point start_time;
+};
+
+static double SecondsSince(chrono::steady_clock::time_point t)
+{
+	return chrono::duration<double>(chrono::steady_clock::now() - t).count();
+}
+
+bool BoundedQueue::Push(ProjBuffer* buf, double* wait)
+{
+	chrono::steady_clock::time_point t = chrono::steady_clock::now();
+	unique_lock<mutex> lock(m);
+
+	while(!closed && (int)items.size() >= max_size)
+		cv_not_full.wait(lock);
+	if(wait)
+		*wait += SecondsSince(t);
+	if(closed)
+		return false;
+
+	items.push_back(buf);
+	if((int)items.size() > max_depth)
+		max_depth = (int)items.size();
+	depth_total += items.size();
+	pushes++;
+
+	lock.unlock();
+	cv_not_empty.notify_one();
+	return true;
+}
+
+ProjBuffer* BoundedQueue::Pop(double* wait)
+{
+	ProjBuffer* buf;
+	chrono::steady_clock::time_point t = chrono::steady_clock::now();
+	unique_lock<mutex> lock(m);
+
+	while(!closed && items.empty())
+		cv_not_empty.wait(lock);
+	if(wait)
+		*wait += SecondsSince(t);
+	if(items.empty())
+		return NULL;
+
+	buf = items.front();
+	items.pop_front();
+
+	lock.unlock();
+	cv_not_full.notify_one();
+	return buf;
+}
+
+void BoundedQueue::Close()
+{
+	{
+		lock_guard<mutex> lock(m);
+		closed = true;
+	}
+	cv_not_empty.notify_all();
+	cv_not_full.notify_all();
+}
+
+void BoundedQueue::Reopen()
+{
+	lock_guard<mutex> lock(m);
+	items.clear();
+	closed = false;
+	max_depth = 0;
+	depth_total = 0;
+	pushes = 0;
+}
+
+ProjectionPipeline::ProjectionPipeline(Projection* newProj, int newSlots, bool filter)
+:proj(newProj), do_filter(filter), running(false), from_stack(false), fill_stack(false),
+ num_slots(max(newSlots, 2)), free_q(max(newSlots, 2)), load_q(max(newSlots, 2)), ready_q(max(newSlots, 2))
+{
+	slots = new ProjBuffer*[num_slots];
+	for(int i=0;i<num_slots;i++)
+		slots[i] = new ProjBuffer(proj->rows, proj->cols);
+}
+
+ProjectionPipeline::~ProjectionPipeline()
+{
+	Stop();
+
+	for(int i=0;i<num_slots;i++)
+		delete slots[i];
+	delete [] slots;
+}
+
+void ProjectionPipeline::Start()
+{
+	Stop();
+
+	free_q.Reopen();
+	load_q.Reopen();
+	ready_q.Reopen();
+	for(int i=0;i<num_slots;i++)
+		free_q.Push(slots[i], NULL);
+
+	memset(&load_stats, 0, sizeof(load_stats));
+	memset(&filter_stats, 0, sizeof(filter_stats));
+	memset(&consume_stats, 0, sizeof(consume_stats));
+	start_time = chrono::steady_clock::now();
+
+	// the cache is only written if every projection gets through
+	from_stack = proj->stack.IsFull();
+	string key = !proj->cache_dir.empty() && !from_stack ? proj->CacheKey(do_filter) : "";
+	if(!key.empty() && !cache.Open(proj->cache_dir, key, proj->rows, proj->cols, proj->num_proj))
+		cache.Create(proj->cache_dir, key, proj->rows, proj->cols, proj->num_proj, proj->cache_budget);
+	if(cache.IsOpen())
+		cout << "Loading " << (do_filter ? "filtered" : "preprocessed") << " projections from the sinogram cache" << endl;
+
+	// filtered projections from the cache can't go on the stack
+	fill_stack = proj->stack.IsReserved() && !from_stack && !(cache.IsOpen() && do_filter);
+	if(fill_stack)
+		proj->stack.Clear();
+
+	running = true;
+	loader = thread(&ProjectionPipeline::LoadLoop, this);
+	filterer = thread(&ProjectionPipeline::FilterLoop, this);
+}
+
+void ProjectionPipeline::Stop()
+{
+	if(!running)
+		return;
+
+	free_q.Close();
+	load_q.Close();
+	ready_q.Close();
+	loader.join();
+	filterer.join();
+	proj->Rewind();
+	cache.Close();		// throws away a cache file that wasn't finished
+	if(fill_stack && !proj->stack.IsFull())
+		proj->stack.Clear();
+
+	running = false;
+}
+
+void ProjectionPipeline::LoadLoop()
+{
+	ProjBuffer* buf;
+	chrono::steady_clock::time_point t;
+	int n = 0;
+
+	while((buf = free_q.Pop(&load_stats.starved)) != NULL)
+	{
+		t = chrono::steady_clock::now();
+		if(from_stack)
+		{
+			if(n >= proj->stack.GetNumProj())
+				break;
+			for(int i=0;i<proj->rows;i++)
+				memcpy(buf->pd[i], proj->stack.GetProj(n) + i*proj->cols, proj->cols*sizeof(FP_VAR));
+			buf->projAngle = proj->stack.GetAngle(n++);
+		}
+		else if(cache.IsOpen())
+		{
+			if(n >= proj->num_proj)
+				break;
+			for(int i=0;i<proj->rows;i++)
+				memcpy(buf->pd[i], cache.GetProj(n) + i*proj->cols, proj->cols*sizeof(FP_VAR));
+			buf->projAngle = cache.GetAngle(n++);
+		}
+		else if(!proj->ReadNext(buf))
+			break;
+		load_stats.busy += SecondsSince(t);
+		load_stats.count++;
+
+		if(!load_q.Push(buf, &load_stats.blocked))
+			return;
+	}
+
+	load_q.Close();		// no more projections, the filter drains what's left
+}
+
+void ProjectionPipeline::FilterLoop()
+{
+	ProjBuffer* buf;
+	chrono::steady_clock::time_point t;
+
+	while((buf = load_q.Pop(&filter_stats.starved)) != NULL)
+	{
+		t = chrono::steady_clock::now();
+		if(from_stack)
+		{
+			if(do_filter)
+				proj->Filter(buf);
+		}
+		else if(!cache.IsOpen())
+		{
+			proj->Preprocess(buf);
+			if(fill_stack)
+				proj->stack.Add(buf->pd, buf->projAngle);
+			if(do_filter)
+				proj->Filter(buf);
+			if(cache.IsWriting())
+				cache.Add(buf->pd, buf->projAngle);
+		}
+		else if(fill_stack)		// preprocessed projections from the cache
+			proj->stack.Add(buf->pd, buf->projAngle);
+		filter_stats.busy += SecondsSince(t);
+		filter_stats.count++;
+
+		if(!ready_q.Push(buf, &filter_stats.blocked))
+			return;
+	}
+
+	if(cache.IsWriting() && cache.Finish())
+		cout << "Saved the " << (do_filter ? "filtered" : "preprocessed") << " projections to the sinogram cache" << endl;
+	ready_q.Close();
+}
+
+ProjBuffer* ProjectionPipeline::Next()
+{
+	ProjBuffer* buf = ready_q.Pop(&consume_stats.starved);
+	consume_start = chrono::steady_clock::now();
+	return buf;
+}
+
+void ProjectionPipeline::Release(ProjBuffer* buf)
+{
+	consume_stats.busy += SecondsSince(consume_start);
+	consume_stats.count++;
+	free_q.Push(buf, &consume_stats.blocked);
+}
+
+void ProjectionPipeline::PrintStats()
+{
+	double total = SecondsSince(start_time);
+	if(total <= 0)
+		return;
+
+	const char* names[3] = {"load", "filter", "backproject"};
+	StageStats* stats[3] = {&load_stats, &filter_stats, &consume_stats};
+
+	cout << "Pipeline: " << num_slots << " buffers, " << total << " s" << endl;
+	for(int s=0;s<3;s++)
+	{
+		cout << "  " << names[s] << ": " << stats[s]->count << " projections, busy "
+			 << 100.0*stats[s]->busy/total << "%, starved " << 100.0*stats[s]->starved/total
+			 << "%, blocked " << 100.0*stats[s]->blocked/total << "%" << endl;
+	}
+	cout << "  queue depth (mean/max): load " << load_q.MeanDepth() << "/" << load_q.MaxDepth()
+		 << ", ready " << ready_q.MeanDepth() << "/" << ready_q.MaxDepth() << endl;
+}
+
+#endif
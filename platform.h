@@ -0,0 +1,355 @@
+// platform.h
+
+// the few operating system services the reconstruction engine needs, so the same
+// engine builds for the Windows GUI and for the command line version on Linux.
+
+#ifndef _PLATFORM_H
+#define _PLATFORM_H
+
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#include <process.h>
+#else
+#include <dirent.h>
+#include <fnmatch.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+using namespace std;
+
+#ifdef _WIN32
+#define PATH_SEP "\\"
+#else
+#define PATH_SEP "/"
+
+#ifndef MAX_PATH
+#define MAX_PATH 4096
+#endif
+
+// the bounds checked CRT functions used throughout, with the same arguments
+#define sprintf_s snprintf
+#define localtime_s(tm_out, time_in) localtime_r(time_in, tm_out)
+
+inline int strcpy_s(char* dest, size_t size, const char* src)
+{
+	if(!dest || !size)
+		return -1;
+	snprintf(dest, size, "%s", src);
+	return 0;
+}
+#endif
+
+// walks through the files in a directory whose names match a wildcard pattern (* and ?).
+// On Linux the names come back sorted, which is the order NTFS gives them on Windows.
+class FileFinder
+{
+public:
+	FileFinder();
+	~FileFinder();
+
+	// finds the first match and copies its name (without the directory) to name,
+	// returns false if there isn't one
+	bool First(const char* dir, const char* pattern, char* name, size_t len);
+	bool Next(char* name, size_t len);		// false when there are no more files
+	void Close();
+	bool IsOpen() { return open; }
+
+private:
+	bool open;
+#ifdef _WIN32
+	intptr_t handle;
+	_finddata_t data;
+#else
+	vector<string> names;
+	size_t pos;
+#endif
+};
+
+FileFinder::FileFinder()
+{
+	open = false;
+#ifdef _WIN32
+	handle = -1;
+#else
+	pos = 0;
+#endif
+}
+
+FileFinder::~FileFinder()
+{
+	Close();
+}
+
+bool FileFinder::First(const char* dir, const char* pattern, char* name, size_t len)
+{
+	Close();
+
+#ifdef _WIN32
+	char filespec[MAX_PATH];
+
+	sprintf_s(filespec,MAX_PATH,"%s\\%s",dir,pattern);
+	if((handle = _findfirst(filespec, &data)) == -1)
+		return false;
+	open = true;
+	strncpy(name, data.name, len);
+	name[len-1] = 0;
+	return true;
+#else
+	DIR* d;
+	struct dirent* entry;
+
+	if(!(d = opendir(dir)))
+		return false;
+	names.clear();
+	while((entry = readdir(d)) != NULL)
+		if(fnmatch(pattern, entry->d_name, 0) == 0)
+			names.push_back(entry->d_name);
+	closedir(d);
+
+	sort(names.begin(), names.end());
+	pos = 0;
+	open = true;
+	return Next(name, len);
+#endif
+}
+
+bool FileFinder::Next(char* name, size_t len)
+{
+	if(!open)
+		return false;
+
+#ifdef _WIN32
+	if(_findnext(handle, &data) == -1)	// _findnext will return 0 if sucessful
+	{
+		Close();
+		return false;
+	}
+	strncpy(name, data.name, len);
+#else
+	if(pos >= names.size())
+	{
+		Close();
+		return false;
+	}
+	strncpy(name, names[pos++].c_str(), len);
+#endif
+	name[len-1] = 0;
+	return true;
+}
+
+void FileFinder::Close()
+{
+	if(!open)
+		return;
+
+#ifdef _WIN32
+	_findclose(handle);
+	handle = -1;
+#else
+	names.clear();
+	pos = 0;
+#endif
+	open = false;
+}
+
+// physical memory not in use right now, in bytes
+unsigned long long AvailableMemory()
+{
+#ifdef _WIN32
+	MEMORYSTATUSEX status;
+	status.dwLength = sizeof(status);
+	return GlobalMemoryStatusEx(&status) ? status.ullAvailPhys : 0;
+#else
+	long pages = sysconf(_SC_AVPHYS_PAGES);
+	long page_size = sysconf(_SC_PAGESIZE);
+	return pages > 0 && page_size > 0 ? (unsigned long long)pages * page_size : 0;
+#endif
+}
+
+// size in bytes and last write time of a file, false if it isn't there. The times are only for
+// comparing with each other, they aren't in the same units on Windows and Linux.
+bool FileStatus(const char* filename, long long* size, long long* modified)
+{
+#ifdef _WIN32
+	WIN32_FILE_ATTRIBUTE_DATA info;
+
+	if(!GetFileAttributesExA(filename, GetFileExInfoStandard, &info))
+		return false;
+	*size = ((long long)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+	*modified = ((long long)info.ftLastWriteTime.dwHighDateTime << 32) | info.ftLastWriteTime.dwLowDateTime;
+#else
+	struct stat st;
+
+	if(stat(filename, &st) != 0)
+		return false;
+	*size = st.st_size;
+	*modified = st.st_mtime;
+#endif
+	return true;
+}
+
+// a whole file mapped read only into memory, so its contents can be used in place
+// without reading them into a buffer first. Open again to map another file.
+// A file made with Create is mapped read/write instead, and what's written to it goes to the file.
+class MappedFile
+{
+public:
+	MappedFile();
+	~MappedFile();
+
+	bool Open(const char* filename);	// false if it can't be opened or mapped (an empty file can't)
+	bool Create(const char* filename, size_t newSize);	// replaces the file with size zero bytes
+	void Close();
+
+	const unsigned char* Data() { return data; }	// NULL when nothing is mapped
+	unsigned char* WritableData() { return writable ? data : NULL; }	// NULL unless made with Create
+	size_t Size() { return size; }
+
+private:
+	unsigned char* data;
+	size_t size;
+	bool writable;
+#ifdef _WIN32
+	HANDLE file;
+	HANDLE mapping;
+#endif
+};
+
+MappedFile::MappedFile()
+{
+	data = NULL;
+	size = 0;
+	writable = false;
+#ifdef _WIN32
+	file = INVALID_HANDLE_VALUE;
+	mapping = NULL;
+#endif
+}
+
+MappedFile::~MappedFile()
+{
+	Close();
+}
+
+bool MappedFile::Open(const char* filename)
+{
+	Close();
+
+#ifdef _WIN32
+	LARGE_INTEGER file_size;
+
+	file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if(file == INVALID_HANDLE_VALUE)
+		return false;
+	if(!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0 ||
+	   !(mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL)))
+	{
+		Close();
+		return false;
+	}
+	if(!(data = (unsigned char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0)))
+	{
+		Close();
+		return false;
+	}
+	size = (size_t)file_size.QuadPart;
+#else
+	struct stat st;
+	int fd;
+	void* p;
+	int flags = MAP_PRIVATE;
+
+#ifdef MAP_POPULATE
+	flags |= MAP_POPULATE;	// read it all in now, on the thread that opens it
+#endif
+
+	if((fd = open(filename, O_RDONLY)) < 0)
+		return false;
+	if(fstat(fd, &st) != 0 || st.st_size == 0)
+	{
+		close(fd);
+		return false;
+	}
+	p = mmap(NULL, st.st_size, PROT_READ, flags, fd, 0);
+	close(fd);		// the mapping keeps the file open
+	if(p == MAP_FAILED)
+		return false;
+	data = (unsigned char*)p;
+	size = st.st_size;
+#endif
+
+	return true;
+}
+
+bool MappedFile::Create(const char* filename, size_t newSize)
+{
+	Close();
+	if(newSize == 0)
+		return false;
+
+#ifdef _WIN32
+	file = CreateFileA(filename, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(file == INVALID_HANDLE_VALUE)
+		return false;
+	// the mapping makes the file newSize bytes long
+	if(!(mapping = CreateFileMappingA(file, NULL, PAGE_READWRITE, DWORD((unsigned long long)newSize >> 32), DWORD(newSize), NULL)) ||
+	   !(data = (unsigned char*)MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, 0)))
+	{
+		Close();
+		return false;
+	}
+#else
+	int fd;
+	void* p;
+
+	if((fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0)
+		return false;
+	if(ftruncate(fd, newSize) != 0)
+	{
+		close(fd);
+		return false;
+	}
+	p = mmap(NULL, newSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(p == MAP_FAILED)
+		return false;
+	data = (unsigned char*)p;
+#endif
+
+	size = newSize;
+	writable = true;
+	return true;
+}
+
+void MappedFile::Close()
+{
+#ifdef _WIN32
+	if(data)
+		UnmapViewOfFile(data);
+	if(mapping)
+		CloseHandle(mapping);
+	if(file != INVALID_HANDLE_VALUE)
+		CloseHandle(file);
+	mapping = NULL;
+	file = INVALID_HANDLE_VALUE;
+#else
+	if(data)
+		munmap((void*)data, size);
+#endif
+	data = NULL;
+	size = 0;
+	writable = false;
+}
+
+#endif
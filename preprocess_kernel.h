@@ -0,0 +1,180 @@
+// preprocess_kernel.h
+
+// log transform and beam hardening correction of one detector row. The counts are 16 bit,
+// so log(count) comes from a table with an entry for every possible count, and log(blank)
+// is worked out once per scan, which leaves a table fetch, a subtraction and a fetch from the
+// beam hardening table (beam_hardening.h) for each pixel.
+// The tables and the arithmetic are single precision where Projection::PreprocessReference
+// works in double. The difference from it, absolute where the attenuation is under 1 and
+// relative above that, is under 1e-6 for any count without a correction and under 5e-6 with
+// one (CheckPreprocess in phantom_bench checks every count against these).
+
+// requires FP_VAR to be defined before inclusion
+
+#ifndef _PREPROCESS_KERNEL_H
+#define _PREPROCESS_KERNEL_H
+
+#include <cmath>
+
+#include "cpu_features.h"
+#include "beam_hardening.h"
+
+using namespace std;
+
+const int LOG_LUT_SIZE = 65536;		// one entry for every unsigned short count
+
+// fills lut[c] = log(c) for every count, lut[0] is -infinity like log(0)
+void BuildLogLUT(FP_VAR* lut)
+{
+	for(int c=0;c<LOG_LUT_SIZE;c++)
+		lut[c] = FP_VAR(log(double(c)));
+}
+
+// out[j] = correction(P) where P = log_blank[j] - log_lut[raw[j]] = log(blank/raw) for 0 <= j < n,
+// with the correction looked up in bh, or NULL for no correction (out[j] = P).
+// The vector versions can differ from the scalar one in the last bit (fused multiply-adds).
+typedef void (*PreprocessKernel)(FP_VAR* out, const unsigned short* raw, const FP_VAR* log_blank,
+								 const FP_VAR* log_lut, const BHTable* bh, int n);
+
+void PreprocessKernelScalar(FP_VAR* out, const unsigned short* raw, const FP_VAR* log_blank,
+							const FP_VAR* log_lut, const BHTable* bh, int n)
+{
+	int i,j;
+	FP_VAR P,t;
+
+	if(!bh)
+	{
+		for(j=0;j<n;j++)
+			out[j] = log_blank[j] - log_lut[raw[j]];
+		return;
+	}
+
+	for(j=0;j<n;j++)
+	{
+		P = log_blank[j] - log_lut[raw[j]];
+		t = (P - bh->lo) * bh->scale;		// position in the table
+		if(!(t >= 0))		// also catches 0/0
+			t = 0;
+		if(t > BH_TABLE_SIZE)
+			t = BH_TABLE_SIZE;
+		i = min(int(t), BH_TABLE_SIZE-1);
+		out[j] = bh->entries[2*i] + bh->entries[2*i+1] * (t - i);
+	}
+}
+
+#ifdef CT_SIMD_X86
+
+// 8 pixels at a time, gathers from the log and correction tables
+TARGET_AVX2 void PreprocessKernelAVX2(FP_VAR* out, const unsigned short* raw, const FP_VAR* log_blank,
+									  const FP_VAR* log_lut, const BHTable* bh, int n)
+{
+	float* f_out = (float*)out;
+	const float* f_blank = (const float*)log_blank;
+	const float* f_lut = (const float*)log_lut;
+
+	int j = 0;
+	if(!bh)
+	{
+		for(;j+8<=n;j+=8)
+		{
+			__m256i c = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(raw + j)));
+			__m256 P = _mm256_sub_ps(_mm256_loadu_ps(f_blank + j), _mm256_i32gather_ps(f_lut, c, 4));
+			_mm256_storeu_ps(f_out + j, P);
+		}
+	}
+	else
+	{
+		const float* f_entries = (const float*)bh->entries;
+		const __m256 lo = _mm256_set1_ps((float)bh->lo);
+		const __m256 scale = _mm256_set1_ps((float)bh->scale);
+		const __m256 t_max = _mm256_set1_ps((float)BH_TABLE_SIZE);
+		const __m256i i_max = _mm256_set1_epi32(BH_TABLE_SIZE-1);
+
+		for(;j+8<=n;j+=8)
+		{
+			__m256i c = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(raw + j)));
+			__m256 P = _mm256_sub_ps(_mm256_loadu_ps(f_blank + j), _mm256_i32gather_ps(f_lut, c, 4));
+			__m256 t = _mm256_mul_ps(_mm256_sub_ps(P, lo), scale);
+			t = _mm256_min_ps(_mm256_max_ps(t, _mm256_setzero_ps()), t_max);	// max gives 0 for NaN, like the scalar version
+			__m256i i = _mm256_min_epi32(_mm256_cvttps_epi32(t), i_max);
+			__m256 frac = _mm256_sub_ps(t, _mm256_cvtepi32_ps(i));
+			__m256 v = _mm256_i32gather_ps(f_entries, i, 8);
+			__m256 dv = _mm256_i32gather_ps(f_entries + 1, i, 8);
+			_mm256_storeu_ps(f_out + j, _mm256_add_ps(v, _mm256_mul_ps(dv, frac)));
+		}
+	}
+
+	PreprocessKernelScalar(out + j, raw + j, log_blank + j, log_lut, bh, n - j);
+}
+
+// 16 pixels at a time
+TARGET_AVX512 void PreprocessKernelAVX512(FP_VAR* out, const unsigned short* raw, const FP_VAR* log_blank,
+										  const FP_VAR* log_lut, const BHTable* bh, int n)
+{
+	float* f_out = (float*)out;
+	const float* f_blank = (const float*)log_blank;
+	const float* f_lut = (const float*)log_lut;
+
+	int j = 0;
+	if(!bh)
+	{
+		for(;j+16<=n;j+=16)
+		{
+			__m512i c = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*)(raw + j)));
+			__m512 P = _mm512_sub_ps(_mm512_loadu_ps(f_blank + j), _mm512_i32gather_ps(c, f_lut, 4));
+			_mm512_storeu_ps(f_out + j, P);
+		}
+	}
+	else
+	{
+		const float* f_entries = (const float*)bh->entries;
+		const __m512 lo = _mm512_set1_ps((float)bh->lo);
+		const __m512 scale = _mm512_set1_ps((float)bh->scale);
+		const __m512 t_max = _mm512_set1_ps((float)BH_TABLE_SIZE);
+		const __m512i i_max = _mm512_set1_epi32(BH_TABLE_SIZE-1);
+
+		for(;j+16<=n;j+=16)
+		{
+			__m512i c = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*)(raw + j)));
+			__m512 P = _mm512_sub_ps(_mm512_loadu_ps(f_blank + j), _mm512_i32gather_ps(c, f_lut, 4));
+			__m512 t = _mm512_mul_ps(_mm512_sub_ps(P, lo), scale);
+			t = _mm512_min_ps(_mm512_max_ps(t, _mm512_setzero_ps()), t_max);
+			__m512i i = _mm512_min_epi32(_mm512_cvttps_epi32(t), i_max);
+			__m512 frac = _mm512_sub_ps(t, _mm512_cvtepi32_ps(i));
+			__m512 v = _mm512_i32gather_ps(i, f_entries, 8);
+			__m512 dv = _mm512_i32gather_ps(i, f_entries + 1, 8);
+			_mm512_storeu_ps(f_out + j, _mm512_add_ps(v, _mm512_mul_ps(dv, frac)));
+		}
+	}
+
+	PreprocessKernelScalar(out + j, raw + j, log_blank + j, log_lut, bh, n - j);
+}
+
+#endif
+
+// picks the widest kernel the cpu can run, capped at max_level
+PreprocessKernel SelectPreprocessKernel(simd_level max_level)
+{
+	if(sizeof(FP_VAR) != sizeof(float))	// vector kernels are single precision only
+		return PreprocessKernelScalar;
+
+#ifdef CT_SIMD_X86
+	simd_level level = GetSIMDLevel();
+	if(max_level < level)
+		level = max_level;
+
+	switch(level)
+	{
+	case SIMD_AVX512:
+		return PreprocessKernelAVX512;
+	case SIMD_AVX2:
+		return PreprocessKernelAVX2;
+	default:
+		break;
+	}
+#endif
+
+	return PreprocessKernelScalar;
+}
+
+#endif
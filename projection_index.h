@@ -0,0 +1,206 @@
+// projection_index.h
+
+// one pass over a scan directory before anything is loaded. The headers of all the
+// 1.3.6.1.4.1* files are parsed in parallel (stopping at the pixel data) to find the blank
+// scan(s) and the angle of every projection, and where each file's pixel data starts, so the
+// projections can then be read in order of angle straight from the files.
+// The scanner saves an extra projection at 270 degrees before the others. Like any other
+// projection that repeats an angle it's dropped, keeping the last file (in name order) at
+// each angle.
+
+#ifndef _PROJECTION_INDEX_H
+#define _PROJECTION_INDEX_H
+
+#include <cmath>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <iostream>
+
+#include "platform.h"
+#include "dicom.h"
+#include "thread_pool.h"
+
+using namespace std;
+
+struct ProjectionEntry
+{
+	string filename;			// full path
+	double angle;				// (0009,1036), degrees
+	bool blank;					// ImageType (0008,0008) contains BLANK SCAN
+	long long pixel_offset;		// start of the pixel data in the file, -1 if there isn't any
+	unsigned long pixel_length;	// bytes
+};
+
+class ProjectionIndex
+{
+public:
+	// indexes dir with the given number of threads (0 uses every hardware thread),
+	// false if there are no files matching 1.3.6.1.4.1*
+	bool Build(const char* dir, int threads = 0);
+
+	int GetNumProj() { return (int)projections.size(); }
+	const ProjectionEntry& GetProj(int n) { return projections[n]; }	// in order of angle
+	int GetNumBlank() { return (int)blanks.size(); }
+	const ProjectionEntry* GetBlank() { return blanks.empty() ? NULL : &blanks[0]; }	// NULL if there isn't one
+
+	// prints duplicate angles (and the files dropped for them) and gaps in the angles,
+	// compared to expected_num_proj evenly spaced over 360 degrees. Returns true if there weren't any.
+	bool Report(int expected_num_proj);
+
+private:
+	vector<ProjectionEntry> projections;
+	vector<ProjectionEntry> blanks;
+	vector<ProjectionEntry> duplicates;
+};
+
+// parses the header of one file, false if it isn't a DICOM file with pixel data
+static bool IndexFile(ProjectionEntry* entry)
+{
+	char image_type[65];
+	unsigned long len;
+
+	RootDicomObj dcm(entry->filename.c_str(), true);
+
+	entry->pixel_offset = dcm.GetPixelDataOffset();
+	entry->pixel_length = dcm.GetPixelDataLength();
+	entry->angle = 0;
+
+	len = dcm.GetValue(0x0008, 0x0008, image_type, sizeof(image_type)-1);
+	image_type[len < sizeof(image_type) ? len : 0] = 0;
+	entry->blank = strstr(image_type, "BLANK SCAN") != NULL;
+
+	if(!entry->blank)
+		dcm.GetValue(0x0009, 0x1036, &entry->angle, sizeof(entry->angle));
+
+	return entry->pixel_offset >= 0;
+}
+
+static bool CompareAngle(const ProjectionEntry& a, const ProjectionEntry& b)
+{
+	return a.angle < b.angle;
+}
+
+bool ProjectionIndex::Build(const char* dir, int threads)
+{
+	FileFinder finder;
+	char name[MAX_PATH];
+	char filename[MAX_PATH];
+	vector<ProjectionEntry> entries;
+	vector<char> ok;
+	size_t i;
+	int len;
+
+	projections.clear();
+	blanks.clear();
+	duplicates.clear();
+
+	if(!finder.First(dir, "1.3.6.1.4.1*", name, sizeof(name)))
+		return false;
+	do
+	{
+		len = sprintf_s(filename, MAX_PATH, "%s" PATH_SEP "%s", dir, name);
+		if(len < 0 || len >= MAX_PATH)
+		{
+			cout << "Warning: path too long, skipped " << dir << PATH_SEP << name << endl;
+			continue;
+		}
+		entries.push_back(ProjectionEntry());
+		entries.back().filename = filename;
+	} while(finder.Next(name, sizeof(name)));
+
+	// the files are independent, so the parse order doesn't matter
+	ok.resize(entries.size());
+	{
+		WorkerPool pool(threads);
+		pool.Run((int)entries.size(), [&](int n, int /*thread*/)
+		{
+			ok[n] = IndexFile(&entries[n]);
+		});
+	}
+
+	// entries are in name order, stable_sort keeps it for equal angles
+	for(i=0;i<entries.size();i++)
+	{
+		if(!ok[i])
+			cout << "Warning: no pixel data in " << entries[i].filename << ", skipped" << endl;
+		else if(entries[i].blank)
+			blanks.push_back(entries[i]);
+		else
+			projections.push_back(entries[i]);
+	}
+	stable_sort(projections.begin(), projections.end(), CompareAngle);
+
+	// keep the last of each run of equal angles
+	vector<ProjectionEntry> unique;
+	for(i=0;i<projections.size();i++)
+	{
+		if(i+1 < projections.size() && fabs(projections[i+1].angle - projections[i].angle) < 1e-3)
+			duplicates.push_back(projections[i]);
+		else
+			unique.push_back(projections[i]);
+	}
+	projections.swap(unique);
+
+	return true;
+}
+
+bool ProjectionIndex::Report(int expected_num_proj)
+{
+	bool clean = true;
+	size_t i;
+	double step, gap;
+
+	if(blanks.empty())
+	{
+		cout << "Warning: blank scan not found." << endl;
+		clean = false;
+	}
+	else if(blanks.size() > 1)
+	{
+		cout << "Warning: " << blanks.size() << " blank scans, using " << blanks[0].filename << endl;
+		clean = false;
+	}
+
+	for(i=0;i<duplicates.size();i++)
+	{
+		if(fabs(duplicates[i].angle - 270) < 1e-3)	// the scanner's extra one
+		{
+			cout << "Extra projection at 270 degrees dropped: " << duplicates[i].filename << endl;
+			continue;
+		}
+		cout << "Warning: duplicate projection at " << duplicates[i].angle << " degrees, dropped "
+			 << duplicates[i].filename << endl;
+		clean = false;
+	}
+
+	if(projections.empty() || expected_num_proj <= 0)
+		return clean && !projections.empty();
+
+	if((int)projections.size() != expected_num_proj)
+	{
+		cout << "Warning: " << projections.size() << " projections, the header says " << expected_num_proj << endl;
+		clean = false;
+	}
+
+	// a gap of more than one and a half steps means something is missing, including across 360
+	step = 360.0 / expected_num_proj;
+	for(i=0;i<projections.size();i++)
+	{
+		if(i+1 < projections.size())
+			gap = projections[i+1].angle - projections[i].angle;
+		else
+			gap = projections[0].angle + 360 - projections[i].angle;
+		if(gap > 1.5*step)
+		{
+			cout << "Warning: about " << int(floor(gap/step + 0.5)) - 1 << " projections missing between "
+				 << projections[i].angle << " and " << (i+1 < projections.size() ? projections[i+1].angle : projections[0].angle + 360)
+				 << " degrees" << endl;
+			clean = false;
+		}
+	}
+
+	return clean;
+}
+
+#endif
@@ -0,0 +1,160 @@
+// projection_stack.h
+
+// every preprocessed projection of a scan held in memory, one after another in a single
+// arena, so a reconstruction that goes over the projections more than once (metal removal)
+// only reads and log transforms the files the first time. ProjectionPipeline fills its
+// Projection's stack on the first pass and loads from it on every pass after that, without
+// touching the files or the sinogram cache. Any projection can be had by number or by angle.
+// The stack is only made when it fits in the budget set with Projection::SetStackBudget. If it
+// doesn't, or the memory can't be had, the projections are streamed from the files as before.
+
+// requires FP_VAR to be defined before inclusion
+
+#ifndef _PROJECTION_STACK_H
+#define _PROJECTION_STACK_H
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include "platform.h"
+
+using namespace std;
+
+class ProjectionStack
+{
+public:
+	ProjectionStack();
+	~ProjectionStack();
+
+	// makes room for num_proj projections if they fit in budget MB, false (with the reason
+	// printed, unless budget is 0) to stream them instead. A negative budget allows half the
+	// physical memory that's free. Throws away any stack already there.
+	bool Reserve(int newRows, int newCols, int newNumProj, long long budget_mb);
+	void Free();
+
+	bool Add(FP_VAR** pd, double angle);	// appends the next projection, false once there are num_proj
+	void Clear() { count = 0; }		// empties the stack but keeps the memory, after a pass that didn't finish
+
+	bool IsReserved() const { return arena != NULL; }
+	bool IsFull() const { return arena != NULL && count == num_proj; }
+	int GetNumProj() const { return count; }
+
+	const FP_VAR* GetProj(int n) const { return arena + n*stride; }	// rows*cols values, row after row
+	double GetAngle(int n) const { return angles[n]; }
+	int FindAngle(double angle) const;	// the projection nearest angle (degrees, either way round), -1 if empty
+
+private:
+	int rows;
+	int cols;
+	int num_proj;
+	int count;			// projections added so far
+	size_t stride;		// values from one projection to the next, a multiple of 64 bytes
+
+	FP_VAR* arena;		// num_proj*stride values, 64 byte aligned
+	double* angles;
+};
+
+ProjectionStack::ProjectionStack()
+{
+	rows = cols = num_proj = count = 0;
+	stride = 0;
+	arena = NULL;
+	angles = NULL;
+}
+
+ProjectionStack::~ProjectionStack()
+{
+	Free();
+}
+
+bool ProjectionStack::Reserve(int newRows, int newCols, int newNumProj, long long budget_mb)
+{
+	unsigned long long budget, bytes;
+
+	Free();
+	if(budget_mb == 0 || newNumProj <= 0)
+		return false;
+
+	rows = newRows;
+	cols = newCols;
+	num_proj = newNumProj;
+	stride = (size_t(rows)*cols*sizeof(FP_VAR) + 63) / 64 * 64 / sizeof(FP_VAR);
+
+	bytes = (unsigned long long)num_proj * stride * sizeof(FP_VAR);
+	if(budget_mb > 0)
+		budget = (unsigned long long)budget_mb << 20;
+	else
+		budget = AvailableMemory() / 2;
+	if(bytes > budget)
+	{
+		cout << "Projection stack needs " << (bytes >> 20) << " MB, over the " << (budget >> 20)
+			 << " MB budget, streaming the projections instead" << endl;
+		return false;
+	}
+
+#ifdef _WIN32
+	arena = (FP_VAR*)_aligned_malloc((size_t)bytes, 64);
+#else
+	void* p = NULL;
+	arena = posix_memalign(&p, 64, (size_t)bytes) == 0 ? (FP_VAR*)p : NULL;
+#endif
+	if(!arena)
+	{
+		cout << "Unable to allocate " << (bytes >> 20) << " MB for the projection stack, streaming the projections instead" << endl;
+		return false;
+	}
+	angles = new double[num_proj];
+
+	cout << "Projection stack: " << num_proj << " projections, " << (bytes >> 20) << " MB" << endl;
+	return true;
+}
+
+void ProjectionStack::Free()
+{
+#ifdef _WIN32
+	_aligned_free(arena);
+#else
+	free(arena);
+#endif
+	arena = NULL;
+	delete [] angles;
+	angles = NULL;
+	count = 0;
+}
+
+bool ProjectionStack::Add(FP_VAR** pd, double angle)
+{
+	if(!arena || count >= num_proj)
+		return false;
+
+	FP_VAR* dest = arena + count*stride;
+	for(int i=0;i<rows;i++)
+		memcpy(dest + i*cols, pd[i], cols*sizeof(FP_VAR));
+	angles[count++] = angle;
+
+	return true;
+}
+
+int ProjectionStack::FindAngle(double angle) const
+{
+	int n, best = -1;
+	double d, best_d = 0;
+
+	// linear, there are only a few hundred
+	for(n=0;n<count;n++)
+	{
+		d = fabs(fmod(angles[n] - angle, 360.0));
+		d = min(d, 360 - d);
+		if(best < 0 || d < best_d)
+		{
+			best = n;
+			best_d = d;
+		}
+	}
+
+	return best;
+}
+
+#endif
@@ -0,0 +1,320 @@
+// sinogram_cache.h
+
+// preprocessed (and optionally filtered) projections saved to disk, so reconstructing the same
+// scan again with a different volume skips reading, log transforming and filtering the
+// projections. ProjectionPipeline writes one as it goes the first time and reads from it
+// after that, when its Projection has been given a directory with SetSinogramCacheDir.
+// A cache file is found by a hash of its key, which names everything the projections depend on:
+// the scan (StudyInstanceUID/SeriesInstanceUID and size), the beam hardening correction, and
+// for filtered projections the filter, cutoff and FFT backend (Projection::CacheKey).
+//
+// file layout, little endian, all of it mappable as is:
+//   SinogramHeader
+//   key (key_length chars, not terminated)
+//   projections at data_offset (64 byte aligned), rows*cols FP_VARs each, row after row
+//   angles (num_proj doubles, degrees) right after the projections, only 4 byte aligned if
+//     FP_VAR is float and there's an odd number of values
+// Files are written under a temporary name and renamed when the last projection is in, so a
+// cache file that exists is complete.
+// Given a budget, Create first removes the oldest (by when they were written) cache files in
+// the directory until the new one fits in it alongside those left.
+
+// requires FP_VAR to be defined before inclusion
+
+#ifndef _SINOGRAM_CACHE_H
+#define _SINOGRAM_CACHE_H
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <iostream>
+
+#include "platform.h"
+
+using namespace std;
+
+const int SINOGRAM_CACHE_VERSION = 1;	// change when Preprocess or Filter change what they produce
+
+struct SinogramHeader
+{
+	char magic[8];			// "CTSINO\0\0"
+	int version;
+	int value_size;			// sizeof(FP_VAR)
+	int rows;
+	int cols;
+	int num_proj;
+	int key_length;
+	long long data_offset;	// from the start of the file
+};
+
+class SinogramCache
+{
+public:
+	SinogramCache();
+	~SinogramCache();
+
+	// maps the complete cache file for key in dir, false if there isn't one that matches
+	bool Open(const string& dir, const string& key, int newRows, int newCols, int newNumProj);
+	const FP_VAR* GetProj(int n) { return data + size_t(n)*rows*cols; }	// rows*cols values
+	double GetAngle(int n);
+
+	// starts a new cache file for key in dir, Add each projection to it in order, then Finish.
+	// With a budget (bytes, 0 for none) all the cache files in dir are kept under it.
+	bool Create(const string& dir, const string& key, int newRows, int newCols, int newNumProj, long long budget = 0);
+	bool Add(FP_VAR** pd, double angle);
+	bool Finish();		// false (and no cache file) unless all num_proj projections were added
+
+	void Close();		// closes a mapped file, or throws away one that wasn't finished
+	bool IsOpen() { return data != NULL; }
+	bool IsWriting() { return out != NULL; }
+
+private:
+	static string Directory(const string& dir);
+	static string FileName(const string& dir, const string& key);
+	static long long DataOffset(const string& key);
+	static bool Trim(const string& dir, long long budget, long long new_size);
+
+	int rows;
+	int cols;
+	int num_proj;
+
+	// reading
+	MappedFile file;
+	const FP_VAR* data;
+	const char* angles;		// num_proj doubles, maybe not aligned
+
+	// writing
+	FILE* out;
+	string out_name;
+	string temp_name;
+	double* out_angles;
+	int added;
+};
+
+SinogramCache::SinogramCache()
+{
+	rows = cols = num_proj = 0;
+	data = NULL;
+	angles = NULL;
+	out = NULL;
+	out_angles = NULL;
+	added = 0;
+}
+
+SinogramCache::~SinogramCache()
+{
+	Close();
+}
+
+// dir without a separator on the end, GetTempPath leaves one there
+string SinogramCache::Directory(const string& dir)
+{
+	size_t end = dir.find_last_not_of("\\/");
+	return end == string::npos ? "" : dir.substr(0, end + 1);
+}
+
+// <dir>/sino_<64 bit FNV-1a hash of the key>.bin
+string SinogramCache::FileName(const string& dir, const string& key)
+{
+	unsigned long long hash = 14695981039346656037ULL;
+	char name[64];
+
+	for(size_t i=0;i<key.size();i++)
+	{
+		hash ^= (unsigned char)key[i];
+		hash *= 1099511628211ULL;
+	}
+	sprintf_s(name, sizeof(name), "sino_%016llx.bin", hash);
+
+	return Directory(dir) + PATH_SEP + name;
+}
+
+long long SinogramCache::DataOffset(const string& key)
+{
+	return (sizeof(SinogramHeader) + key.size() + 63) / 64 * 64;
+}
+
+// removes cache files from dir, oldest first, until a new one of new_size bytes fits in budget
+// with the rest. False if it won't fit even on its own.
+bool SinogramCache::Trim(const string& dir, long long budget, long long new_size)
+{
+	struct CacheFile
+	{
+		string name;
+		long long size;
+		long long modified;
+	};
+
+	FileFinder finder;
+	char name[MAX_PATH];
+	vector<CacheFile> files;
+	CacheFile f;
+	long long total = new_size;
+
+	if(new_size > budget)
+		return false;
+
+	if(finder.First(Directory(dir).c_str(), "sino_*.bin", name, sizeof(name)))
+	{
+		do
+		{
+			f.name = Directory(dir) + PATH_SEP + name;
+			if(FileStatus(f.name.c_str(), &f.size, &f.modified))
+			{
+				files.push_back(f);
+				total += f.size;
+			}
+		}
+		while(finder.Next(name, sizeof(name)));
+	}
+
+	sort(files.begin(), files.end(), [](const CacheFile& a, const CacheFile& b) { return a.modified < b.modified; });
+	for(size_t i=0;i<files.size() && total>budget;i++)
+		if(remove(files[i].name.c_str()) == 0)
+			total -= files[i].size;
+
+	return true;
+}
+
+bool SinogramCache::Open(const string& dir, const string& key, int newRows, int newCols, int newNumProj)
+{
+	const SinogramHeader* h;
+	size_t values;
+
+	Close();
+	if(dir.empty() || !file.Open(FileName(dir, key).c_str()))
+		return false;
+
+	rows = newRows;
+	cols = newCols;
+	num_proj = newNumProj;
+	values = size_t(rows)*cols*num_proj;
+
+	// everything has to match, the hash only finds the file
+	h = (const SinogramHeader*)file.Data();
+	if(file.Size() < sizeof(SinogramHeader) || memcmp(h->magic, "CTSINO\0\0", 8) ||
+	   h->version != SINOGRAM_CACHE_VERSION || h->value_size != sizeof(FP_VAR) ||
+	   h->rows != rows || h->cols != cols || h->num_proj != num_proj ||
+	   h->key_length != (int)key.size() || h->data_offset != DataOffset(key) ||
+	   file.Size() != h->data_offset + values*sizeof(FP_VAR) + num_proj*sizeof(double) ||
+	   memcmp(file.Data() + sizeof(SinogramHeader), key.data(), key.size()))
+	{
+		file.Close();
+		return false;
+	}
+
+	data = (const FP_VAR*)(file.Data() + h->data_offset);
+	angles = (const char*)(data + values);
+	return true;
+}
+
+double SinogramCache::GetAngle(int n)
+{
+	double angle;
+
+	memcpy(&angle, angles + n*sizeof(double), sizeof(angle));
+	return angle;
+}
+
+bool SinogramCache::Create(const string& dir, const string& key, int newRows, int newCols, int newNumProj, long long budget)
+{
+	SinogramHeader h;
+	long long pos;
+
+	Close();
+	if(dir.empty())
+		return false;
+
+	rows = newRows;
+	cols = newCols;
+	num_proj = newNumProj;
+	if(budget > 0 && !Trim(dir, budget, DataOffset(key) + (long long)rows*cols*num_proj*sizeof(FP_VAR) + num_proj*sizeof(double)))
+	{
+		cout << "Warning: the sinogram cache for this scan won't fit in its " << budget/(1024*1024) << " MB" << endl;
+		return false;
+	}
+
+	out_name = FileName(dir, key);
+	temp_name = out_name + ".tmp";
+	if(!(out = fopen(temp_name.c_str(), "wb")))
+	{
+		cout << "Warning: can't write the sinogram cache " << temp_name << endl;
+		return false;
+	}
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, "CTSINO\0\0", 8);
+	h.version = SINOGRAM_CACHE_VERSION;
+	h.value_size = sizeof(FP_VAR);
+	h.rows = rows;
+	h.cols = cols;
+	h.num_proj = num_proj;
+	h.key_length = (int)key.size();
+	h.data_offset = DataOffset(key);
+
+	fwrite(&h, sizeof(h), 1, out);
+	fwrite(key.data(), 1, key.size(), out);
+	for(pos=sizeof(h)+key.size();pos<h.data_offset;pos++)
+		fputc(0, out);
+
+	out_angles = new double[num_proj];
+	added = 0;
+	return true;
+}
+
+bool SinogramCache::Add(FP_VAR** pd, double angle)
+{
+	if(!out || added >= num_proj)
+		return false;
+
+	for(int i=0;i<rows;i++)
+		fwrite(pd[i], sizeof(FP_VAR), cols, out);
+	out_angles[added++] = angle;
+
+	return true;
+}
+
+bool SinogramCache::Finish()
+{
+	bool ok;
+
+	if(!out)
+		return false;
+
+	ok = added == num_proj;
+	if(ok)
+		fwrite(out_angles, sizeof(double), num_proj, out);
+	ok = ok && !ferror(out);
+	ok = (fclose(out) == 0) && ok;
+	out = NULL;
+	delete [] out_angles;
+	out_angles = NULL;
+
+	remove(out_name.c_str());		// rename won't replace a file on Windows
+	if(!ok || rename(temp_name.c_str(), out_name.c_str()) != 0)
+	{
+		remove(temp_name.c_str());
+		return false;
+	}
+
+	return true;
+}
+
+void SinogramCache::Close()
+{
+	file.Close();
+	data = NULL;
+	angles = NULL;
+
+	if(out)
+	{
+		fclose(out);
+		out = NULL;
+		remove(temp_name.c_str());
+	}
+	delete [] out_angles;
+	out_angles = NULL;
+	added = 0;
+}
+
+#endif
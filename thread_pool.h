@@ -0,0 +1,145 @@
+// thread_pool.h
+
+// a small pool of worker threads used to split the reconstruction volume
+// into independent pieces. Each piece must only write to its own voxels,
+// so the result doesn't depend on how many threads there are.
+
+#ifndef _THREAD_POOL_H
+#define _THREAD_POOL_H
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <vector>
+
+using namespace std;
+
+class WorkerPool
+{
+public:
+	WorkerPool(int newThreads = 0);		// 0 uses every hardware thread
+	~WorkerPool();
+
+	int GetNumThreads() { return num_threads; }
+
+	// calls task(n, thread) for n = 0..num_tasks-1 and waits for all of them to finish
+	// thread is in the range 0..GetNumThreads()-1 and can be used to index per-thread buffers
+	void Run(int num_tasks, const function<void(int,int)>& task);
+
+private:
+	void WorkerLoop(int thread);
+	void DoTasks(int thread);
+
+	int num_threads;
+	vector<thread> workers;
+
+	mutex m;
+	condition_variable cv_start;
+	condition_variable cv_done;
+
+	const function<void(int,int)>* current_task;
+	int task_count;
+	atomic<int> next_task;
+	int busy;					// workers still running the current batch
+	unsigned int generation;	// incremented every time Run() hands out a new batch
+	bool quit;
+};
+
+WorkerPool::WorkerPool(int newThreads)
+{
+	num_threads = newThreads;
+	if(num_threads <= 0)
+		num_threads = thread::hardware_concurrency();
+	if(num_threads <= 0)
+		num_threads = 1;
+
+	current_task = NULL;
+	task_count = 0;
+	next_task = 0;
+	busy = 0;
+	generation = 0;
+	quit = false;
+
+	// the calling thread acts as thread 0, so only num_threads-1 extra threads are needed
+	for(int i=1;i<num_threads;i++)
+		workers.push_back(thread(&WorkerPool::WorkerLoop, this, i));
+}
+
+WorkerPool::~WorkerPool()
+{
+	{
+		lock_guard<mutex> lock(m);
+		quit = true;
+	}
+	cv_start.notify_all();
+
+	for(size_t i=0;i<workers.size();i++)
+		workers[i].join();
+}
+
+void WorkerPool::Run(int num_tasks, const function<void(int,int)>& task)
+{
+	if(num_tasks <= 0)
+		return;
+
+	if(workers.empty())
+	{
+		for(int n=0;n<num_tasks;n++)
+			task(n, 0);
+		return;
+	}
+
+	{
+		lock_guard<mutex> lock(m);
+		current_task = &task;
+		task_count = num_tasks;
+		next_task = 0;
+		busy = (int)workers.size();
+		generation++;
+	}
+	cv_start.notify_all();
+
+	DoTasks(0);
+
+	// wait for the other threads to run out of work
+	unique_lock<mutex> lock(m);
+	while(busy)
+		cv_done.wait(lock);
+	current_task = NULL;
+}
+
+void WorkerPool::DoTasks(int thread)
+{
+	int n;
+	while((n = next_task++) < task_count)
+		(*current_task)(n, thread);
+}
+
+void WorkerPool::WorkerLoop(int thread)
+{
+	unsigned int seen = 0;
+
+	while(1)
+	{
+		{
+			unique_lock<mutex> lock(m);
+			while(!quit && generation == seen)
+				cv_start.wait(lock);
+			if(quit)
+				return;
+			seen = generation;
+		}
+
+		DoTasks(thread);
+
+		{
+			lock_guard<mutex> lock(m);
+			busy--;
+		}
+		cv_done.notify_one();
+	}
+}
+
+#endif
@@ -0,0 +1,203 @@
+// volume.h
+
+// reconstruction volume stored in one contiguous, 64-byte aligned block.
+// Voxels are addressed as (slice, row, col), the same as the old recon[i][j][k],
+// but the order they're laid out in memory can be chosen when the volume is created.
+
+// requires FP_VAR to be defined before inclusion
+
+#ifndef _VOLUME_H
+#define _VOLUME_H
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#endif
+
+using namespace std;
+
+enum axis_order {
+	ORDER_SLICE_ROW_COL,	// x fastest, same as the .bin files
+	ORDER_ROW_COL_SLICE		// z fastest, every voxel column is contiguous (fastest for backprojection)
+};
+
+class Volume
+{
+public:
+	Volume(int newSlices, int newRows, int newCols, axis_order newOrder = ORDER_SLICE_ROW_COL, bool hugePages = false);
+	~Volume();
+
+	FP_VAR& operator()(int i, int j, int k) { return data[i*slice_stride + j*row_stride + k*col_stride]; }
+	FP_VAR* Column(int j, int k) { return data + j*row_stride + k*col_stride; }	// voxel (0,j,k), slices are SliceStride() apart
+
+	size_t SliceStride() { return slice_stride; }
+	size_t RowStride() { return row_stride; }
+	size_t ColStride() { return col_stride; }
+
+	FP_VAR* Data() { return data; }
+	size_t Size() { return (size_t)slices * rows * cols; }
+	axis_order GetOrder() { return order; }
+
+	void Zero();
+
+	// reads/writes raw voxels in slice, row, col order regardless of the memory layout
+	void Read(istream& f);
+	void Write(ostream& f);
+
+private:
+	int slices;
+	int rows;
+	int cols;
+	axis_order order;
+
+	size_t slice_stride;
+	size_t row_stride;
+	size_t col_stride;
+
+	FP_VAR* data;
+	bool large_pages;	// true if data came from VirtualAlloc/mmap rather than the aligned heap
+};
+
+Volume::Volume(int newSlices, int newRows, int newCols, axis_order newOrder, bool hugePages)
+:slices(newSlices), rows(newRows), cols(newCols), order(newOrder)
+{
+	size_t bytes = Size() * sizeof(FP_VAR);
+
+	switch(order)
+	{
+	case ORDER_ROW_COL_SLICE:
+		slice_stride = 1;
+		col_stride = slices;
+		row_stride = (size_t)cols * slices;
+		break;
+	default:
+		col_stride = 1;
+		row_stride = cols;
+		slice_stride = (size_t)rows * cols;
+		break;
+	}
+
+	data = NULL;
+	large_pages = false;
+
+	if(hugePages)
+	{
+#ifdef _WIN32
+		// needs SeLockMemoryPrivilege, fall back to normal pages if it isn't there
+		size_t page = GetLargePageMinimum();
+		if(page)
+		{
+			size_t len = (bytes + page - 1) / page * page;
+			data = (FP_VAR*)VirtualAlloc(NULL, len, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+		}
+#else
+		void* p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(p != MAP_FAILED)
+		{
+#ifdef MADV_HUGEPAGE
+			madvise(p, bytes, MADV_HUGEPAGE);
+#endif
+			data = (FP_VAR*)p;
+		}
+#endif
+		if(data)
+			large_pages = true;
+		else
+			cout << "Large pages not available, using normal pages." << endl;
+	}
+
+	if(!data)
+	{
+#ifdef _WIN32
+		data = (FP_VAR*)_aligned_malloc(bytes, 64);
+#else
+		void* p = NULL;
+		if(posix_memalign(&p, 64, bytes) == 0)
+			data = (FP_VAR*)p;
+#endif
+	}
+
+	if(!data)
+		cout << "Error: unable to allocate memory for reconstruction volume" << endl;
+	else
+		Zero();
+}
+
+Volume::~Volume()
+{
+	if(!data)
+		return;
+
+	if(large_pages)
+	{
+#ifdef _WIN32
+		VirtualFree(data, 0, MEM_RELEASE);
+#else
+		munmap(data, Size() * sizeof(FP_VAR));
+#endif
+	}
+	else
+	{
+#ifdef _WIN32
+		_aligned_free(data);
+#else
+		free(data);
+#endif
+	}
+}
+
+void Volume::Zero()
+{
+	memset(data, 0, Size() * sizeof(FP_VAR));
+}
+
+void Volume::Read(istream& f)
+{
+	int i,j,k;
+
+	if(order == ORDER_SLICE_ROW_COL)
+	{
+		f.read(reinterpret_cast<char*>(data), Size()*sizeof(FP_VAR));
+		return;
+	}
+
+	// read a slice at a time and scatter it into the columns
+	FP_VAR* slice = new FP_VAR[rows*cols];
+	for(i=0;i<slices;i++)
+	{
+		f.read(reinterpret_cast<char*>(slice), rows*cols*sizeof(FP_VAR));
+		for(j=0;j<rows;j++)
+			for(k=0;k<cols;k++)
+				(*this)(i,j,k) = slice[j*cols + k];
+	}
+	delete [] slice;
+}
+
+void Volume::Write(ostream& f)
+{
+	int i,j,k;
+
+	if(order == ORDER_SLICE_ROW_COL)
+	{
+		f.write(reinterpret_cast<char*>(data), Size()*sizeof(FP_VAR));
+		return;
+	}
+
+	FP_VAR* slice = new FP_VAR[rows*cols];
+	for(i=0;i<slices;i++)
+	{
+		for(j=0;j<rows;j++)
+			for(k=0;k<cols;k++)
+				slice[j*cols + k] = (*this)(i,j,k);
+		f.write(reinterpret_cast<char*>(slice), rows*cols*sizeof(FP_VAR));
+	}
+	delete [] slice;
+}
+
+#endif
@@ -75,6 +75,16 @@ int WINAPI wWinMain(HINSTANCE hInstance, HINSTANCE, LPWSTR lpCmdLine, int nCmdSh
 {
 	MainWindow win;
 
+	// beam hardening calibration next to the executable, if there is one
+	char calFile[MAX_PATH];
+	char* slash;
+	if(GetModuleFileNameA(NULL, calFile, MAX_PATH) && (slash = strrchr(calFile, '\\')))
+	{
+		strcpy_s(slash + 1, MAX_PATH - (slash + 1 - calFile), "bh_calibration.txt");
+		if(GetFileAttributesA(calFile) != INVALID_FILE_ATTRIBUTES)
+			LoadBHCalibration(calFile);
+	}
+
 	if(!win.Create(L"Cone-Beam CT Reconstruction", WS_OVERLAPPEDWINDOW | WS_EX_CONTROLPARENT))
 	{
 		return 0;
@@ -377,6 +387,7 @@ void MainWindow::CreateMainWindow()
 	SendMessage(m_hFilter, CB_ADDSTRING, 0, (LPARAM)L"Hamming");
 	SendMessage(m_hFilter, CB_ADDSTRING, 0, (LPARAM)L"Hann");
 	SendMessage(m_hFilter, CB_ADDSTRING, 0, (LPARAM)L"Cosine");
+	SendMessage(m_hFilter, CB_ADDSTRING, 0, (LPARAM)L"Blackman");
 	SendMessage(m_hFilter, CB_SETCURSEL, 0, NULL);
 
 	m_hCutoff = CreateWindowEx(0, 
@@ -542,6 +553,16 @@ BOOL MainWindow::OpenProjData()
 
 	WideCharToMultiByte(1251,WC_NO_BEST_FIT_CHARS,szDisplayName,MAX_PATH,projFolder,sizeof(projFolder),0,NULL);
 	m_Proj = new Projection(projFolder);
+
+	// reconstructing the same scan again reuses its filtered projections. The temp directory
+	// isn't cleaned up by itself, so only the newest 4 GB of them are kept.
+	char cacheDir[MAX_PATH];
+	if(GetTempPathA(MAX_PATH, cacheDir))
+		m_Proj->SetSinogramCacheDir(cacheDir, 4096);
+
+	// and metal removal doesn't read the projections a second time if they fit in memory
+	m_Proj->SetStackBudget(-1);
+
 	SendMessage(m_hProgress,PBM_SETRANGE,MAKEWPARAM(0,0),MAKELPARAM(0,m_Proj->GetNumProj()));
 
 	return TRUE;